@@ -12,8 +12,9 @@ int main(int argc, char** argv){
      int query_interval = 50000;
      int emb_dim = 1024;
      std::string query_directory = "";
+     bool warmup = false;
 
-     while ((opt = getopt(argc, argv, "n:b:q:i:e:")) != -1) {
+     while ((opt = getopt(argc, argv, "n:b:q:i:e:w")) != -1) {
           switch (opt) {
                case 'n':
                     num_queries = std::atoi(optarg);  // Convert the argument to an integer
@@ -30,8 +31,11 @@ int main(int argc, char** argv){
                case 'e':
                     emb_dim = std::atoi(optarg);
                     break;
+               case 'w':
+                    warmup = true;
+                    break;
                case '?': // Unknown option or missing option argument
-                    std::cerr << "Usage: " << argv[0] << " -n <number_of_queries> -b <batch_size> -q <query_data_dir> -i <interval> -e <emb_dim>" << std::endl;
+                    std::cerr << "Usage: " << argv[0] << " -n <number_of_queries> -b <batch_size> -q <query_data_dir> -i <interval> -e <emb_dim> [-w]" << std::endl;
                     return 1;
                default:
                     break;
@@ -39,7 +43,7 @@ int main(int argc, char** argv){
      }
      if (num_queries == 0 || batch_size == 0 || query_directory.empty()) {
           std::cerr << "Error: Missing required options." << std::endl;
-          std::cerr << "Usage: " << argv[0] << " -n <number_of_queries> -b <batch_size> -q <query_dir.csv> -i <interval> -e <emb_dim>" << std::endl;
+          std::cerr << "Usage: " << argv[0] << " -n <number_of_queries> -b <batch_size> -q <query_dir.csv> -i <interval> -e <emb_dim> [-w]" << std::endl;
           return 1;
      }
      if (batch_size > MAX_NUM_EMB_PER_OBJ) {
@@ -60,6 +64,9 @@ int main(int argc, char** argv){
           std::cerr << "Error: failed to establish connections to all servers." << std::endl;
           return 1;
      }
+     if (warmup) {
+          perf_client.warmup(capi, num_shards);
+     }
      // 2. Run perf test
      perf_client.run_perf_test(capi, query_directory);
 
@@ -0,0 +1,192 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <set>
+#include <string>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+#include <faiss/IndexFlat.h>
+#include <faiss/utils/distances.h>
+#include "../vortex_udls/hierarchical_index.hpp"
+#include "../vortex_udls/simd_flat_search.hpp"
+
+/***
+* Checks of the built-in search kernels against a faiss::IndexFlatL2 reference, on random embeddings:
+* the SIMD flat search (query by query and tile by tile) must return the exact top_k, for the specialized and generic
+* embedding dimensions, and the hierarchical index must return it too when its beam covers every node.
+* The recall of the hierarchical index with smaller beams is reported, not checked.
+***/
+
+namespace {
+
+/***
+* Compare a top_k result to the reference: up to ties, the i-th distance must be the reference i-th distance,
+* the ids must be distinct embeddings at that distance, and the missing results must be -1
+***/
+bool check_top_k(const std::string& name, const float* xb, int64_t num_embs, int emb_dim, int nq, const float* xq, int top_k,
+                 const float* D_ref, const long* I_ref, const float* D, const long* I) {
+     int num_errors = 0;
+     int64_t num_valid = std::min<int64_t>(top_k, num_embs);
+     for (int q = 0; q < nq && num_errors < 5; q++) {
+          const float* query = xq + static_cast<size_t>(q) * emb_dim;
+          std::set<long> ids;
+          for (int j = 0; j < top_k; j++) {
+               size_t r = static_cast<size_t>(q) * top_k + j;
+               if (j >= num_valid) {
+                    if (I[r] != -1 || I_ref[r] != -1) {
+                         std::cerr << name << ": query " << q << " rank " << j << " should be empty, got " << I[r] << std::endl;
+                         num_errors++;
+                    }
+                    continue;
+               }
+               float tolerance = 1e-3f * (1.0f + std::abs(D_ref[r]));
+               if (I[r] < 0 || I[r] >= num_embs || !ids.insert(I[r]).second) {
+                    std::cerr << name << ": query " << q << " rank " << j << " has an invalid or repeated id " << I[r] << std::endl;
+                    num_errors++;
+                    continue;
+               }
+               float exact = faiss::fvec_L2sqr(query, xb + static_cast<size_t>(I[r]) * emb_dim, emb_dim);
+               if (std::abs(D[r] - exact) > tolerance || std::abs(D[r] - D_ref[r]) > tolerance) {
+                    std::cerr << name << ": query " << q << " rank " << j << " id " << I[r] << " distance " << D[r]
+                              << ", exact " << exact << ", reference " << D_ref[r] << " (id " << I_ref[r] << ")" << std::endl;
+                    num_errors++;
+               }
+          }
+     }
+     std::cout << name << ": " << (num_errors == 0 ? "ok" : "FAILED") << std::endl;
+     return num_errors == 0;
+}
+
+/*** fraction of the reference top_k ids that are found ***/
+double recall(int nq, int top_k, const long* I_ref, const long* I) {
+     int64_t found = 0;
+     int64_t total = 0;
+     for (int q = 0; q < nq; q++) {
+          std::set<long> ids(I + static_cast<size_t>(q) * top_k, I + static_cast<size_t>(q + 1) * top_k);
+          for (int j = 0; j < top_k; j++) {
+               long id = I_ref[static_cast<size_t>(q) * top_k + j];
+               if (id >= 0) {
+                    total++;
+                    found += ids.count(id);
+               }
+          }
+     }
+     return total == 0 ? 1.0 : static_cast<double>(found) / total;
+}
+
+/*** embeddings around num_centers random centers, so that the k-means levels of the hierarchical index are meaningful ***/
+std::vector<float> clustered_embeddings(std::mt19937_64& rng, int64_t num, int emb_dim, const std::vector<float>& centers) {
+     std::normal_distribution<float> noise(0.0f, 1.0f);
+     int64_t num_centers = static_cast<int64_t>(centers.size()) / emb_dim;
+     std::vector<float> embs(static_cast<size_t>(num) * emb_dim);
+     for (int64_t i = 0; i < num; i++) {
+          int64_t c = static_cast<int64_t>(rng() % num_centers);
+          for (int d = 0; d < emb_dim; d++) {
+               embs[i * emb_dim + d] = centers[c * emb_dim + d] + noise(rng);
+          }
+     }
+     return embs;
+}
+
+bool run_checks(int64_t num_embs, int emb_dim, int nq, int top_k, int fanout, uint64_t seed) {
+     std::mt19937_64 rng(seed);
+     std::normal_distribution<float> spread(0.0f, 4.0f);
+     std::vector<float> centers(static_cast<size_t>(32) * emb_dim);
+     for (auto& value : centers) {
+          value = spread(rng);
+     }
+     std::vector<float> xb = clustered_embeddings(rng, num_embs, emb_dim, centers);
+     std::vector<float> xq = clustered_embeddings(rng, nq, emb_dim, centers);
+     std::string config = "emb_dim=" + std::to_string(emb_dim) + " num_embs=" + std::to_string(num_embs);
+
+     faiss::IndexFlatL2 reference(emb_dim);
+     reference.add(num_embs, xb.data());
+     std::vector<float> D_ref(static_cast<size_t>(nq) * top_k);
+     std::vector<long> I_ref(static_cast<size_t>(nq) * top_k);
+     reference.search(nq, xq.data(), top_k, D_ref.data(), I_ref.data());
+
+     bool ok = true;
+     std::vector<float> D(D_ref.size());
+     std::vector<long> I(I_ref.size());
+     simd_flat_l2_search(xb.data(), nullptr, num_embs, emb_dim, nq, xq.data(), top_k, D.data(), I.data());
+     ok &= check_top_k("simd flat, by query, " + config, xb.data(), num_embs, emb_dim, nq, xq.data(), top_k,
+                       D_ref.data(), I_ref.data(), D.data(), I.data());
+
+     std::vector<float> norms(num_embs);
+     simd_l2_norms(xb.data(), num_embs, emb_dim, norms.data());
+     simd_flat_l2_search(xb.data(), norms.data(), num_embs, emb_dim, nq, xq.data(), top_k, D.data(), I.data());
+     ok &= check_top_k("simd flat, tiled, " + config, xb.data(), num_embs, emb_dim, nq, xq.data(), top_k,
+                       D_ref.data(), I_ref.data(), D.data(), I.data());
+
+     // the tree over two blocks, as the segments of a group split into several objects
+     HierarchicalFlatIndex tree;
+     int64_t first_block = num_embs / 3;
+     tree.build({{xb.data(), first_block}, {xb.data() + first_block * emb_dim, num_embs - first_block}}, emb_dim, fanout);
+     std::vector<int> full_beam = {static_cast<int>(std::max<int64_t>(1, num_embs))};
+     tree.search(nq, xq.data(), top_k, full_beam, D.data(), I.data());
+     ok &= check_top_k("hierarchical, full beam, " + config, xb.data(), num_embs, emb_dim, nq, xq.data(), top_k,
+                       D_ref.data(), I_ref.data(), D.data(), I.data());
+     for (int beam_width : {1, 4, 8, 32}) {
+          tree.search(nq, xq.data(), top_k, {beam_width}, D.data(), I.data());
+          std::cout << "hierarchical, beam " << beam_width << ", " << config << ", levels=" << tree.num_levels()
+                    << ": recall " << recall(nq, top_k, I_ref.data(), I.data()) << std::endl;
+     }
+     return ok;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+     int opt;
+     int64_t num_embs = 5000;
+     int nq = 32;
+     int top_k = 10;
+     int fanout = 16;
+     uint64_t seed = 42;
+
+     while ((opt = getopt(argc, argv, "n:q:k:f:s:")) != -1) {
+          switch (opt) {
+               case 'n':
+                    num_embs = std::atoll(optarg);
+                    break;
+               case 'q':
+                    nq = std::atoi(optarg);
+                    break;
+               case 'k':
+                    top_k = std::atoi(optarg);
+                    break;
+               case 'f':
+                    fanout = std::atoi(optarg);
+                    break;
+               case 's':
+                    seed = std::strtoull(optarg, nullptr, 10);
+                    break;
+               case '?': // Unknown option or missing option argument
+                    std::cerr << "Usage: " << argv[0] << " [-n <num_embs>] [-q <num_queries>] [-k <top_k>] [-f <tree_fanout>] [-s <seed>]" << std::endl;
+                    return 1;
+               default:
+                    break;
+          }
+     }
+     if (num_embs <= 0 || nq <= 0 || top_k <= 0 || fanout < 2) {
+          std::cerr << "Error: num_embs, num_queries and top_k must be positive, and tree_fanout at least 2." << std::endl;
+          return 1;
+     }
+     std::cout << "SIMD flat search kernels: " << simd_flat_l2_kernel_name() << std::endl;
+     bool ok = true;
+     // the specialized dimensions, and a generic one
+     for (int emb_dim : {128, 384, 768, 1024, 100}) {
+          ok &= run_checks(num_embs, emb_dim, nq, top_k, fanout, seed);
+     }
+     // fewer embeddings than top_k: the missing results are -1
+     ok &= run_checks(std::max(1, top_k / 2), 128, nq, top_k, fanout, seed);
+     if (!ok) {
+          std::cerr << "Error: some search results do not match the faiss::IndexFlatL2 reference." << std::endl;
+          return 1;
+     }
+     std::cout << "All search checks passed." << std::endl;
+     return 0;
+}
@@ -0,0 +1,275 @@
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "../vortex_udls/cluster_lru.hpp"
+#include "../vortex_udls/inflight_query_table.hpp"
+#include "../vortex_udls/query_result_cache.hpp"
+#include "../vortex_udls/rag_utils.hpp"
+#include "../vortex_udls/semantic_query_cache.hpp"
+#include "../vortex_udls/search_worker.hpp"
+#include "../vortex_udls/wire_format.hpp"
+
+/***
+* Checks of the bookkeeping structures of the UDLs, outside of Cascade:
+* the cluster LRU of the clusters search UDL, the result cache of a cluster, the semantic query cache and the in-flight
+* query table of the centroids search UDL, and the batch deadline of the search worker pool, which must flush a small batch while other clusters
+* keep the workers busy.
+***/
+
+using namespace derecho::cascade;
+
+namespace {
+
+int num_failures = 0;
+
+void expect(bool condition, const std::string& what) {
+     if (!condition) {
+          std::cerr << "FAILED: " << what << std::endl;
+          num_failures++;
+     }
+}
+
+void check_cluster_lru() {
+     ClusterLRU lru;
+     for (int cluster_id : {0, 1, 2, 3}) {
+          lru.touch(cluster_id);
+     }
+     lru.touch(0); // recency order, least recent first: 1, 2, 3, 0
+     auto all_evictable = [](int cluster_id, int64_t& memory_bytes) {
+          memory_bytes = 10;
+          return true;
+     };
+     expect(lru.select_victims(25, all_evictable) == std::vector<int>({1, 2, 3}), "cluster LRU: victims are the least recently queried, until enough bytes are freed");
+     expect(lru.select_victims(0, all_evictable).empty(), "cluster LRU: no victim when nothing is to free");
+     auto skip_two = [](int cluster_id, int64_t& memory_bytes) {
+          memory_bytes = 10;
+          return cluster_id != 2;
+     };
+     expect(lru.select_victims(20, skip_two) == std::vector<int>({1, 3}), "cluster LRU: clusters that cannot be evicted are skipped");
+     expect(lru.select_victims(1000, all_evictable).size() == 4, "cluster LRU: every cluster is a victim when not enough bytes can be freed");
+     lru.erase(1);
+     lru.erase(7);
+     expect(lru.size() == 3, "cluster LRU: erase removes only tracked clusters");
+     expect(lru.select_victims(10, all_evictable) == std::vector<int>({2}), "cluster LRU: an erased cluster is not a victim");
+     lru.touch(1);
+     expect(lru.select_victims(40, all_evictable) == std::vector<int>({2, 3, 0, 1}), "cluster LRU: a touched cluster is tracked again as the most recent");
+}
+
+void check_query_result_cache() {
+     const int emb_dim = 4;
+     const int top_k = 2;
+     QueryResultCache cache(2, emb_dim);
+     float embs[3][emb_dim] = {{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}};
+     long ids[3][top_k] = {{10, 11}, {20, 21}, {30, 31}};
+     float dists[3][top_k] = {{0.1f, 0.2f}, {1.1f, 1.2f}, {2.1f, 2.2f}};
+     long I[top_k];
+     float D[top_k];
+
+     expect(!cache.lookup(1, embs[0], top_k, I, D), "result cache: empty cache misses");
+     cache.insert(1, embs[0], top_k, ids[0], dists[0]);
+     cache.insert(2, embs[1], top_k, ids[1], dists[1]);
+     expect(cache.lookup(1, embs[0], top_k, I, D) && I[0] == 10 && I[1] == 11 && D[1] == 0.2f, "result cache: hit returns the cached results");
+     expect(!cache.lookup(1, embs[0], top_k + 1, I, D), "result cache: results cached for another top_k miss");
+     expect(!cache.lookup(1, embs[2], top_k, I, D), "result cache: another embedding with the same hash misses");
+     // 1 was used last, so 2 is evicted
+     cache.insert(3, embs[2], top_k, ids[2], dists[2]);
+     expect(cache.size() == 2, "result cache: size is bounded by its capacity");
+     expect(!cache.lookup(2, embs[1], top_k, I, D), "result cache: the least recently used entry is evicted");
+     expect(cache.lookup(1, embs[0], top_k, I, D), "result cache: a recently used entry is kept");
+     expect(cache.lookup(3, embs[2], top_k, I, D) && I[0] == 30, "result cache: the new entry is cached");
+     // an entry with the same hash is replaced, even for another embedding
+     cache.insert(3, embs[1], top_k, ids[1], dists[1]);
+     expect(!cache.lookup(3, embs[2], top_k, I, D) && cache.lookup(3, embs[1], top_k, I, D) && I[0] == 20,
+            "result cache: insert replaces the entry with the same hash");
+     cache.clear();
+     expect(cache.size() == 0 && !cache.lookup(1, embs[0], top_k, I, D), "result cache: clear drops every entry");
+
+     QueryResultCache disabled(0, emb_dim);
+     disabled.insert(1, embs[0], top_k, ids[0], dists[0]);
+     expect(disabled.size() == 0, "result cache: a cache of capacity 0 caches nothing");
+}
+
+void check_semantic_query_cache() {
+     const int emb_dim = 384;
+     const int nq = 16;
+     SemanticQueryCache cache(emb_dim, nq, 0.0f);
+     std::mt19937 rng(7);
+     std::normal_distribution<float> value(0.0f, 1.0f);
+     std::vector<float> xq(static_cast<size_t>(nq) * emb_dim);
+     for (auto& x : xq) {
+          x = value(rng);
+     }
+     std::vector<std::string> hit_results;
+     expect(cache.lookup(nq, xq.data(), hit_results) == 0, "semantic cache: empty cache misses");
+     expect(!cache.fill(0, "q0", "r0"), "semantic cache: a query that is not pending is not cached");
+     for (int i = 0; i < nq; i++) {
+          cache.add_pending(i, xq.data() + static_cast<size_t>(i) * emb_dim);
+          expect(cache.fill(i, "q" + std::to_string(i), "r" + std::to_string(i)), "semantic cache: a pending query is cached");
+     }
+     // with threshold 0, an exact duplicate hits whether it is looked up alone or with other queries
+     expect(cache.lookup(1, xq.data(), hit_results) == 1 && hit_results[0] == "r0", "semantic cache: an exact duplicate looked up alone hits");
+     bool all_hit = (cache.lookup(nq, xq.data(), hit_results) == nq);
+     for (int i = 0; i < nq && all_hit; i++) {
+          all_hit = (hit_results[i] == "r" + std::to_string(i));
+     }
+     expect(all_hit, "semantic cache: exact duplicates looked up in a batch hit");
+     std::vector<float> near(xq.begin(), xq.begin() + emb_dim);
+     near[0] += 0.01f;
+     expect(cache.lookup(1, near.data(), hit_results) == 0, "semantic cache: another embedding misses with threshold 0");
+}
+
+void check_inflight_query_table() {
+     const int64_t timeout_us = 1000;
+     InFlightQueryTable table(timeout_us);
+     int64_t now_us = 1000000;
+
+     expect(table.dispatch_or_wait("what is rag", 7, 1, 1, 100, now_us), "in-flight table: the first query is dispatched");
+     expect(!table.dispatch_or_wait("what is rag", 7, 2, 5, 200, now_us + 10), "in-flight table: an identical query waits");
+     expect(!table.dispatch_or_wait("what is rag", 7, 3, 6, 300, now_us + 20), "in-flight table: a second identical query waits");
+     expect(table.dispatch_or_wait("what is rag", 8, 4, 7, 400, now_us + 30), "in-flight table: the same text with another embedding is dispatched");
+     expect(table.dispatch_or_wait("what is cascade", 7, 1, 1, 101, now_us + 40), "in-flight table: another text is dispatched");
+     expect(table.size() == 2, "in-flight table: one entry per in-flight text");
+
+     std::vector<InFlightQueryTable::Waiter> waiters = table.complete(100);
+     expect(waiters.size() == 2 && waiters[0].client_id == 2 && waiters[0].query_id == 200 &&
+            waiters[1].client_id == 3 && waiters[1].query_batch_id == 6, "in-flight table: completion returns the waiters in order");
+     expect(table.complete(100).empty(), "in-flight table: a query completes once");
+     expect(table.complete(400).empty(), "in-flight table: a query dispatched next to an in-flight one is not tracked");
+
+     // the result of the first dispatch is lost: the next duplicate after the timeout is dispatched again, and keeps the waiters
+     now_us += 10000;
+     expect(table.dispatch_or_wait("what is rag", 7, 1, 2, 500, now_us), "in-flight table: a new query is dispatched");
+     expect(!table.dispatch_or_wait("what is rag", 7, 2, 2, 600, now_us + 10), "in-flight table: its duplicate waits");
+     expect(table.dispatch_or_wait("what is rag", 7, 3, 2, 700, now_us + timeout_us + 20), "in-flight table: a duplicate after the timeout is dispatched again");
+     expect(!table.dispatch_or_wait("what is rag", 7, 4, 2, 800, now_us + timeout_us + 30), "in-flight table: a duplicate of the redispatched query waits");
+     waiters = table.complete(500);
+     expect(waiters.size() == 2 && waiters[0].query_id == 600 && waiters[1].query_id == 800,
+            "in-flight table: the late result of the first dispatch completes every waiter");
+     expect(table.complete(700).empty(), "in-flight table: the result of the redispatch does not complete it again");
+
+     // the queries whose result did not come back within the timeout are removed with their query ids,
+     // and their waiters are returned to be answered with an error
+     now_us += 100000;
+     std::vector<std::pair<std::string, InFlightQueryTable::Waiter>> expired_waiters;
+     table.expire(now_us, expired_waiters);
+     expect(expired_waiters.empty() && table.size() == 0 && table.num_query_ids() == 0, "in-flight table: an expired query without waiters is removed with its query ids");
+     expect(table.dispatch_or_wait("what is vortex", 9, 1, 3, 900, now_us + 900), "in-flight table: a query after a long pause is dispatched");
+     expect(!table.dispatch_or_wait("what is vortex", 9, 2, 3, 901, now_us + 910), "in-flight table: its duplicate waits");
+     table.expire(now_us + timeout_us, expired_waiters);
+     expect(expired_waiters.empty() && table.size() == 1, "in-flight table: a query is not expired before its timeout");
+     table.expire(now_us + 2 * timeout_us + 10, expired_waiters);
+     expect(expired_waiters.size() == 1 && expired_waiters[0].first == "what is vortex" && expired_waiters[0].second.query_id == 901,
+            "in-flight table: the waiters of an expired query are returned");
+     expect(table.size() == 0 && table.num_query_ids() == 0, "in-flight table: nothing is left once every query completed or expired");
+     expect(table.complete(900).empty(), "in-flight table: the late result of an expired query is ignored");
+}
+
+/***
+* One worker, busy with full batches of clusters 1..num_busy_clusters, while a single query waits in cluster 0:
+* cluster 0 must be searched around its deadline, not once the busy clusters run out of queries.
+***/
+void check_batch_deadline_under_load(int emb_dim, int num_busy_clusters, int64_t max_batch_wait_us, int64_t slack_us) {
+     const int max_batch_size = 4;
+     const int num_embs = 64;
+     std::unordered_map<int, std::shared_ptr<GroupedEmbeddingsForSearch>> cluster_search_index;
+     std::shared_mutex cluster_search_index_map_mutex;
+     for (int cluster_id = 0; cluster_id <= num_busy_clusters; cluster_id++) {
+          float* data = new float[static_cast<size_t>(num_embs) * emb_dim];
+          for (int i = 0; i < num_embs * emb_dim; i++) {
+               data[i] = static_cast<float>((i * 31 + cluster_id * 7) % 101) / 101.0f;
+          }
+          auto cluster_index = std::make_shared<GroupedEmbeddingsForSearch>(emb_dim, num_embs, data);
+          cluster_index->initialize_groupped_embeddings_for_search();
+          cluster_index->set_max_pending_queries(max_batch_size);
+          cluster_search_index[cluster_id] = std::move(cluster_index);
+     }
+
+     std::atomic<int64_t> deadline_result_us = 0;
+     std::atomic<int64_t> num_load_results = 0;
+     ClusterSearchWorkerPool pool(2, cluster_search_index, cluster_search_index_map_mutex, max_batch_size, max_batch_wait_us,
+                                  ClusterSchedulingPolicy::ROUND_ROBIN,
+                                  [&](const ObjectWithStringKey& obj) {
+                                       // a slow put, so that the worker is never idle while the load lasts
+                                       std::this_thread::sleep_for(std::chrono::microseconds(200));
+                                       if (obj.key.find("_cluster0_qid") != std::string::npos) {
+                                            deadline_result_us = steady_clock_now_us();
+                                       } else {
+                                            num_load_results++;
+                                       }
+                                  });
+     pool.start(1);
+
+     std::vector<float> query(emb_dim, 0.5f);
+     QueryBatchWriter writer(max_batch_size, emb_dim, max_batch_size * 4);
+     for (int i = 0; i < max_batch_size; i++) {
+          writer.add(make_query_id(0, static_cast<uint32_t>(i)), query.data(), "load");
+     }
+     std::string query_bytes = writer.take();
+     QueryBatchView query_batch;
+     query_batch.parse(reinterpret_cast<const uint8_t*>(query_bytes.data()), query_bytes.size(), emb_dim);
+     auto add_queries = [&](int cluster_id, int nq, const std::string& key_string) {
+          GroupedEmbeddingsForSearch* cluster_index = cluster_search_index.at(cluster_id).get();
+          std::vector<uint32_t> query_indices(nq);
+          for (int i = 0; i < nq; i++) {
+               query_indices[i] = i;
+          }
+          bool started_batch = cluster_index->add_queries(query_batch, query_indices, key_string);
+          pool.notify_queries_added(cluster_id, cluster_index, started_batch);
+     };
+
+     std::atomic<bool> loading = true;
+     std::thread producer([&]() {
+          while (loading) {
+               // waits while the batch of a cluster is full, i.e. until the worker takes it
+               for (int cluster_id = 1; cluster_id <= num_busy_clusters && loading; cluster_id++) {
+                    add_queries(cluster_id, max_batch_size, "client0_qb0_cluster" + std::to_string(cluster_id));
+               }
+          }
+     });
+
+     // let the load build up, then send the single query
+     std::this_thread::sleep_for(std::chrono::milliseconds(20));
+     int64_t load_results_before = num_load_results;
+     int64_t sent_us = steady_clock_now_us();
+     add_queries(0, 1, "client0_qb1_cluster0");
+
+     int64_t wait_limit_us = max_batch_wait_us + slack_us;
+     while (deadline_result_us == 0 && steady_clock_now_us() - sent_us < 4 * wait_limit_us) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(1));
+     }
+     int64_t load_results_during = num_load_results - load_results_before;
+     loading = false;
+     producer.join();
+     pool.stop();
+
+     int64_t latency_us = deadline_result_us == 0 ? -1 : deadline_result_us - sent_us;
+     std::cout << "batch deadline under load: " << num_busy_clusters << " busy clusters, max_batch_wait_us=" << max_batch_wait_us
+               << ", single query answered after " << latency_us << " us, " << load_results_during << " results of the load meanwhile" << std::endl;
+     expect(load_results_during > 0, "batch deadline: the busy clusters kept the worker busy");
+     expect(latency_us >= max_batch_wait_us, "batch deadline: a batch smaller than max_batch_size waits for its deadline");
+     expect(latency_us >= 0 && latency_us <= wait_limit_us, "batch deadline: the batch is flushed at its deadline while the worker is busy");
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+     check_cluster_lru();
+     check_query_result_cache();
+     check_semantic_query_cache();
+     check_inflight_query_table();
+     check_batch_deadline_under_load(128, 8, 5000, 50000);
+     if (num_failures > 0) {
+          std::cerr << num_failures << " UDL checks failed." << std::endl;
+          return 1;
+     }
+     std::cout << "All UDL checks passed." << std::endl;
+     return 0;
+}
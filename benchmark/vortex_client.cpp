@@ -65,23 +65,20 @@ int VortexPerfClient::read_query_embs(std::string query_emb_directory, std::uniq
      return num_query_collected;
 }
 
-std::string VortexPerfClient::format_query_emb_object(int nq, std::unique_ptr<float[]>& xq, std::vector<std::string>& query_list) {
-     // create an bytes object by concatenating: num_queries + float array of emebddings + list of query_text
-     uint32_t num_queries = static_cast<uint32_t>(nq);
-     std::string nq_bytes(4, '\0');
-     nq_bytes[0] = (num_queries >> 24) & 0xFF;
-     nq_bytes[1] = (num_queries >> 16) & 0xFF;
-     nq_bytes[2] = (num_queries >> 8) & 0xFF;
-     nq_bytes[3] = num_queries & 0xFF;
-     float* query_embeddings = xq.get();
-     // serialize the query embeddings and query texts, formated as num_queries + query_embeddings + query_texts
-     std::string query_emb_string = nq_bytes +
-                              std::string(reinterpret_cast<const char*>(query_embeddings), sizeof(float) * this->embedding_dim * num_queries) +
-                              nlohmann::json(query_list).dump();
-     return query_emb_string;
+std::string VortexPerfClient::format_query_emb_object(int nq, std::unique_ptr<float[]>& xq, const std::vector<uint64_t>& query_ids, std::vector<std::string>& query_list) {
+     // create a query batch object (see wire_format.hpp), written in place in a buffer of its final size
+     size_t total_text_size = 0;
+     for (int i = 0; i < nq; i++) {
+          total_text_size += query_list[i].size();
+     }
+     QueryBatchWriter writer(static_cast<uint32_t>(nq), this->embedding_dim, total_text_size);
+     for (int i = 0; i < nq; i++) {
+          writer.add(query_ids[i], xq.get() + static_cast<size_t>(i) * this->embedding_dim, query_list[i]);
+     }
+     return writer.take();
 }
 
-bool VortexPerfClient::deserialize_result(const Blob& blob, std::string& query_text, std::vector<std::string>& top_k_docs,uint32_t& query_batch_id) {
+bool VortexPerfClient::deserialize_result(const Blob& blob, std::string& query_text, std::vector<std::string>& top_k_docs,uint32_t& query_batch_id, uint64_t& query_id) {
      if (blob.size == 0) {
           std::cerr << "Error: empty result blob." << std::endl;
           return false;
@@ -91,13 +88,18 @@ bool VortexPerfClient::deserialize_result(const Blob& blob, std::string& query_t
      std::string json_string(json_data, json_size);
      try{
           nlohmann::json parsed_json = nlohmann::json::parse(json_string);
-          if (parsed_json.count("query") == 0 || parsed_json.count("top_k_docs") == 0) {
-               std::cerr << "Result JSON does not contain query or top_k_docs." << std::endl;
+          if (parsed_json.count("query") == 0 || parsed_json.count("top_k_docs") == 0 || parsed_json.count("query_id") == 0) {
+               std::cerr << "Result JSON does not contain query, top_k_docs or query_id." << std::endl;
                return false;
           }
           query_text = parsed_json["query"];
           top_k_docs = parsed_json["top_k_docs"];
           query_batch_id = parsed_json["query_batch_id"];
+          query_id = parsed_json["query_id"];
+          if (parsed_json.count("error") > 0) {
+               // answered without docs, e.g. a coalesced query whose in-flight query got no result
+               std::cerr << "Error: result of query " << query_id << ": " << parsed_json["error"].get<std::string>() << std::endl;
+          }
 
      } catch (const nlohmann::json::parse_error& e) {
           std::cerr << "Result JSON parse error: " << e.what() << std::endl;
@@ -120,25 +122,21 @@ int VortexPerfClient::register_notification_on_all_servers(ServiceClientAPI& cap
                     std::string query_text;
                     std::vector<std::string> top_k_docs;
                     uint32_t query_batch_id;
-                    if (!deserialize_result(result, query_text, top_k_docs, query_batch_id)) {
+                    uint64_t query_id;
+                    if (!deserialize_result(result, query_text, top_k_docs, query_batch_id, query_id)) {
                          std::cerr << "Error: failed to deserialize the result from the notification." << std::endl;
                          return false;
                     }
                     if (this->query_results.find(query_text) == this->query_results.end()) {
                          this->query_results[query_text] = top_k_docs;
                     }
-                    if (this->sent_queries.find(query_text) != this->sent_queries.end()) {
-                         uint32_t batch_id = query_batch_id / QUERY_BATCH_ID_MODULUS;
-                         uint32_t q_id = query_batch_id % QUERY_BATCH_ID_MODULUS;
+                    std::lock_guard<std::mutex> lock(this->sent_queries_mutex);
+                    if (this->sent_queries.erase(query_id) > 0) {
 #ifdef ENABLE_VORTEX_EVALUATION_LOGGING
-                         TimestampLogger::log(LOG_TAG_QUERIES_RESULT_CLIENT_RECEIVED,this->my_node_id,query_batch_id,q_id);
+                         // query_batch_id is the sequence number of the query, counted across the batches of batch_size queries
+                         uint32_t q_id = query_batch_id % this->batch_size;
+                         TimestampLogger::log(LOG_TAG_QUERIES_RESULT_CLIENT_RECEIVED,this->my_node_id,query_batch_id / this->batch_size,q_id);
 #endif
-                         // std::cout << "Received result for query: " << query_text << " from client: " << this->my_node_id << " batch_id: " << batch_id << " q_id: " << q_id << std::endl;
-                         // remove batch_id from this->sent_queries
-                         this->sent_queries[query_text].erase(std::remove(this->sent_queries[query_text].begin(), this->sent_queries[query_text].end(), batch_id), this->sent_queries[query_text].end());                        
-                         if (this->sent_queries[query_text].size() == 0) {
-                              this->sent_queries.erase(query_text);
-                         }
                     } else {
                          std::cerr << "Error: received result for query that is not sent." << std::endl;
                     }
@@ -204,16 +202,17 @@ bool VortexPerfClient::run_perf_test(ServiceClientAPI& capi, std::string& query_
           std::string key = "/rag/emb/centroids_search/client" + std::to_string(this->my_node_id) + "/qb" + std::to_string(batch_id);
           // 2.1. Prepare the query texts
           std::vector<std::string> cur_query_list;
-          std::vector<int> cur_query_ids;
+          std::vector<uint64_t> cur_query_ids;
           int qb_start_loc = batch_id * this->batch_size;
-          for (int j = 0; j < this->batch_size; ++j) {
-               int pos = (qb_start_loc + j) % num_query_collected;
-              cur_query_list.push_back(queries[pos]);
-              cur_query_ids.push_back(pos);
-              if (this->sent_queries.find(queries[pos]) == this->sent_queries.end()) {
-                   this->sent_queries[queries[pos]] = std::vector<uint32_t>();
-              }
-              this->sent_queries[queries[pos]].push_back((uint32_t)batch_id);
+          {
+               std::lock_guard<std::mutex> lock(this->sent_queries_mutex);
+               for (int j = 0; j < this->batch_size; ++j) {
+                    int pos = (qb_start_loc + j) % num_query_collected;
+                    uint64_t query_id = make_query_id(this->my_node_id, this->next_query_sequence++);
+                    cur_query_list.push_back(queries[pos]);
+                    cur_query_ids.push_back(query_id);
+                    this->sent_queries[query_id] = queries[pos];
+               }
           }
           // 2.2. Prepare query embeddings
           std::unique_ptr<float[]> query_embeddings(new float[this->embedding_dim * this->batch_size]);
@@ -224,7 +223,7 @@ bool VortexPerfClient::run_perf_test(ServiceClientAPI& capi, std::string& query_
                }
           }
           // 2.3. format the query 
-          std::string emb_query_string = format_query_emb_object(this->batch_size, query_embeddings, cur_query_list);
+          std::string emb_query_string = format_query_emb_object(this->batch_size, query_embeddings, cur_query_ids, cur_query_list);
           ObjectWithStringKey emb_query_obj;
           emb_query_obj.key = key;
           emb_query_obj.blob = Blob(reinterpret_cast<const uint8_t*>(emb_query_string.c_str()), emb_query_string.size());
@@ -255,24 +254,40 @@ bool VortexPerfClient::run_perf_test(ServiceClientAPI& capi, std::string& query_
      return true;
 }
 
-bool VortexPerfClient::flush_logs(ServiceClientAPI& capi, int num_shards){
-     std::string flush_log_key = "/rag/emb/centroids_search/flush_logs";
-     for (int i = 0; i < num_shards; i++){
-          ObjectWithStringKey obj;
-          std::string control_value = "flush";
-          obj.key = flush_log_key;
-          obj.blob = Blob(reinterpret_cast<const uint8_t*>(control_value.c_str()), control_value.size());
-          // TODO: 
-          auto res = capi.template put<VolatileCascadeStoreWithStringKey>(obj, VORTEX_SUBGROUP_INDEX, i, true);
-          for (auto& reply_future:res.get()) {
-               reply_future.second.get(); // wait for the object pool to be created
+bool VortexPerfClient::put_control_key(ServiceClientAPI& capi, int num_shards, const std::vector<std::string>& control_keys, const std::string& control_value){
+     for (const auto& control_key : control_keys) {
+          for (int i = 0; i < num_shards; i++){
+               ObjectWithStringKey obj;
+               obj.key = control_key;
+               obj.blob = Blob(reinterpret_cast<const uint8_t*>(control_value.c_str()), control_value.size());
+               // TODO: 
+               auto res = capi.template put<VolatileCascadeStoreWithStringKey>(obj, VORTEX_SUBGROUP_INDEX, i, true);
+               for (auto& reply_future:res.get()) {
+                    reply_future.second.get(); // wait for the object pool to be created
+               }
           }
      }
+     return true;
+}
+
+bool VortexPerfClient::flush_logs(ServiceClientAPI& capi, int num_shards){
+     // centroids_search flushes the timestamp logs, clusters_search flushes its queueing delay stats
+     std::vector<std::string> flush_log_keys = {"/rag/emb/centroids_search/flush_logs", "/rag/emb/clusters_search/flush_logs"};
+     put_control_key(capi, num_shards, flush_log_keys, "flush");
      std::cout << "Flushed logs to shards." << std::endl;
      TimestampLogger::flush("client_timestamp.dat");
      return true;
 }
 
+bool VortexPerfClient::warmup(ServiceClientAPI& capi, int num_shards){
+     // each UDL loads its data on a background thread, the queries sent before it finishes wait for the loading
+     std::vector<std::string> warmup_keys = {std::string("/rag/emb/centroids_search/") + WARMUP_CONTROL_KEY,
+                                             std::string("/rag/emb/clusters_search/") + WARMUP_CONTROL_KEY};
+     put_control_key(capi, num_shards, warmup_keys, "warmup");
+     std::cout << "Triggered warmup on shards." << std::endl;
+     return true;
+}
+
 std::vector<std::vector<std::string>> VortexPerfClient::read_groundtruth(std::filesystem::path filename) {
     std::vector<std::vector<std::string>> groundtruth_data;
     std::ifstream file(filename);
@@ -3,6 +3,7 @@
 #include <chrono>
 #include <filesystem> 
 #include <iostream>
+#include <mutex>
 #include <unistd.h>  
 #include <vector>
 #include "../vortex_udls/rag_utils.hpp"
@@ -32,11 +33,11 @@ class VortexPerfClient{
      int query_interval = 50000;
      int embedding_dim = 1024;
 
-     // Use vector since one query may be reuse for multiple times among different batches. 
-     // sent_queries: query_text -> batch_id
-     // Note, we are currently not handling the case if there are duplicated queries in the same batch. 
-     // TODO: this should be done at client side, here. To avoid send batch with duplication but keep track of it to return to the RESTFUL clients that have the same query.
-     std::unordered_map<std::string, std::vector<uint32_t>> sent_queries;
+     // sent_queries: query_id -> query_text, of the sent queries waiting for their result.
+     // Each query sent gets its own query id, made of this client id and a sequence number, even if its text was sent before.
+     std::unordered_map<uint64_t, std::string> sent_queries;
+     uint32_t next_query_sequence = 0; // sequence number of the next query id, only used by the sending thread
+     std::mutex sent_queries_mutex; // sent_queries is updated by the sending thread and the notification handler
      std::unordered_map<std::string, std::vector<std::string>> query_results; 
      std::atomic<bool> running;
      std::atomic<int> num_queries_to_send;
@@ -46,12 +47,12 @@ public:
 
      int read_queries(std::filesystem::path query_filepath, std::vector<std::string>& queries);
      int read_query_embs(std::string query_emb_directory, std::unique_ptr<float[]>& query_embs);
-     std::string format_query_emb_object(int nq, std::unique_ptr<float[]>& xq, std::vector<std::string>& query_list);
+     std::string format_query_emb_object(int nq, std::unique_ptr<float[]>& xq, const std::vector<uint64_t>& query_ids, std::vector<std::string>& query_list);
 
      /***
-     * Result JSON is in format of : {"query": query_text, "top_k_docs":[doc_text1, doc_text2, ...], "query_batch_id": query_batch_id}
+     * Result JSON is in format of : {"query": query_text, "top_k_docs":[doc_text1, doc_text2, ...], "query_batch_id": query_batch_id, "query_id": query_id}
      */
-     bool deserialize_result(const Blob& blob, std::string& query_text, std::vector<std::string>& top_k_docs,uint32_t& query_batch_id);
+     bool deserialize_result(const Blob& blob, std::string& query_text, std::vector<std::string>& top_k_docs,uint32_t& query_batch_id, uint64_t& query_id);
      
      /***
       * Register notification to all servers, helper function to run_perf_test
@@ -65,8 +66,19 @@ public:
       */
      bool run_perf_test(ServiceClientAPI& capi, std::string& query_directory);
 
+     /***
+      * Put a control key to the trigger paths on all shards, and wait for the puts to complete
+      */
+     bool put_control_key(ServiceClientAPI& capi, int num_shards, const std::vector<std::string>& control_keys, const std::string& control_value);
+
      bool flush_logs(ServiceClientAPI& capi, int num_shards);
 
+     /***
+      * Trigger the background warmup of the centroids and clusters search UDLs on all shards,
+      * so that the first queries do not pay for loading the embeddings
+      */
+     bool warmup(ServiceClientAPI& capi, int num_shards);
+
      std::vector<std::vector<std::string>> read_groundtruth(std::filesystem::path filename);
 
      bool compute_recall(ServiceClientAPI& capi, std::string& query_directory);
@@ -0,0 +1,557 @@
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include <nlohmann/json.hpp>
+#include "../vortex_udls/wire_format.hpp"
+
+/***
+* Benchmark of the wire formats of wire_format.hpp against the previous formats of the queries and cluster search results,
+* and of the shard bundles against one query batch per cluster,
+* and fuzzing of their validators: every mutated message must either be rejected, or be fully readable within its bytes.
+***/
+
+namespace {
+
+/*** Previous query format: | num_queries (big endian uint32) | query embeddings | query ids (uint64) | JSON list of query texts | ***/
+std::string legacy_serialize_queries(uint32_t nq, uint32_t emb_dim, const float* query_embeddings,
+                                     const uint64_t* query_ids, const std::vector<std::string>& query_list) {
+     std::string query_texts = nlohmann::json(query_list).dump();
+     size_t embs_size = sizeof(float) * emb_dim * nq;
+     size_t ids_size = sizeof(uint64_t) * nq;
+     std::string bytes(4 + embs_size + ids_size + query_texts.size(), '\0');
+     bytes[0] = (nq >> 24) & 0xFF;
+     bytes[1] = (nq >> 16) & 0xFF;
+     bytes[2] = (nq >> 8) & 0xFF;
+     bytes[3] = nq & 0xFF;
+     std::memcpy(bytes.data() + 4, query_embeddings, embs_size);
+     std::memcpy(bytes.data() + 4 + embs_size, query_ids, ids_size);
+     std::memcpy(bytes.data() + 4 + embs_size + ids_size, query_texts.data(), query_texts.size());
+     return bytes;
+}
+
+void legacy_deserialize_queries(const uint8_t* bytes, size_t data_size, uint32_t emb_dim, uint32_t& nq, const float*& query_embeddings,
+                                std::vector<uint64_t>& query_ids, std::vector<std::string>& query_list) {
+     nq = (static_cast<uint32_t>(bytes[0]) << 24) | (static_cast<uint32_t>(bytes[1]) << 16) |
+          (static_cast<uint32_t>(bytes[2]) << 8) | static_cast<uint32_t>(bytes[3]);
+     size_t embs_end = 4 + sizeof(float) * emb_dim * nq;
+     query_embeddings = reinterpret_cast<const float*>(bytes + 4);
+     query_ids.resize(nq);
+     std::memcpy(query_ids.data(), bytes + embs_end, sizeof(uint64_t) * nq);
+     size_t json_start = embs_end + sizeof(uint64_t) * nq;
+     std::string json_string(reinterpret_cast<const char*>(bytes + json_start), data_size - json_start);
+     query_list = nlohmann::json::parse(json_string).get<std::vector<std::string>>();
+}
+
+/*** Previous cluster search result format: | top_k (big endian uint32) | I | D | query_text | ***/
+std::string legacy_serialize_cluster_search_result(uint32_t top_k, const long* I, const float* D, const std::string& query_text) {
+     std::string num_embs(4, '\0');
+     num_embs[0] = (top_k >> 24) & 0xFF;
+     num_embs[1] = (top_k >> 16) & 0xFF;
+     num_embs[2] = (top_k >> 8) & 0xFF;
+     num_embs[3] = top_k & 0xFF;
+     return num_embs +
+            std::string(reinterpret_cast<const char*>(I), sizeof(long) * top_k) +
+            std::string(reinterpret_cast<const char*>(D), sizeof(float) * top_k) +
+            query_text;
+}
+
+struct LegacyDocIndex {
+     long emb_id;
+     float distance;
+};
+
+void legacy_deserialize_cluster_search_result(const uint8_t* bytes, size_t data_size, std::string& query_text,
+                                              std::vector<LegacyDocIndex>& cluster_results) {
+     uint32_t top_k = (static_cast<uint32_t>(bytes[0]) << 24) | (static_cast<uint32_t>(bytes[1]) << 16) |
+                      (static_cast<uint32_t>(bytes[2]) << 8) | static_cast<uint32_t>(bytes[3]);
+     const long* I = reinterpret_cast<const long*>(bytes + 4);
+     const float* D = reinterpret_cast<const float*>(bytes + 4 + sizeof(long) * top_k);
+     size_t text_start = 4 + (sizeof(long) + sizeof(float)) * top_k;
+     query_text = std::string(reinterpret_cast<const char*>(bytes + text_start), data_size - text_start);
+     for (uint32_t i = 0; i < top_k; i++) {
+          cluster_results.push_back(LegacyDocIndex{I[i], D[i]});
+     }
+}
+
+struct Queries {
+     uint32_t emb_dim;
+     std::vector<float> embs;
+     std::vector<uint64_t> ids;
+     std::vector<std::string> texts;
+};
+
+Queries make_queries(uint32_t nq, uint32_t emb_dim, std::mt19937_64& rng) {
+     Queries queries;
+     queries.emb_dim = emb_dim;
+     std::uniform_real_distribution<float> value(-1.0f, 1.0f);
+     std::uniform_int_distribution<int> text_size(0, 200);
+     std::uniform_int_distribution<int> text_char(32, 126); // printable ASCII, including the quotes and backslashes escaped in JSON
+     queries.embs.resize(static_cast<size_t>(nq) * emb_dim);
+     for (float& v : queries.embs) {
+          v = value(rng);
+     }
+     for (uint32_t i = 0; i < nq; i++) {
+          queries.ids.push_back(rng());
+          std::string text(text_size(rng), '\0');
+          for (char& c : text) {
+               c = static_cast<char>(text_char(rng));
+          }
+          queries.texts.push_back(std::move(text));
+     }
+     return queries;
+}
+
+std::string write_query_batch(const Queries& queries) {
+     uint32_t nq = static_cast<uint32_t>(queries.ids.size());
+     size_t total_text_size = 0;
+     for (const auto& text : queries.texts) {
+          total_text_size += text.size();
+     }
+     QueryBatchWriter writer(nq, queries.emb_dim, total_text_size);
+     for (uint32_t i = 0; i < nq; i++) {
+          writer.add(queries.ids[i], queries.embs.data() + static_cast<size_t>(i) * queries.emb_dim, queries.texts[i], i % 8);
+     }
+     return writer.take();
+}
+
+uint32_t count_query_indices(const std::vector<std::vector<uint32_t>>& cluster_query_indices) {
+     size_t total = 0;
+     for (const auto& indices : cluster_query_indices) {
+          total += indices.size();
+     }
+     return static_cast<uint32_t>(total);
+}
+
+void add_clusters(ClusterBundleWriter& writer, const std::vector<long>& cluster_ids, const std::vector<std::vector<uint32_t>>& cluster_query_indices) {
+     for (size_t c = 0; c < cluster_ids.size(); c++) {
+          writer.add_cluster(cluster_ids[c]);
+          for (uint32_t i : cluster_query_indices[c]) {
+               writer.add_query_index(i);
+          }
+     }
+}
+
+/*** Read every field of an accepted query batch, checking that it stays within the bytes; returns a checksum ***/
+uint64_t read_query_batch(const QueryBatchView& view, const uint8_t* bytes, size_t size, bool& in_bounds) {
+     uint64_t checksum = 0;
+     const char* begin = reinterpret_cast<const char*>(bytes);
+     for (uint32_t i = 0; i < view.size(); i++) {
+          checksum += view.query_id(i);
+          const float* emb = view.embedding(i);
+          for (uint32_t d = 0; d < view.get_emb_dim(); d++) {
+               checksum += static_cast<uint64_t>(emb[d] != 0.0f);
+          }
+          std::string_view text = view.query_text(i);
+          if (text.data() < begin || text.data() + text.size() > begin + size) {
+               in_bounds = false;
+          }
+          for (char c : text) {
+               checksum += static_cast<uint8_t>(c);
+          }
+     }
+     return checksum;
+}
+
+uint64_t read_cluster_search_result(const ClusterSearchResultView& view, const uint8_t* bytes, size_t size, bool& in_bounds) {
+     uint64_t checksum = view.get_query_id();
+     for (uint32_t i = 0; i < view.get_top_k(); i++) {
+          checksum += static_cast<uint64_t>(view.emb_index(i)) + static_cast<uint64_t>(view.distance(i) != 0.0f);
+     }
+     std::string_view text = view.query_text();
+     const char* begin = reinterpret_cast<const char*>(bytes);
+     if (text.data() < begin || text.data() + text.size() > begin + size) {
+          in_bounds = false;
+     }
+     return checksum + text.size();
+}
+
+template <typename Func>
+double time_per_iteration_us(int iterations, Func&& func) {
+     auto start = std::chrono::steady_clock::now();
+     for (int i = 0; i < iterations; i++) {
+          func();
+     }
+     auto end = std::chrono::steady_clock::now();
+     return std::chrono::duration<double, std::micro>(end - start).count() / iterations;
+}
+
+volatile uint64_t sink; // keeps the benchmarked work from being optimized out
+
+void run_benchmark(uint32_t nq, uint32_t emb_dim, uint32_t top_k, uint32_t clusters_per_shard, int iterations, std::mt19937_64& rng) {
+     Queries queries = make_queries(nq, emb_dim, rng);
+     std::string legacy_batch = legacy_serialize_queries(nq, emb_dim, queries.embs.data(), queries.ids.data(), queries.texts);
+     std::string batch = write_query_batch(queries);
+     // copy into float-aligned buffers, as the received Blobs are
+     std::vector<float> legacy_buffer(legacy_batch.size() / sizeof(float) + 1);
+     std::memcpy(legacy_buffer.data(), legacy_batch.data(), legacy_batch.size());
+     std::vector<float> buffer(batch.size() / sizeof(float) + 1);
+     std::memcpy(buffer.data(), batch.data(), batch.size());
+     const uint8_t* legacy_bytes = reinterpret_cast<const uint8_t*>(legacy_buffer.data());
+     const uint8_t* bytes = reinterpret_cast<const uint8_t*>(buffer.data());
+
+     double legacy_serialize_us = time_per_iteration_us(iterations, [&]() {
+          sink = legacy_serialize_queries(nq, emb_dim, queries.embs.data(), queries.ids.data(), queries.texts).size();
+     });
+     double serialize_us = time_per_iteration_us(iterations, [&]() {
+          sink = write_query_batch(queries).size();
+     });
+     double legacy_parse_us = time_per_iteration_us(iterations, [&]() {
+          uint32_t parsed_nq;
+          const float* embs;
+          std::vector<uint64_t> ids;
+          std::vector<std::string> texts;
+          legacy_deserialize_queries(legacy_bytes, legacy_batch.size(), emb_dim, parsed_nq, embs, ids, texts);
+          sink = texts.size();
+     });
+     double parse_us = time_per_iteration_us(iterations, [&]() {
+          QueryBatchView view;
+          sink = view.parse(bytes, batch.size(), emb_dim) ? view.query_text(nq - 1).size() : 0;
+     });
+     std::cout << "query batch (" << nq << " queries, emb_dim " << emb_dim << "): "
+               << legacy_batch.size() << " -> " << batch.size() << " bytes" << std::endl;
+     std::cout << "  serialize: " << legacy_serialize_us << " us -> " << serialize_us << " us" << std::endl;
+     std::cout << "  parse:     " << legacy_parse_us << " us -> " << parse_us << " us" << std::endl;
+
+     std::vector<long> I(top_k);
+     std::vector<float> D(top_k);
+     for (uint32_t i = 0; i < top_k; i++) {
+          I[i] = static_cast<long>(rng() % 1000000);
+          D[i] = static_cast<float>(i);
+     }
+     const std::string& text = queries.texts[0];
+     std::string legacy_result = legacy_serialize_cluster_search_result(top_k, I.data(), D.data(), text);
+     std::string result = serialize_cluster_search_result(queries.ids[0], top_k, I.data(), D.data(), text, 4);
+     double legacy_result_serialize_us = time_per_iteration_us(iterations, [&]() {
+          sink = legacy_serialize_cluster_search_result(top_k, I.data(), D.data(), text).size();
+     });
+     double result_serialize_us = time_per_iteration_us(iterations, [&]() {
+          sink = serialize_cluster_search_result(queries.ids[0], top_k, I.data(), D.data(), text, 4).size();
+     });
+     double legacy_result_parse_us = time_per_iteration_us(iterations, [&]() {
+          std::string query_text;
+          std::vector<LegacyDocIndex> cluster_results;
+          legacy_deserialize_cluster_search_result(reinterpret_cast<const uint8_t*>(legacy_result.data()), legacy_result.size(),
+                                                   query_text, cluster_results);
+          sink = cluster_results.size();
+     });
+     double result_parse_us = time_per_iteration_us(iterations, [&]() {
+          ClusterSearchResultView view;
+          bool in_bounds = true;
+          sink = view.parse(reinterpret_cast<const uint8_t*>(result.data()), result.size()) ?
+                 read_cluster_search_result(view, reinterpret_cast<const uint8_t*>(result.data()), result.size(), in_bounds) : 0;
+     });
+     std::cout << "cluster search result (top_k " << top_k << "): " << legacy_result.size() << " -> " << result.size() << " bytes" << std::endl;
+     std::cout << "  serialize: " << legacy_result_serialize_us << " us -> " << result_serialize_us << " us" << std::endl;
+     std::cout << "  parse:     " << legacy_result_parse_us << " us -> " << result_parse_us << " us" << std::endl;
+
+     // the queries of clusters_per_shard clusters on the same shard, each cluster selected by half of the queries
+     std::vector<long> cluster_ids(clusters_per_shard);
+     std::vector<std::vector<uint32_t>> cluster_query_indices(clusters_per_shard);
+     for (uint32_t c = 0; c < clusters_per_shard; c++) {
+          cluster_ids[c] = c;
+          for (uint32_t i = 0; i < nq; i++) {
+               if (rng() % 2) {
+                    cluster_query_indices[c].push_back(i);
+               }
+          }
+     }
+     size_t per_cluster_bytes = 0;
+     double per_cluster_us = time_per_iteration_us(iterations, [&]() {
+          per_cluster_bytes = 0;
+          for (const auto& indices : cluster_query_indices) {
+               size_t total_text_size = 0;
+               for (uint32_t i : indices) {
+                    total_text_size += queries.texts[i].size();
+               }
+               QueryBatchWriter writer(static_cast<uint32_t>(indices.size()), emb_dim, total_text_size);
+               for (uint32_t i : indices) {
+                    writer.add(queries.ids[i], queries.embs.data() + static_cast<size_t>(i) * emb_dim, queries.texts[i]);
+               }
+               per_cluster_bytes += writer.take().size();
+          }
+     });
+     size_t bundle_bytes = 0;
+     double bundle_us = time_per_iteration_us(iterations, [&]() {
+          std::vector<uint8_t> in_bundle(nq, 0);
+          size_t total_text_size = 0;
+          uint32_t num_bundle_queries = 0;
+          for (const auto& indices : cluster_query_indices) {
+               for (uint32_t i : indices) {
+                    if (!in_bundle[i]) {
+                         in_bundle[i] = 1;
+                         total_text_size += queries.texts[i].size();
+                         num_bundle_queries++;
+                    }
+               }
+          }
+          // the bundle keeps the batch order, so that the per-cluster indices stay valid without remapping
+          std::vector<std::vector<uint32_t>> bundle_indices = cluster_query_indices;
+          std::vector<uint32_t> position(nq);
+          for (uint32_t i = 0, p = 0; i < nq; i++) {
+               position[i] = p;
+               p += in_bundle[i];
+          }
+          for (auto& indices : bundle_indices) {
+               for (uint32_t& i : indices) {
+                    i = position[i];
+               }
+          }
+          ClusterBundleWriter writer(static_cast<uint32_t>(cluster_ids.size()), count_query_indices(bundle_indices), num_bundle_queries,
+                                     emb_dim, total_text_size);
+          add_clusters(writer, cluster_ids, bundle_indices);
+          for (uint32_t i = 0; i < nq; i++) {
+               if (in_bundle[i]) {
+                    writer.batch().add(queries.ids[i], queries.embs.data() + static_cast<size_t>(i) * emb_dim, queries.texts[i]);
+               }
+          }
+          bundle_bytes = writer.take().size();
+     });
+     std::cout << "shard bundle (" << clusters_per_shard << " clusters): " << clusters_per_shard << " objects, " << per_cluster_bytes
+               << " bytes -> 1 object, " << bundle_bytes << " bytes" << std::endl;
+     std::cout << "  serialize: " << per_cluster_us << " us -> " << bundle_us << " us" << std::endl;
+}
+
+/*** Randomly corrupt a valid message: bit flips, truncation, extension, or overwritten header fields ***/
+std::string mutate(const std::string& message, std::mt19937_64& rng) {
+     std::string mutated = message;
+     switch (rng() % 5) {
+          case 0: { // flip a few bits
+               int num_flips = 1 + rng() % 8;
+               for (int i = 0; i < num_flips && !mutated.empty(); i++) {
+                    mutated[rng() % mutated.size()] ^= static_cast<char>(1 << (rng() % 8));
+               }
+               break;
+          }
+          case 1: // truncate
+               mutated.resize(rng() % (mutated.size() + 1));
+               break;
+          case 2: // append garbage
+               for (int i = 1 + rng() % 16; i > 0; i--) {
+                    mutated.push_back(static_cast<char>(rng()));
+               }
+               break;
+          case 3: { // overwrite a 32-bit field of the header with an arbitrary or boundary value
+               static const uint32_t boundary_values[] = {0, 1, 0x7FFFFFFF, 0x80000000, 0xFFFFFFFF};
+               uint32_t value = (rng() % 2) ? boundary_values[rng() % 5] : static_cast<uint32_t>(rng());
+               size_t offset = 4 * (rng() % 4);
+               if (mutated.size() >= offset + sizeof(value)) {
+                    std::memcpy(mutated.data() + offset, &value, sizeof(value));
+               }
+               break;
+          }
+          default: // random bytes after an intact header
+               for (size_t i = sizeof(QueryBatchHeader); i < mutated.size(); i++) {
+                    if (rng() % 4 == 0) {
+                         mutated[i] = static_cast<char>(rng());
+                    }
+               }
+               break;
+     }
+     return mutated;
+}
+
+/*** @return the number of failures: round trips that differ, or accepted messages read out of their bounds ***/
+int run_fuzz(int iterations, std::mt19937_64& rng) {
+     int failures = 0;
+     uint64_t accepted = 0;
+     for (int it = 0; it < iterations; it++) {
+          uint32_t nq = rng() % 8;
+          uint32_t emb_dim = 1 + rng() % 64;
+          Queries queries = make_queries(nq, emb_dim, rng);
+          std::string batch = write_query_batch(queries);
+          // round trip
+          QueryBatchView view;
+          bool round_trip = view.parse(reinterpret_cast<const uint8_t*>(batch.data()), batch.size(), emb_dim) && view.size() == nq;
+          for (uint32_t i = 0; round_trip && i < nq; i++) {
+               round_trip = view.query_id(i) == queries.ids[i] && view.probe_count(i) == i % 8 && view.query_text(i) == queries.texts[i] &&
+                            std::memcmp(view.embedding(i), queries.embs.data() + static_cast<size_t>(i) * emb_dim, sizeof(float) * emb_dim) == 0;
+          }
+          if (!round_trip) {
+               std::cerr << "Error: query batch round trip failed, nq=" << nq << ", emb_dim=" << emb_dim << std::endl;
+               failures++;
+          }
+          // mutated copies, also at an odd address to go through the unaligned embeddings path
+          for (int m = 0; m < 8; m++) {
+               std::string mutated = mutate(batch, rng);
+               size_t shift = rng() % 2;
+               std::vector<uint8_t> buffer(mutated.size() + shift + 1); // never empty, so that data() is not null
+               std::memcpy(buffer.data() + shift, mutated.data(), mutated.size());
+               QueryBatchView mutated_view;
+               if (mutated_view.parse(buffer.data() + shift, mutated.size(), emb_dim)) {
+                    accepted++;
+                    bool in_bounds = true;
+                    sink = read_query_batch(mutated_view, buffer.data() + shift, mutated.size(), in_bounds);
+                    if (!in_bounds) {
+                         std::cerr << "Error: accepted query batch read out of bounds." << std::endl;
+                         failures++;
+                    }
+               }
+          }
+
+          // cluster query bundle of random subsets of the queries
+          std::vector<long> cluster_ids(rng() % 4);
+          std::vector<std::vector<uint32_t>> cluster_query_indices(cluster_ids.size());
+          for (size_t c = 0; c < cluster_ids.size(); c++) {
+               cluster_ids[c] = static_cast<long>(rng() % 1000);
+               for (uint32_t i = 0; i < nq; i++) {
+                    if (rng() % 2) {
+                         cluster_query_indices[c].push_back(i);
+                    }
+               }
+          }
+          size_t total_text_size = 0;
+          for (const auto& text : queries.texts) {
+               total_text_size += text.size();
+          }
+          ClusterBundleWriter bundle_writer(static_cast<uint32_t>(cluster_ids.size()), count_query_indices(cluster_query_indices), nq,
+                                            emb_dim, total_text_size);
+          add_clusters(bundle_writer, cluster_ids, cluster_query_indices);
+          for (uint32_t i = 0; i < nq; i++) {
+               bundle_writer.batch().add(queries.ids[i], queries.embs.data() + static_cast<size_t>(i) * emb_dim, queries.texts[i]);
+          }
+          std::string bundle = bundle_writer.take();
+          ClusterBundleView bundle_view;
+          round_trip = is_cluster_bundle(reinterpret_cast<const uint8_t*>(bundle.data()), bundle.size()) &&
+                       bundle_view.parse(reinterpret_cast<const uint8_t*>(bundle.data()), bundle.size(), emb_dim) &&
+                       bundle_view.size() == cluster_ids.size() && bundle_view.query_batch().size() == nq;
+          for (uint32_t c = 0; round_trip && c < bundle_view.size(); c++) {
+               std::vector<uint32_t> indices;
+               bundle_view.get_query_indices(c, indices);
+               round_trip = bundle_view.cluster_id(c) == cluster_ids[c] && indices == cluster_query_indices[c];
+          }
+          if (!round_trip) {
+               std::cerr << "Error: cluster bundle round trip failed, num_clusters=" << cluster_ids.size() << std::endl;
+               failures++;
+          }
+          for (int m = 0; m < 8; m++) {
+               std::string mutated = mutate(bundle, rng);
+               ClusterBundleView mutated_view;
+               if (mutated_view.parse(reinterpret_cast<const uint8_t*>(mutated.data()), mutated.size(), emb_dim)) {
+                    accepted++;
+                    bool in_bounds = true;
+                    const QueryBatchView& batch_view = mutated_view.query_batch();
+                    sink = read_query_batch(batch_view, reinterpret_cast<const uint8_t*>(mutated.data()), mutated.size(), in_bounds);
+                    for (uint32_t c = 0; c < mutated_view.size(); c++) {
+                         std::vector<uint32_t> indices;
+                         mutated_view.get_query_indices(c, indices);
+                         for (uint32_t index : indices) {
+                              in_bounds = in_bounds && index < batch_view.size();
+                         }
+                         sink = mutated_view.cluster_id(c);
+                    }
+                    if (!in_bounds) {
+                         std::cerr << "Error: accepted cluster bundle read out of bounds." << std::endl;
+                         failures++;
+                    }
+               }
+          }
+
+          uint32_t top_k = rng() % 16;
+          std::vector<long> I(top_k);
+          std::vector<float> D(top_k);
+          for (uint32_t i = 0; i < top_k; i++) {
+               I[i] = static_cast<long>(rng());
+               D[i] = static_cast<float>(rng() % 1000);
+          }
+          std::string text = nq > 0 ? queries.texts[0] : std::string();
+          uint32_t probe_count = rng() % 8;
+          std::string result = serialize_cluster_search_result(it, top_k, I.data(), D.data(), text, probe_count);
+          ClusterSearchResultView result_view;
+          round_trip = result_view.parse(reinterpret_cast<const uint8_t*>(result.data()), result.size()) &&
+                       result_view.get_query_id() == static_cast<uint64_t>(it) && result_view.get_top_k() == top_k &&
+                       result_view.get_probe_count() == probe_count &&
+                       result_view.query_text() == text;
+          for (uint32_t i = 0; round_trip && i < top_k; i++) {
+               round_trip = result_view.emb_index(i) == I[i] && result_view.distance(i) == D[i];
+          }
+          if (!round_trip) {
+               std::cerr << "Error: cluster search result round trip failed, top_k=" << top_k << std::endl;
+               failures++;
+          }
+          for (int m = 0; m < 8; m++) {
+               std::string mutated = mutate(result, rng);
+               ClusterSearchResultView mutated_view;
+               if (mutated_view.parse(reinterpret_cast<const uint8_t*>(mutated.data()), mutated.size())) {
+                    accepted++;
+                    bool in_bounds = true;
+                    sink = read_cluster_search_result(mutated_view, reinterpret_cast<const uint8_t*>(mutated.data()), mutated.size(), in_bounds);
+                    if (!in_bounds) {
+                         std::cerr << "Error: accepted cluster search result read out of bounds." << std::endl;
+                         failures++;
+                    }
+               }
+          }
+          // arbitrary bytes
+          std::string garbage(rng() % 256, '\0');
+          for (char& c : garbage) {
+               c = static_cast<char>(rng());
+          }
+          QueryBatchView garbage_view;
+          ClusterSearchResultView garbage_result_view;
+          if (garbage_view.parse(reinterpret_cast<const uint8_t*>(garbage.data()), garbage.size(), emb_dim) ||
+              garbage_result_view.parse(reinterpret_cast<const uint8_t*>(garbage.data()), garbage.size())) {
+               accepted++;
+          }
+     }
+     std::cout << "fuzz: " << iterations << " iterations, " << accepted << " mutated messages accepted (and read within bounds), "
+               << failures << " failures" << std::endl;
+     return failures;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+     int opt;
+     uint32_t num_queries = 100;
+     uint32_t emb_dim = 1024;
+     uint32_t top_k = 5;
+     uint32_t clusters_per_shard = 4;
+     int iterations = 1000;
+     int fuzz_iterations = 0;
+     uint64_t seed = 42;
+
+     while ((opt = getopt(argc, argv, "b:e:k:c:n:f:s:")) != -1) {
+          switch (opt) {
+               case 'b':
+                    num_queries = std::atoi(optarg);
+                    break;
+               case 'e':
+                    emb_dim = std::atoi(optarg);
+                    break;
+               case 'k':
+                    top_k = std::atoi(optarg);
+                    break;
+               case 'c':
+                    clusters_per_shard = std::atoi(optarg);
+                    break;
+               case 'n':
+                    iterations = std::atoi(optarg);
+                    break;
+               case 'f':
+                    fuzz_iterations = std::atoi(optarg);
+                    break;
+               case 's':
+                    seed = std::strtoull(optarg, nullptr, 10);
+                    break;
+               case '?': // Unknown option or missing option argument
+                    std::cerr << "Usage: " << argv[0] << " [-b <queries_per_batch>] [-e <emb_dim>] [-k <top_k>] [-c <clusters_per_shard>] [-n <iterations>] [-f <fuzz_iterations>] [-s <seed>]" << std::endl;
+                    return 1;
+               default:
+                    break;
+          }
+     }
+     if (num_queries == 0 || emb_dim == 0 || iterations <= 0) {
+          std::cerr << "Error: queries_per_batch, emb_dim and iterations must be positive." << std::endl;
+          return 1;
+     }
+     std::mt19937_64 rng(seed);
+     run_benchmark(num_queries, emb_dim, top_k, clusters_per_shard, iterations, rng);
+     if (fuzz_iterations > 0 && run_fuzz(fuzz_iterations, rng) > 0) {
+          return 1;
+     }
+     return 0;
+}
@@ -1,4 +1,5 @@
 #include <algorithm>
+#include <cstring>
 #include <memory>
 #include <map>
 #include <iostream>
@@ -10,6 +11,7 @@
 #include <cascade/cascade_interface.hpp>
 
 #include "rag_utils.hpp"
+#include "snapshot.hpp"
 
 namespace derecho{
 namespace cascade{
@@ -53,7 +55,7 @@ struct QuerySearchResults{
      *  return true if the cluster_id's result has been collected before for the same query
      *  return false if the cluster_id has not been collected bofore, and as been added to this query's QuerySearchResults
      */
-    void add_cluster_result(int cluster_id, std::vector<DocIndex> cluster_results){
+    void add_cluster_result(int cluster_id, const ClusterSearchResultView& cluster_result){
         if(std::find(collected_cluster_ids.begin(), collected_cluster_ids.end(), cluster_id) != collected_cluster_ids.end()){
             // std::cerr << "Error: cluster_id=" << cluster_id << " has been collected before for the query=" << query_text << std::endl;
             // dbg_default_error("cluster_id={} has been collected before for the query={}.", cluster_id, query_text);
@@ -61,7 +63,12 @@ struct QuerySearchResults{
         }
         this->collected_cluster_ids.push_back(cluster_id);
         // Add the cluster_results to the min_heap, and keep the size of the heap to be top_k
-        for (const auto& doc_index : cluster_results) {
+        for (uint32_t i = 0; i < cluster_result.get_top_k(); i++) {
+            // the approximate search types pad their results with -1 when they reach fewer than top_k embeddings
+            if (cluster_result.emb_index(i) < 0) {
+                continue;
+            }
+            DocIndex doc_index{cluster_id, cluster_result.emb_index(i), cluster_result.distance(i)};
             if (static_cast<int>(agg_top_k_results.size()) < top_k) {
                 agg_top_k_results.push(doc_index);
             } else if (doc_index < agg_top_k_results.top()) {
@@ -72,43 +79,87 @@ struct QuerySearchResults{
     }
 };
 
-struct QueryRequestSource{
-    uint32_t client_id;
-    uint32_t query_batch_id;
-    int total_cluster_num;
-    int received_cluster_result_count;
-    bool finished_process; // true if the result of this query has been sent back to the client that sent this query
-    QueryRequestSource(uint32_t client_id, uint32_t query_batch_id, int total_cluster_num, int received_cluster_result_count, bool finished_process):
-                       client_id(client_id), query_batch_id(query_batch_id), total_cluster_num(total_cluster_num), received_cluster_result_count(received_cluster_result_count), finished_process(finished_process) {}
-};
-
 class AggGenOCDPO: public DefaultOffCriticalDataPathObserver {
 
     int top_k = 5; // final top K results to use for LLM
-    int top_num_centroids = 4; // number of top K clusters need to wait to gather for each query
+    int top_num_centroids = 4; // number of top K clusters need to wait to gather for each query, unless the results carry their probe count
     int include_llm = false; // 0: not include, 1: include
     int retrieve_docs = true; // 0: not retrieve, 1: retrieve
+    std::string snapshot_dir; // local directory of the doc table snapshots, reused across restarts; empty: no snapshot
+    bool snapshot_verify_version = true; // fetch the first chunk of a doc table to check its version before using its snapshot
+    bool semantic_cache_fill = false; // send the final results to the centroids search UDL, to fill its semantic query cache
+    bool coalesce_inflight_queries = false; // send the final results to the centroids search UDL, to answer the queries it coalesced
 
     std::unordered_map<int, std::unordered_map<long, std::string>> doc_tables; // cluster_id -> emb_index -> pathname
     /*** TODO: use a more efficient way to store the doc_contents cache */
     std::unordered_map<int,std::unordered_map<long, std::string>> doc_contents; // {cluster_id0:{ emb_index0: doc content0, ...}, cluster_id1:{...}, ...}
-    /*** query_result: query_text -> QuerySearchResults 
+    /*** query_results: query_id -> QuerySearchResults
      *   is a UDL local cache to store the cluster search results for queries that haven't notified the client 
-     *   (due to not all cluster results are collected)
-    */
-    std::unordered_map<std::string, std::unique_ptr<QuerySearchResults>> query_results; 
-    /*** since same query may appear in different query batches from different clients. i.e. different people ask the same question
-     *  query_request_tracker: query_text -> [(client_id, query_batch_id, finished_process), ..]
-     *  query_request_tracker keep track of the batched query requests that requested the same type of query.
-     *  This is used as a helper field for caching the query_results, and early reply to the client if the results are ready
-     *  to delay garbage collection of the results for a query if there is still requesting qb.
+     *   (due to not all cluster results are collected). Each query has its own client-assigned query id, 
+     *   so the results of a query are removed once they are sent back to its client.
     */
-    std::unordered_map<std::string, std::vector<QueryRequestSource>> query_request_tracker; 
+    std::unordered_map<uint64_t, std::unique_ptr<QuerySearchResults>> query_results; 
 
 
     int my_id; // the node id of this node; logging purpose
 
 
+    /***
+     * Load a doc table from its snapshot, if the snapshot was built from the given chunk objects,
+     * and from the current version of the first one unless snapshot_verify_version is false
+     * The "doc_table" section is a sequence of records: [int64 emb_index][uint32 pathname length][pathname bytes]
+     */
+    bool load_doc_table_snapshot(const std::string& snapshot_file, const std::vector<std::string>& chunk_keys,
+                                 const std::vector<uint64_t>& chunk_sizes, DefaultCascadeContextType* typed_ctxt,
+                                 std::unordered_map<long, std::string>& doc_table){
+        std::unique_ptr<MappedSnapshot> mapped = MappedSnapshot::open(snapshot_file);
+        if (!mapped || !mapped->matches_sources(chunk_keys, chunk_sizes)) {
+            return false;
+        }
+        if (this->snapshot_verify_version &&
+            !mapped->matches_first_version(get_object_version(typed_ctxt->get_service_client_ref(), chunk_keys.front(), CURRENT_VERSION, true))) {
+            dbg_default_info("{}, snapshot {} was built from another version of {}, rebuilding it.", __func__, snapshot_file, chunk_keys.front());
+            return false;
+        }
+        const uint8_t* data = nullptr;
+        uint64_t size = 0;
+        if (!mapped->get_section("doc_table", data, size)) {
+            return false;
+        }
+        uint64_t pos = 0;
+        while (pos < size) {
+            int64_t emb_index = 0;
+            uint32_t len = 0;
+            if (size - pos < sizeof(emb_index) + sizeof(len)) {
+                return false;
+            }
+            std::memcpy(&emb_index, data + pos, sizeof(emb_index));
+            std::memcpy(&len, data + pos + sizeof(emb_index), sizeof(len));
+            pos += sizeof(emb_index) + sizeof(len);
+            if (size - pos < len) {
+                return false;
+            }
+            doc_table[emb_index] = std::string(reinterpret_cast<const char*>(data + pos), len);
+            pos += len;
+        }
+        return true;
+    }
+
+    void save_doc_table_snapshot(const std::string& snapshot_file, const std::vector<SnapshotSource>& sources,
+                                 const std::unordered_map<long, std::string>& doc_table){
+        std::string records;
+        for (const auto& [emb_index, pathname] : doc_table) {
+            int64_t index = emb_index;
+            uint32_t len = static_cast<uint32_t>(pathname.size());
+            records.append(reinterpret_cast<const char*>(&index), sizeof(index));
+            records.append(reinterpret_cast<const char*>(&len), sizeof(len));
+            records.append(pathname);
+        }
+        if (!write_snapshot(snapshot_file, sources, {{"doc_table", {{records.data(), records.size()}}}})) {
+            dbg_default_warn("{}, failed to write snapshot {}.", __func__, snapshot_file);
+        }
+    }
+
     bool load_doc_table(DefaultCascadeContextType* typed_ctxt, int cluster_id){
         if (doc_tables.find(cluster_id) != doc_tables.end()) {
             return true;
@@ -129,30 +180,57 @@ class AggGenOCDPO: public DefaultOffCriticalDataPathObserver {
             return -1;
         }
         std::priority_queue<std::string, std::vector<std::string>, CompareObjKey> filtered_keys = filter_exact_matched_keys(map_obj_keys, table_prefix);
-        // 1. get the doc table for the cluster_id
-        while(!filtered_keys.empty()){
-            std::string map_obj_key = filtered_keys.top();
-            filtered_keys.pop();
-            auto get_query_results = typed_ctxt->get_service_client_ref().get(map_obj_key);
-            auto& reply = get_query_results.get().begin()->second.get();
+        std::vector<std::string> chunk_keys = drain_keys(filtered_keys);
+        std::unordered_map<long, std::string> doc_table;
+        // 1. use the local snapshot of the table, if it was built from the current chunks
+        std::string snapshot_file;
+        std::vector<uint64_t> chunk_sizes;
+        if (!this->snapshot_dir.empty()) {
+            snapshot_file = snapshot_path(this->snapshot_dir, table_prefix);
+            chunk_sizes = get_object_sizes(typed_ctxt->get_service_client_ref(), chunk_keys, version, stable);
+            if (load_doc_table_snapshot(snapshot_file, chunk_keys, chunk_sizes, typed_ctxt, doc_table)) {
+                this->doc_tables[cluster_id] = std::move(doc_table);
+                return true;
+            }
+            doc_table.clear();
+        }
+        // 2. get the doc table chunks for the cluster_id, with the gets pipelined, and parse each chunk as it arrives
+        std::vector<persistent::version_t> chunk_versions(chunk_keys.size(), CURRENT_VERSION);
+        bool loaded = pipelined_get(typed_ctxt->get_service_client_ref(), chunk_keys, MAX_IN_FLIGHT_GETS, version, stable,
+                                    [&](size_t key_index, const ObjectWithStringKey& reply) {
+            const std::string& map_obj_key = chunk_keys[key_index];
             if (reply.blob.size == 0) {
                 std::cerr << "Error: failed to get the doc table for key=" << map_obj_key << std::endl;
                 dbg_default_error("Failed to get the doc table for key={}.", map_obj_key);
                 return false;
             }
+            chunk_versions[key_index] = reply.version;
             char* json_data = const_cast<char*>(reinterpret_cast<const char*>(reply.blob.bytes));
             std::string json_str(json_data, reply.blob.size);
             try{
                 nlohmann::json doc_table_json = nlohmann::json::parse(json_str);
                 for (const auto& [emb_index, pathname] : doc_table_json.items()) {
-                    this->doc_tables[cluster_id][std::stol(emb_index)] = "/rag/doc/" + std::to_string(pathname.get<int>());
+                    doc_table[std::stol(emb_index)] = "/rag/doc/" + std::to_string(pathname.get<int>());
                 }
             } catch (const nlohmann::json::parse_error& e) {
                 std::cerr << "Error: load_doc_table JSON parse error: " << e.what() << std::endl;
                 dbg_default_error("{}, JSON parse error: {}", __func__, e.what());
                 return false;
             }
+            return true;
+        });
+        if (!loaded) {
+            return false;
+        }
+        if (!snapshot_file.empty()) {
+            std::vector<SnapshotSource> sources;
+            for (size_t i = 0; i < chunk_keys.size(); i++) {
+                sources.push_back({chunk_keys[i], chunk_versions[i], chunk_sizes[i]});
+            }
+            save_doc_table_snapshot(snapshot_file, sources, doc_table);
         }
+        // only cache complete tables, so that a failed load is retried by the next query
+        this->doc_tables[cluster_id] = std::move(doc_table);
 #ifdef ENABLE_VORTEX_EVALUATION_LOGGING     
         TimestampLogger::log(LOG_TAG_AGG_UDL_LOAD_EMB_DOC_MAP_END, my_id, 0, cluster_id);
 #endif
@@ -202,54 +280,6 @@ class AggGenOCDPO: public DefaultOffCriticalDataPathObserver {
         return true;
     }
 
-    /*** Helper function to add intermediate result to udl cache
-     *   check if the query existed in the cache
-     *   and if all the results are collected for the query
-     *   If all results are collected, return the top_k docs for the query
-     *   If not all results collected, add this qb_id to the tracker
-     */
-    bool check_query_request_finished(const std::string& query_text, const uint32_t& client_id, const uint32_t& query_batch_id){
-        auto& tracked_query_request = query_request_tracker[query_text];
-        for (auto& q_source : tracked_query_request) {
-            if (q_source.client_id == client_id && q_source.query_batch_id == query_batch_id ) {
-                q_source.received_cluster_result_count += 1;
-                if (q_source.received_cluster_result_count > q_source.total_cluster_num) {
-                    std::cerr << "Error: received_cluster_result_count" << q_source.received_cluster_result_count << ">total_cluster_num=" << q_source.total_cluster_num << std::endl;
-                    assert (q_source.received_cluster_result_count <= q_source.total_cluster_num);
-                }
-                return q_source.finished_process;
-            }
-        }
-        query_request_tracker[query_text].emplace_back(client_id, query_batch_id, this->top_num_centroids, 1, false);
-        return false;
-    }
-
-    void garbage_collect_query_results(const std::string& query_text, const uint32_t& client_id, const uint32_t& query_batch_id){
-        auto& tracked_query_request = query_request_tracker[query_text];
-        for (auto it = tracked_query_request.begin(); it != tracked_query_request.end(); ++it) {
-            if (it->client_id == client_id && it->query_batch_id == query_batch_id) {
-                it->finished_process = true;
-                break;
-            } 
-        }
-        /*** check if all the cluster search result of this query has been processed. 
-         * If not, keep the query in the tracker longer, because this UDL will be triggered again by the remaining cluster search DULs results,
-         * in which case, we would skip processing the query again.
-        */
-        bool all_finished = true;
-        for (const auto& query_tracker : tracked_query_request) {
-            if (!query_tracker.finished_process || query_tracker.received_cluster_result_count < query_tracker.total_cluster_num) {
-                all_finished = false;
-                break;
-            }
-        }
-        if (all_finished) {
-            query_results.erase(query_text);
-            query_request_tracker.erase(query_text);
-        }
-    }
-
-
     virtual void ocdpo_handler(const node_id_t sender,
                                const std::string& object_pool_pathname,
                                const std::string& key_string,
@@ -258,51 +288,39 @@ class AggGenOCDPO: public DefaultOffCriticalDataPathObserver {
                                DefaultCascadeContextType* typed_ctxt,
                                uint32_t worker_id) override { 
         // 0. parse the query information from the key_string
-        int client_id, cluster_id, batch_id, qid;
-        if (!parse_query_info(key_string, client_id, batch_id, cluster_id, qid)) {
+        int client_id, cluster_id, batch_id;
+        uint64_t query_id;
+        if (!parse_query_info(key_string, client_id, batch_id, cluster_id, query_id)) {
             std::cerr << "Error: failed to parse the query_info from the key_string:" << key_string << std::endl;
             dbg_default_error("In {}, Failed to parse the query_info from the key_string:{}.", __func__, key_string);
             return;
         }
         
+        uint32_t query_batch_id = get_query_batch_id(query_id); // sequence number of the query at its client, for logging
 #ifdef ENABLE_VORTEX_EVALUATION_LOGGING
-        int query_batch_id = batch_id * QUERY_BATCH_ID_MODULUS + qid % QUERY_BATCH_ID_MODULUS; // cast down qid for logging purpose
         TimestampLogger::log(LOG_TAG_AGG_UDL_START,client_id,query_batch_id,cluster_id);
 #endif
         dbg_default_trace("[AggregateGenUDL] receive cluster search result from cluster{}.", cluster_id);
-        std::string query_text;
-        std::vector<DocIndex> cluster_results;
-        // 1. deserialize the cluster searched result from the object
-        try{
-            deserialize_cluster_search_result_from_bytes(cluster_id, object.blob.bytes, object.blob.size, query_text, cluster_results);
-        } catch (const std::exception& e) {
+        // 1. read the cluster searched result from the object, in place
+        ClusterSearchResultView cluster_result;
+        if (!cluster_result.parse(object.blob.bytes, object.blob.size) || cluster_result.get_query_id() != query_id) {
             std::cerr << "Error: failed to deserialize the cluster searched result and query texts from the object." << std::endl;
-            dbg_default_error("{}, Failed to deserialize the cluster searched result from the object.", __func__);
+            dbg_default_error("{}, Failed to deserialize the cluster searched result of key: {}, size: {}.", __func__, key_string, object.blob.size);
             return;
         }
 #ifdef ENABLE_VORTEX_EVALUATION_LOGGING
         TimestampLogger::log(LOG_TAG_AGG_UDL_FINISHED_DESERIALIZE, client_id, query_batch_id, cluster_id);
 #endif
-        /*** 1.1 If the query result has sent back to the client before, skip sending it again.
-         * To handle the case where multiple different client send the same query 
-         *  At aggregation step, we could use the local cache to directly send back to client what were collected before
-         *  But UDL2 doesn't have caching and unaware of the same query, so it would recomputes KNN for the same query embedding and
-         *  then trigger this UDL multiple time even after we send back the result to the client already. 
-         *  This is to avoid sending the same result to the client multiple times.
-        */
-        if (query_results.find(query_text) == query_results.end()) {
-            query_results[query_text] = std::make_unique<QuerySearchResults>(query_text, top_num_centroids, top_k);
-            query_request_tracker[query_text] = std::vector<QueryRequestSource>();
-        } 
-        if (check_query_request_finished(query_text, client_id, query_batch_id)) {
-            // check if need to garbage clean the query results if all of its cluster_results have been processed
-            garbage_collect_query_results(query_text, client_id, query_batch_id); 
-            return;
+        // 2. add the cluster_results to the query_results
+        std::unique_ptr<QuerySearchResults>& query_result = query_results[query_id];
+        if (!query_result) {
+            // the centroids search UDL sets the number of clusters each query is sent to, which varies with adaptive_probe
+            int total_cluster_num = cluster_result.get_probe_count() > 0 ? static_cast<int>(cluster_result.get_probe_count()) : top_num_centroids;
+            query_result = std::make_unique<QuerySearchResults>(std::string(cluster_result.query_text()), total_cluster_num, top_k);
         }
-        // 2. add the cluster_results to the query_results and check if all results are collected
-        query_results[query_text]->add_cluster_result(cluster_id, cluster_results);
+        query_result->add_cluster_result(cluster_id, cluster_result);
         // 3. check if all cluster results are collected for this query
-        if (!query_results[query_text]->is_all_results_collected()) {
+        if (!query_result->is_all_results_collected()) {
 #ifdef ENABLE_VORTEX_EVALUATION_LOGGING
             TimestampLogger::log(LOG_TAG_AGG_UDL_END_NOT_FULLY_GATHERED, client_id, query_batch_id, cluster_id);
 #endif
@@ -312,27 +330,31 @@ class AggGenOCDPO: public DefaultOffCriticalDataPathObserver {
         TimestampLogger::log(LOG_TAG_AGG_UDL_RETRIEVE_DOC_START, client_id, query_batch_id, cluster_id);
 #endif
         // 4. All cluster results are collected. Retrieve the top_k docs contents
-        if (!query_results[query_text]->retrieved_top_k_docs) {
-            auto& agg_top_k_results = query_results[query_text]->agg_top_k_results;
-            auto& top_k_docs = query_results[query_text]->top_k_docs;
-            top_k_docs.resize(agg_top_k_results.size());
-            int i = agg_top_k_results.size();
+        if (!query_result->retrieved_top_k_docs) {
+            auto& agg_top_k_results = query_result->agg_top_k_results;
+            auto& top_k_docs = query_result->top_k_docs;
+            // the heap pops the farthest doc first
+            std::vector<DocIndex> top_k_indices;
+            top_k_indices.reserve(agg_top_k_results.size());
             while (!agg_top_k_results.empty()) {
-                i--;
-                auto doc_index = agg_top_k_results.top();
+                top_k_indices.push_back(agg_top_k_results.top());
                 agg_top_k_results.pop();
+            }
+            top_k_docs.clear();
+            for (auto it = top_k_indices.rbegin(); it != top_k_indices.rend(); ++it) {
                 std::string res_doc;
-                bool find_doc = get_doc(typed_ctxt,doc_index.cluster_id, doc_index.emb_id, res_doc);
+                bool find_doc = get_doc(typed_ctxt, it->cluster_id, it->emb_id, res_doc);
                 if (!find_doc) {
-                    std::cerr << "Error: failed to get_doc for cluster_id=" << doc_index.cluster_id << " and emb_id=" << doc_index.emb_id << std::endl;
-                    dbg_default_error("Failed to get_doc for cluster_id={} and emb_id={}.", doc_index.cluster_id, doc_index.emb_id);
-                    return;
+                    // answer with the docs that could be retrieved, instead of leaving the client without an answer
+                    std::cerr << "Error: failed to get_doc for cluster_id=" << it->cluster_id << " and emb_id=" << it->emb_id << std::endl;
+                    dbg_default_error("Failed to get_doc for cluster_id={} and emb_id={}.", it->cluster_id, it->emb_id);
+                    continue;
                 }
-                top_k_docs[i] = std::move(res_doc);
+                top_k_docs.push_back(std::move(res_doc));
             }
-            query_results[query_text]->retrieved_top_k_docs = true;
+            query_result->retrieved_top_k_docs = true;
 #ifdef ENABLE_VORTEX_EVALUATION_LOGGING
-            TimestampLogger::log(LOG_TAG_AGG_UDL_RETRIEVE_DOC_END, client_id, query_batch_id, qid);
+            TimestampLogger::log(LOG_TAG_AGG_UDL_RETRIEVE_DOC_END, client_id, query_batch_id, cluster_id);
 #endif
         }
         // 5. run LLM with the query and its top_k closest docs
@@ -340,28 +362,50 @@ class AggGenOCDPO: public DefaultOffCriticalDataPathObserver {
         // 6. put the result to cascade and notify the client
         // convert the query and top_k_docs to a json object
         nlohmann::json result_json;
-        result_json["query"] = query_text;
-        result_json["top_k_docs"] = query_results[query_text]->top_k_docs;
+        result_json["query"] = query_result->query_text;
+        result_json["top_k_docs"] = query_result->top_k_docs;
         result_json["query_batch_id"] = query_batch_id;
+        result_json["query_id"] = query_id;
         std::string result_json_str = result_json.dump();
         // put the result to cascade
         Blob result_blob(reinterpret_cast<const uint8_t*>(result_json_str.c_str()), result_json_str.size());
         try {
 #ifdef ENABLE_VORTEX_EVALUATION_LOGGING
-            TimestampLogger::log(LOG_TAG_AGG_UDL_PUT_RESULT_START, client_id, query_batch_id, qid);
+            TimestampLogger::log(LOG_TAG_AGG_UDL_PUT_RESULT_START, client_id, query_batch_id, cluster_id);
 #endif
             std::string notification_pathname = "/rag/results/" + std::to_string(client_id);
             typed_ctxt->get_service_client_ref().notify(result_blob,notification_pathname,client_id);
             dbg_default_trace("[AggregateGenUDL] echo back to node {}", client_id);
 #ifdef ENABLE_VORTEX_EVALUATION_LOGGING
-            TimestampLogger::log(LOG_TAG_AGG_UDL_PUT_RESULT_END, client_id, query_batch_id, qid);
+            TimestampLogger::log(LOG_TAG_AGG_UDL_PUT_RESULT_END, client_id, query_batch_id, cluster_id);
 #endif
-            // 7. (garbage collection) remove query and query_result from the cache
-            garbage_collect_query_results(query_text, client_id, query_batch_id);
+            if (this->semantic_cache_fill || this->coalesce_inflight_queries) {
+                send_result_to_centroids_search(typed_ctxt, client_id, batch_id, result_json_str);
+            }
         } catch (derecho::derecho_exception& ex) {
             std::cerr << "[AGGnotification ocdpo]: exception on notification:" << ex.what() << std::endl;
             dbg_default_error("[AGGnotification ocdpo]: exception on notification:{}", ex.what());
         }
+        // 7. (garbage collection) remove the query_result from the cache, all the cluster results of the query have been received
+        query_results.erase(query_id);
+    }
+
+    /***
+     * Send a final result back to the centroids search UDL that sent the query down the pipeline,
+     * i.e. the shard the key of the query batch hashes to, to fill its semantic cache and answer the queries coalesced with it.
+     */
+    void send_result_to_centroids_search(DefaultCascadeContextType* typed_ctxt, int client_id, int batch_id, const std::string& result_json_str){
+        auto& service_client = typed_ctxt->get_service_client_ref();
+        std::string query_batch_key = std::string(CENTROIDS_SEARCH_PATHNAME) + "/client" + std::to_string(client_id) + "/qb" + std::to_string(batch_id);
+        ObjectWithStringKey obj;
+        obj.key = std::string(CENTROIDS_SEARCH_PATHNAME) + "/" + QUERY_RESULT_KEY;
+        obj.blob = Blob(reinterpret_cast<const uint8_t*>(result_json_str.c_str()), result_json_str.size());
+        try {
+            auto [subgroup_type_index, subgroup_index, shard_index] = service_client.key_to_shard(query_batch_key);
+            service_client.template put_and_forget<VolatileCascadeStoreWithStringKey>(obj, subgroup_index, shard_index, true);
+        } catch (derecho::derecho_exception& ex) {
+            dbg_default_error("[{}]: exception on sending the result to the centroids search:{}", __func__, ex.what());
+        }
     }
 
     static std::shared_ptr<OffCriticalDataPathObserver> ocdpo_ptr;
@@ -391,6 +435,18 @@ public:
             if (config.contains("retrieve_docs")) {
                 this->retrieve_docs = config["retrieve_docs"].get<bool>();
             }
+            if (config.contains("snapshot_dir")) {
+                this->snapshot_dir = config["snapshot_dir"].get<std::string>();
+            }
+            if (config.contains("snapshot_verify_version")) {
+                this->snapshot_verify_version = config["snapshot_verify_version"].get<bool>();
+            }
+            if (config.contains("semantic_cache_fill")) {
+                this->semantic_cache_fill = config["semantic_cache_fill"].get<bool>();
+            }
+            if (config.contains("coalesce_inflight_queries")) {
+                this->coalesce_inflight_queries = config["coalesce_inflight_queries"].get<bool>();
+            }
         } catch (const std::exception& e) {
             std::cerr << "Error: failed to convert top_num_centroids, top_k, include_llm, or retrieve_docs from config" << std::endl;
             dbg_default_error("Failed to convert top_num_centroids, top_k, include_llm, or retrieve_docs from config, at clusters_search_udl.");
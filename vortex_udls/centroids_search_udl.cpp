@@ -1,9 +1,17 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
 #include <memory>
-#include <map>
+#include <mutex>
 #include <iostream>
+#include <thread>
 #include <unordered_map>
 
 #include "grouped_embeddings_for_search.hpp"
+#include "inflight_query_table.hpp"
+#include "semantic_query_cache.hpp"
 
 
 namespace derecho{
@@ -24,35 +32,640 @@ std::string get_description() {
 class CentroidsSearchOCDPO: public DefaultOffCriticalDataPathObserver {
 
     std::unique_ptr<GroupedEmbeddingsForSearch> centroids_embs;
-    bool cached_centroids_embs = false;
+    std::atomic<bool> cached_centroids_embs = false;
+    std::mutex centroids_load_mutex; // serializes the loading of the centroids by the warmup thread and the handler
 
     // values set by config in dfgs.json.tmp file
     std::string centroids_emb_prefix = "/rag/emb/centroids_obj";
     int emb_dim = 64; // dimension of each embedding
     int top_num_centroids = 4; // number of top K embeddings to search
-    int faiss_search_type = 0; // 0: CPU flat search, 1: GPU flat search, 2: GPU IVF search
+    int faiss_search_type = 0; // 0: CPU flat search, 1: GPU flat search, 2: GPU IVF search, 3: CPU IVF search, 4: CPU HNSW search, 5: CPU PQ search with rerank, 6: CPU SIMD flat search, 7: CPU hierarchical search
+    FaissIndexParams faiss_index_params; // IVF, HNSW and PQ parameters, see FaissIndexParams
+    std::string snapshot_dir; // local directory of the centroids snapshot, reused across restarts; empty: no snapshot
+    bool snapshot_verify_version = true; // fetch the first centroids object to check its version before using the snapshot
+    bool warmup = false; // load the centroids in the background once they are in the KV store, instead of on the first query
+    int semantic_cache_capacity = 0; // number of recently answered queries cached by embedding; 0: no semantic cache
+    float semantic_cache_threshold = 0.0f; // maximum squared L2 distance between a query and a cached query for a cache hit
+    std::unique_ptr<SemanticQueryCache> semantic_cache;
+    std::atomic<uint64_t> semantic_cache_hits = 0;
+    std::atomic<uint64_t> semantic_cache_misses = 0;
+    bool coalesce_inflight_queries = false; // hold the queries identical to an in-flight one until its result comes back
+    int coalesce_timeout_ms = 5000; // an in-flight query without result after this long is sent again by its next duplicate
+    std::unique_ptr<InFlightQueryTable> inflight_queries;
+    // set by the first final result the aggregate UDL sends back: queries are only coalesced once their results are known to come back
+    std::atomic<bool> receives_query_results = false;
+    std::atomic<uint64_t> coalesced_queries = 0;
+    bool bundle_cluster_emits = true; // send the queries of the selected clusters of a shard in one bundled object
+    std::unordered_map<long, std::pair<uint32_t, uint32_t>> cluster_shards; // cluster id -> (subgroup, shard) of its clusters search UDL
+    std::mutex cluster_shards_mutex;
+    std::atomic<uint64_t> emitted_objects = 0;
+    std::atomic<uint64_t> emitted_cluster_batches = 0; // number of (query batch, cluster) pairs sent, bundled or not
+    bool batch_centroids_search = false; // search the queries of several requests together, on batch_search_thread
+    int max_batch_size = MAX_NUM_QUERIES_PER_BATCH; // number of pending queries that triggers a batched search
+    int64_t max_batch_wait_us = 0; // maximum time the oldest pending query waits before a batched search is triggered
+    int max_pending_queries = 0; // max queries queued for batch_search_thread, the handler waits for the search beyond it; 0: unbounded
+    // output paths of batch_search_thread, (pathname, as trigger put), like the "destinations" of this UDL in the DFG
+    std::vector<std::pair<std::string, bool>> batch_destinations = {{CLUSTERS_SEARCH_PATHNAME, false}};
+    std::atomic<uint64_t> batched_searches = 0;
+    std::atomic<uint64_t> batched_queries = 0;
+    bool adaptive_probe = false; // send each query to between min_probe and max_probe clusters, by the distances of its closest clusters
+    int min_probe = 1; // with adaptive_probe, number of closest clusters that a query is always sent to
+    int max_probe = 0; // with adaptive_probe, number of closest clusters searched per query; 0: top_num_centroids
+    float probe_distance_ratio = 1.5f; // with adaptive_probe, a cluster beyond min_probe is probed if its squared L2 distance is at most this times that of the closest one
+    std::atomic<uint64_t> probed_queries = 0;
+    std::atomic<uint64_t> probed_clusters = 0;
 
     int my_id = -1; // id of this node; logging purpose
 
+    std::thread warmup_thread;
+    std::atomic<bool> warmup_running = false;
+    std::atomic<bool> stop_warmup = false;
+
+    std::thread batch_search_thread;
+    std::mutex batch_search_mutex;
+    std::condition_variable batch_search_cv;
+    bool stop_batch_search = false; // protected by batch_search_mutex
+
+    /***
+     * Load the centroids embeddings from Cascade and build their search index, once, 
+     * by the warmup thread or by the first query to this node, whichever comes first
+     * @return false if the centroids failed to load, then the next query retries
+     */
+    bool load_centroids_embs(DefaultCascadeContextType* typed_ctxt){
+        if (cached_centroids_embs.load()) {
+            return true;
+        }
+        std::lock_guard<std::mutex> lock(centroids_load_mutex);
+        if (cached_centroids_embs.load()) {
+            return true;
+        }
+#ifdef ENABLE_VORTEX_EVALUATION_LOGGING
+        TimestampLogger::log(LOG_CENTROIDS_EMBEDDINGS_LOADING_START,this->my_id,0,0);
+#endif
+        //  Fill centroids embs and keep it in memory cache
+        int filled_centroid_embs = this->centroids_embs->retrieve_grouped_embeddings(this->centroids_emb_prefix,typed_ctxt);
+        if (filled_centroid_embs == -1) {
+            dbg_default_error("Failed to fill the centroids embeddings in cache, at centroids_search_udl.");
+            return false;
+        }
+        cached_centroids_embs = true;
+#ifdef ENABLE_VORTEX_EVALUATION_LOGGING
+        TimestampLogger::log(LOG_CENTROIDS_EMBEDDINGS_LOADING_END,this->my_id,0,0);
+#endif
+        return true;
+    }
+
+    /***
+     * Load the centroids on a background thread, once their objects are in the KV store.
+     * Started by set_config() with "warmup", or by putting the WARMUP_CONTROL_KEY to the trigger path.
+     */
+    void start_warmup(DefaultCascadeContextType* typed_ctxt){
+        if (warmup_running.exchange(true)) {
+            return; // a warmup is already in progress
+        }
+        if (warmup_thread.joinable()) {
+            warmup_thread.join();
+        }
+        warmup_thread = std::thread([this, typed_ctxt](){
+            std::vector<std::string> keys = wait_for_keys(typed_ctxt->get_service_client_ref(), this->centroids_emb_prefix,
+                                                          CURRENT_VERSION, true, this->stop_warmup);
+            if (!keys.empty() && load_centroids_embs(typed_ctxt)) {
+                std::cout << "Warmed up the centroids embeddings." << std::endl;
+            }
+            warmup_running = false;
+        });
+    }
+
+    /***
+     * Stop and join the warmup thread and batch_search_thread, which use centroids_embs
+     */
+    void stop_background_threads(){
+        stop_warmup = true;
+        if (warmup_thread.joinable()) {
+            warmup_thread.join();
+        }
+        {
+            std::lock_guard<std::mutex> lock(batch_search_mutex);
+            stop_batch_search = true;
+        }
+        batch_search_cv.notify_all();
+        if (batch_search_thread.joinable()) {
+            batch_search_thread.join();
+        }
+    }
+
+    /***
+     * Buffers of the search and the scatter of a request to its clusters, reused by the requests handled on the same thread:
+     * once they have grown to the largest request, the emit path does not allocate
+     */
+    struct ScatterBuffers {
+        std::vector<uint32_t> query_indices; // index in the query batch of the i-th searched query
+        std::vector<float> dispatched_embs; // the searched embeddings, if some queries of the batch are not searched
+        std::vector<long> I; // the top_num_centroids clusters of each searched query
+        std::vector<float> D;
+        std::vector<uint32_t> probe_counts; // by searched query: number of clusters it is sent to
+        std::vector<uint32_t> cluster_counts; // by cluster id: number of searched queries, then scatter cursor; all zero between requests
+        std::vector<std::pair<uint64_t, long>> selected_clusters; // (destination, cluster id) of the selected clusters, sorted
+        std::vector<uint32_t> cluster_ends; // end in cluster_positions of the queries of each selected cluster
+        std::vector<uint32_t> cluster_positions; // positions of the searched queries, grouped by selected cluster
+        std::vector<int32_t> bundle_index; // by searched query: its index in the object being written, or -1
+        std::vector<uint32_t> bundle_positions; // positions of the searched queries of the object being written
+        std::vector<uint64_t> arena; // the emitted objects, back to back at 8-byte aligned offsets
+        std::string key;
+        std::vector<std::string> hit_results; // by query of the request: its semantic cache result, or empty
+    };
+
+    static ScatterBuffers& get_scatter_buffers(){
+        thread_local ScatterBuffers buffers;
+        return buffers;
+    }
+
+    /***
+     * The queries of a request searched by the handler: the i-th searched query is query_indices[i] of query_batch,
+     * and its embedding is the i-th of data
+     */
+    struct RequestQueries {
+        const QueryBatchView& query_batch;
+        const std::vector<uint32_t>& query_indices;
+        const float* data;
+        const uint32_t* probe_counts;
+        int emb_dim;
+
+        uint32_t size() const { return static_cast<uint32_t>(query_indices.size()); }
+        uint64_t query_id(uint32_t i) const { return query_batch.query_id(query_indices[i]); }
+        uint32_t probe_count(uint32_t i) const { return probe_counts[i]; }
+        std::string_view query_text(uint32_t i) const { return query_batch.query_text(query_indices[i]); }
+        const float* embedding(uint32_t i) const { return data + static_cast<size_t>(i) * emb_dim; }
+    };
+
+    /***
+     * The queries of a request in a batch searched by batch_search_thread: the queries [begin, end) of the batch
+     */
+    struct BatchedRequestQueries {
+        const std::vector<uint64_t>& query_ids;
+        const StringList& query_texts;
+        const std::vector<float>& query_embs;
+        const std::vector<uint32_t>& probe_counts;
+        uint32_t begin;
+        uint32_t end;
+        int emb_dim;
+
+        uint32_t size() const { return end - begin; }
+        uint64_t query_id(uint32_t i) const { return query_ids[begin + i]; }
+        uint32_t probe_count(uint32_t i) const { return probe_counts[begin + i]; }
+        std::string_view query_text(uint32_t i) const { return query_texts[begin + i]; }
+        const float* embedding(uint32_t i) const { return query_embs.data() + static_cast<size_t>(begin + i) * emb_dim; }
+    };
+    /***
+     * The subgroup and shard of the clusters search UDL that the queries of a cluster go to, by the affinity set regex of /rag/emb.
+     * Cached, since the shard of a cluster only depends on its id.
+     * On failure, a key of its own that is not cached, so that the cluster is sent alone.
+     */
+    std::pair<uint32_t, uint32_t> get_cluster_shard(DefaultCascadeContextType* typed_ctxt, long cluster_id){
+        std::lock_guard<std::mutex> lock(cluster_shards_mutex);
+        auto it = cluster_shards.find(cluster_id);
+        if (it != cluster_shards.end()) {
+            return it->second;
+        }
+        std::string cluster_key = std::string(CLUSTERS_SEARCH_PATHNAME) + "/" + CLUSTER_KEY_DELIMITER + std::to_string(cluster_id);
+        try {
+            auto [subgroup_type_index, subgroup_index, shard_index] = typed_ctxt->get_service_client_ref().key_to_shard(cluster_key);
+            std::pair<uint32_t, uint32_t> shard(subgroup_index, shard_index);
+            cluster_shards[cluster_id] = shard;
+            return shard;
+        } catch (derecho::derecho_exception& ex) {
+            dbg_default_error("[{}]: failed to find the shard of cluster {}: {}", __func__, cluster_id, ex.what());
+            return {UINT32_MAX, static_cast<uint32_t>(cluster_id)};
+        }
+    }
+
+    /***
+     * Choose the clusters that each searched query is sent to, among its top_num_centroids closest, and count them.
+     * With adaptive_probe, a query is sent to its min_probe closest clusters, and to the next ones while their squared L2 distance
+     * is at most probe_distance_ratio times that of its closest cluster: a query much closer to one centroid than to the others
+     * is only sent to a few clusters, an ambiguous one to up to top_num_centroids (max_probe). The other clusters are set to -1 in I.
+     * @param I, D the top_num_centroids clusters of each of the nq searched queries, by increasing distance
+     * @param probe_counts output, the number of clusters of each query, sent along to tell the aggregate UDL how many results to wait for
+     */
+    void select_probes(long* I, const float* D, uint32_t nq, std::vector<uint32_t>& probe_counts){
+        probe_counts.resize(nq);
+        uint64_t num_probes = 0;
+        for (uint32_t q = 0; q < nq; q++) {
+            long* query_I = I + static_cast<size_t>(q) * this->top_num_centroids;
+            const float* query_D = D + static_cast<size_t>(q) * this->top_num_centroids;
+            uint32_t count = 0;
+            for (int j = 0; j < this->top_num_centroids; j++) {
+                if (query_I[j] < 0) {
+                    continue;
+                }
+                if (this->adaptive_probe && j >= this->min_probe && query_D[j] > this->probe_distance_ratio * query_D[0]) {
+                    query_I[j] = -1;
+                    continue;
+                }
+                count++;
+            }
+            probe_counts[q] = count;
+            num_probes += count;
+        }
+        this->probed_queries += nq;
+        this->probed_clusters += num_probes;
+    }
+
+    /***
+     * Group the searched queries by selected cluster, with a counting sort over I, and the selected clusters by destination:
+     * the shard of their clusters search UDL if bundle_cluster_emits, each cluster on its own otherwise
+     * @param I the top_num_centroids clusters of each of the nq searched queries
+     */
+    void scatter_to_clusters(ScatterBuffers& buffers, const long* I, uint32_t nq, const std::string& key_string,
+                             DefaultCascadeContextType* typed_ctxt){
+        const size_t num_results = static_cast<size_t>(nq) * this->top_num_centroids;
+        buffers.selected_clusters.clear();
+        for (size_t r = 0; r < num_results; r++) {
+            long cluster_id = I[r];
+            if (cluster_id < 0) {
+                continue;
+            }
+            if (static_cast<size_t>(cluster_id) >= buffers.cluster_counts.size()) {
+                buffers.cluster_counts.resize(cluster_id + 1, 0);
+            }
+            if (buffers.cluster_counts[cluster_id]++ == 0) {
+                buffers.selected_clusters.emplace_back(0, cluster_id);
+            }
+        }
+        if (buffers.selected_clusters.empty() && num_results > 0) {
+            dbg_default_error("Error: [CentroidsSearchOCDPO] for key: {} no cluster selected among top {}, all cluster_id are -1", key_string, this->top_num_centroids);
+        }
+        for (auto& selected : buffers.selected_clusters) {
+            std::pair<uint32_t, uint32_t> shard = this->bundle_cluster_emits ? get_cluster_shard(typed_ctxt, selected.second)
+                                                                             : std::make_pair(UINT32_MAX, static_cast<uint32_t>(selected.second));
+            selected.first = (static_cast<uint64_t>(shard.first) << 32) | shard.second;
+        }
+        std::sort(buffers.selected_clusters.begin(), buffers.selected_clusters.end());
+        // the counts become the offsets of the clusters in cluster_positions, then the cursors of the scatter
+        buffers.cluster_ends.resize(buffers.selected_clusters.size());
+        uint32_t offset = 0;
+        for (size_t c = 0; c < buffers.selected_clusters.size(); c++) {
+            uint32_t& count = buffers.cluster_counts[buffers.selected_clusters[c].second];
+            uint32_t begin = offset;
+            offset += count;
+            count = begin;
+            buffers.cluster_ends[c] = offset;
+        }
+        buffers.cluster_positions.resize(offset);
+        for (size_t r = 0; r < num_results; r++) {
+            long cluster_id = I[r];
+            if (cluster_id >= 0) {
+                buffers.cluster_positions[buffers.cluster_counts[cluster_id]++] = static_cast<uint32_t>(r / this->top_num_centroids);
+            }
+        }
+        for (const auto& selected : buffers.selected_clusters) {
+            buffers.cluster_counts[selected.second] = 0;
+        }
+    }
+
+    /***
+     * Collect the queries of the selected clusters [begin, end), each once, into bundle_positions and bundle_index
+     * @return the total size of their texts
+     */
+    template <typename SearchedQueries>
+    size_t collect_object_queries(ScatterBuffers& buffers, const SearchedQueries& queries, size_t begin, size_t end){
+        buffers.bundle_positions.clear();
+        size_t total_text_size = 0;
+        for (uint32_t p = (begin == 0) ? 0 : buffers.cluster_ends[begin - 1]; p < buffers.cluster_ends[end - 1]; p++) {
+            uint32_t i = buffers.cluster_positions[p];
+            if (buffers.bundle_index[i] == -1) {
+                buffers.bundle_index[i] = static_cast<int32_t>(buffers.bundle_positions.size());
+                buffers.bundle_positions.push_back(i);
+                total_text_size += queries.query_text(i).size();
+            }
+        }
+        return total_text_size;
+    }
+
+    /***
+     * Size of the object of the selected clusters [begin, end), after collect_object_queries():
+     * a query batch for a single cluster, a cluster query bundle otherwise
+     */
+    size_t object_size(const ScatterBuffers& buffers, size_t begin, size_t end, size_t total_text_size){
+        uint32_t num_queries = static_cast<uint32_t>(buffers.bundle_positions.size());
+        if (end - begin == 1) {
+            return query_batch_size(num_queries, this->emb_dim, total_text_size);
+        }
+        uint32_t num_query_indices = buffers.cluster_ends[end - 1] - ((begin == 0) ? 0 : buffers.cluster_ends[begin - 1]);
+        return cluster_bundle_size(static_cast<uint32_t>(end - begin), num_query_indices, num_queries, this->emb_dim, total_text_size);
+    }
+
+    /***
+     * Emit the searched queries to their selected clusters, after scatter_to_clusters(): one object per destination,
+     * all written into buffers.arena, sized once per request, and emitted as emplaced Blobs referencing it
+     * @param queries: the searched queries of the request, see RequestQueries
+     * @param emit_object: called with the key and the Blob of each object
+     */
+    template <typename SearchedQueries, typename EmitObject>
+    void emit_to_clusters(ScatterBuffers& buffers, const SearchedQueries& queries, const std::string& key_string,
+                          const EmitObject& emit_object){
+#ifdef ENABLE_VORTEX_EVALUATION_LOGGING
+        int client_id = -1;
+        int query_batch_id = -1;
+        parse_batch_id(key_string, client_id, query_batch_id); // Logging purpose
+#endif
+        const std::vector<std::pair<uint64_t, long>>& selected_clusters = buffers.selected_clusters;
+        auto destination_end = [&selected_clusters](size_t begin){
+            size_t end = begin + 1;
+            while (end < selected_clusters.size() && selected_clusters[end].first == selected_clusters[begin].first) {
+                end++;
+            }
+            return end;
+        };
+        auto aligned_size = [](size_t size){
+            return (size + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t);
+        };
+        buffers.bundle_index.assign(queries.size(), -1);
+        size_t arena_size = 0;
+        for (size_t begin = 0, end = 0; begin < selected_clusters.size(); begin = end) {
+            end = destination_end(begin);
+            size_t total_text_size = collect_object_queries(buffers, queries, begin, end);
+            arena_size += aligned_size(object_size(buffers, begin, end, total_text_size));
+            for (uint32_t i : buffers.bundle_positions) {
+                buffers.bundle_index[i] = -1;
+            }
+        }
+        buffers.arena.resize(arena_size / sizeof(uint64_t));
+        char* arena = reinterpret_cast<char*>(buffers.arena.data());
+        size_t offset = 0;
+        for (size_t begin = 0, end = 0; begin < selected_clusters.size(); begin = end) {
+            end = destination_end(begin);
+            size_t total_text_size = collect_object_queries(buffers, queries, begin, end);
+            size_t size = object_size(buffers, begin, end, total_text_size);
+            uint32_t num_queries = static_cast<uint32_t>(buffers.bundle_positions.size());
+            auto add_queries = [&](QueryBatchWriter& writer){
+                for (uint32_t i : buffers.bundle_positions) {
+                    writer.add(queries.query_id(i), queries.embedding(i), queries.query_text(i), queries.probe_count(i));
+                }
+            };
+            if (end - begin == 1) {
+                QueryBatchWriter writer(arena + offset, num_queries, this->emb_dim, total_text_size);
+                add_queries(writer);
+            } else {
+                uint32_t first = (begin == 0) ? 0 : buffers.cluster_ends[begin - 1];
+                ClusterBundleWriter writer(arena + offset, static_cast<uint32_t>(end - begin), buffers.cluster_ends[end - 1] - first,
+                                           num_queries, this->emb_dim, total_text_size);
+                for (size_t c = begin; c < end; c++) {
+                    writer.add_cluster(selected_clusters[c].second);
+                    for (uint32_t p = (c == 0) ? 0 : buffers.cluster_ends[c - 1]; p < buffers.cluster_ends[c]; p++) {
+                        writer.add_query_index(static_cast<uint32_t>(buffers.bundle_index[buffers.cluster_positions[p]]));
+                    }
+                }
+                add_queries(writer.batch());
+            }
+            for (uint32_t i : buffers.bundle_positions) {
+                buffers.bundle_index[i] = -1;
+            }
+            // the key of the first cluster routes the object to the shard of all the clusters, by the affinity set regex
+            long first_cluster_id = selected_clusters[begin].second;
+            buffers.key.assign(key_string);
+            buffers.key.append(CLUSTER_KEY_DELIMITER);
+            buffers.key.append(std::to_string(first_cluster_id));
+            Blob blob(reinterpret_cast<const uint8_t*>(arena + offset), size, true);
+#ifdef ENABLE_VORTEX_EVALUATION_LOGGING
+            TimestampLogger::log(LOG_CENTROIDS_EMBEDDINGS_UDL_EMIT_START,client_id,query_batch_id,first_cluster_id);
+#endif
+            emit_object(buffers.key, blob);
+#ifdef ENABLE_VORTEX_EVALUATION_LOGGING
+            TimestampLogger::log(LOG_CENTROIDS_EMBEDDINGS_UDL_EMIT_END,client_id,query_batch_id,first_cluster_id);
+#endif
+            this->emitted_objects++;
+            this->emitted_cluster_batches += end - begin;
+            dbg_default_trace("[Centroids search ocdpo]: Emitted key: {} with {} clusters", buffers.key, end - begin);
+            offset += aligned_size(size);
+        }
+    }
+
+    /***
+     * Wake up batch_search_thread after add_queries(), if the pending batch is ready, 
+     * or if this call started it and the thread has its deadline to wait for
+     */
+    void notify_batch_search(bool started_batch){
+        if (!started_batch && !this->centroids_embs->is_batch_ready(this->max_batch_size, this->max_batch_wait_us, steady_clock_now_us())) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(batch_search_mutex);
+        }
+        batch_search_cv.notify_one();
+    }
+
     /***
-     * Combine subsets of queries that is going to send to the same cluster
-     *  A batching step that batches the results with the same cluster in their top_num_centroids search results
-     * @param I the indices of the top_num_centroids that are close to the queries
-     * @param nq the number of queries
-     * @param cluster_ids_to_query_ids a map from cluster_id to the list of query_ids that are close to the cluster
-    ***/
-    inline void combine_common_clusters(const long* I, const int nq, std::map<long, std::vector<int>>& cluster_ids_to_query_ids){
-        for (int i = 0; i < nq; i++) {
-            for (int j = 0; j < top_num_centroids; j++) {
-                long cluster_id = I[i * top_num_centroids + j];
-                if (cluster_ids_to_query_ids.find(cluster_id) == cluster_ids_to_query_ids.end()) {
-                    cluster_ids_to_query_ids[cluster_id] = std::vector<int>();
+     * Body of batch_search_thread: search the pending batch of the centroids once it has max_batch_size queries, 
+     * or once its oldest query has waited max_batch_wait_us, and emit the queries of each request of the batch to their clusters.
+     * The emit function of the handler is only valid during its call, so the objects are put to batch_destinations directly,
+     * the way emit() puts them to the destinations of this UDL in the DFG.
+     */
+    void batch_search_loop(DefaultCascadeContextType* typed_ctxt){
+        StringList query_texts;
+        std::vector<uint64_t> query_ids;
+        StringList query_keys;
+        std::vector<float> query_embs;
+        std::string request_key;
+        ObjectWithStringKey obj;
+        auto put_to_clusters = [this, &obj, typed_ctxt](const std::string& key, const Blob& blob){
+            for (const auto& [pathname, as_trigger] : this->batch_destinations) {
+                obj.key.assign(pathname);
+                obj.key.append("/");
+                obj.key.append(key);
+                obj.blob = Blob(blob.bytes, blob.size, true);
+                typed_ctxt->get_service_client_ref().put_and_forget(obj, as_trigger);
+            }
+        };
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(batch_search_mutex);
+                while (!stop_batch_search &&
+                       !this->centroids_embs->is_batch_ready(this->max_batch_size, this->max_batch_wait_us, steady_clock_now_us())) {
+                    if (this->centroids_embs->has_pending_queries()) {
+                        int64_t deadline_us = this->centroids_embs->get_batch_deadline_us(this->max_batch_wait_us);
+                        batch_search_cv.wait_until(lock, std::chrono::steady_clock::time_point(std::chrono::microseconds(deadline_us)));
+                    } else {
+                        batch_search_cv.wait(lock);
+                    }
+                }
+                if (stop_batch_search) {
+                    return;
                 }
-                cluster_ids_to_query_ids[cluster_id].push_back(i);
             }
+            long* I = nullptr; // allocated by batchedSearch
+            float* D = nullptr;
+            if (!this->centroids_embs->batchedSearch(this->top_num_centroids, &D, &I, query_texts, query_ids, query_keys, &query_embs)) {
+                dbg_default_error("{}, Failed to batch search the top_num_centroids for the queries.", __func__);
+                continue;
+            }
+            this->batched_searches++;
+            this->batched_queries += query_ids.size();
+            ScatterBuffers& buffers = get_scatter_buffers();
+            select_probes(I, D, static_cast<uint32_t>(query_ids.size()), buffers.probe_counts);
+            // the queries of a request are contiguous in the batch, since they are added by one add_queries() call
+            uint32_t nq = static_cast<uint32_t>(query_ids.size());
+            for (uint32_t begin = 0, end = 0; begin < nq; begin = end) {
+                end = begin + 1;
+                while (end < nq && query_keys[end] == query_keys[begin]) {
+                    end++;
+                }
+                request_key.assign(query_keys[begin]);
+                scatter_to_clusters(buffers, I + static_cast<size_t>(begin) * this->top_num_centroids, end - begin, request_key, typed_ctxt);
+                emit_to_clusters(buffers, BatchedRequestQueries{query_ids, query_texts, query_embs, buffers.probe_counts, begin, end, this->emb_dim},
+                                 request_key, put_to_clusters);
+            }
+            delete[] I;
+            delete[] D;
+        }
+    }
+
+    /***
+     * Write the queries answered without going down the pipeline, on flush_logs
+     */
+    void flush_query_stats() {
+        std::string stats_file_name = "node" + std::to_string(my_id) + "_centroids_query_stats.csv";
+        std::ofstream stats_file(stats_file_name);
+        if (!stats_file.is_open()) {
+            std::cerr << "Error: failed to open " << stats_file_name << std::endl;
+            return;
+        }
+        stats_file << "semantic_cache_hits,semantic_cache_misses,coalesced_queries,inflight_queries,emitted_objects,emitted_cluster_batches,"
+                   << "probed_queries,probed_clusters,"
+                   << "batched_searches,batched_queries,batch_queueing_delay_mean_us,batch_queueing_delay_p99_us" << std::endl;
+        stats_file << semantic_cache_hits << "," << semantic_cache_misses << "," << coalesced_queries << ","
+                   << (inflight_queries ? inflight_queries->size() : 0) << "," << emitted_objects << "," << emitted_cluster_batches << ","
+                   << probed_queries << "," << probed_clusters << ","
+                   << batched_searches << "," << batched_queries << ",";
+        if (this->centroids_embs) {
+            const LatencyHistogram& queueing_delay = this->centroids_embs->get_queueing_delay();
+            stats_file << queueing_delay.get_mean_us() << "," << queueing_delay.get_percentile_us(99) << std::endl;
+        } else {
+            stats_file << "0,0" << std::endl;
+        }
+        std::cout << "Flushed centroids query stats to " << stats_file_name << "." << std::endl;
+    }
+
+    /***
+     * Send a final result to a client, in the same format as the results of the aggregate UDL
+     */
+    void notify_client(DefaultCascadeContextType* typed_ctxt, uint32_t client_id, uint32_t query_batch_id, uint64_t query_id,
+                       std::string_view query_text, const nlohmann::json& top_k_docs, const std::string& error = ""){
+        nlohmann::json result_json;
+        result_json["query"] = std::string(query_text);
+        result_json["top_k_docs"] = top_k_docs;
+        result_json["query_batch_id"] = query_batch_id;
+        result_json["query_id"] = query_id;
+        if (!error.empty()) {
+            result_json["error"] = error;
+        }
+        std::string result_json_str = result_json.dump();
+        Blob result_blob(reinterpret_cast<const uint8_t*>(result_json_str.c_str()), result_json_str.size());
+        try {
+            std::string notification_pathname = "/rag/results/" + std::to_string(client_id);
+            typed_ctxt->get_service_client_ref().notify(result_blob, notification_pathname, client_id);
+        } catch (derecho::derecho_exception& ex) {
+            dbg_default_error("[{}]: exception on notification:{}", __func__, ex.what());
+        }
+    }
+
+    /***
+     * Select the queries of the object that need to be sent down the pipeline:
+     * - a query close to a recently answered one gets the cached result sent back to its client (semantic cache)
+     * - a query identical to one in flight waits for the result of that one (in-flight coalescing)
+     * @param query_indices output, the indices in query_batch of the queries to send down the pipeline
+     */
+    void filter_queries_to_dispatch(const std::string& key_string, const QueryBatchView& query_batch,
+                                    std::vector<uint32_t>& query_indices, DefaultCascadeContextType* typed_ctxt){
+        uint32_t nq = query_batch.size();
+        query_indices.clear();
+        int client_id = -1;
+        int batch_id = -1;
+        if (!parse_batch_id(key_string, client_id, batch_id)) {
+            dbg_default_error("Failed to parse client_id from key: {}, sending all its queries down the pipeline.", key_string);
+            for (uint32_t i = 0; i < nq; i++) {
+                query_indices.push_back(i);
+            }
+            return;
+        }
+        std::vector<std::string>& hit_results = get_scatter_buffers().hit_results;
+        hit_results.resize(nq);
+        if (this->semantic_cache) {
+            int num_hits = this->semantic_cache->lookup(nq, query_batch.embeddings(), hit_results);
+            this->semantic_cache_hits += num_hits;
+            this->semantic_cache_misses += nq - num_hits;
+        }
+        int64_t now_us = steady_clock_now_us();
+        bool coalesce = this->inflight_queries && this->receives_query_results;
+        if (coalesce) {
+            answer_expired_waiters(typed_ctxt, now_us);
+        }
+        for (uint32_t i = 0; i < nq; i++) {
+            uint32_t query_batch_id = get_query_batch_id(query_batch.query_id(i)); // the same as the aggregate UDL reports
+            if (this->semantic_cache && !hit_results[i].empty()) {
+                notify_client(typed_ctxt, client_id, query_batch_id, query_batch.query_id(i), query_batch.query_text(i),
+                              nlohmann::json::parse(hit_results[i]));
+                continue;
+            }
+            const float* emb = query_batch.embedding(i);
+            if (coalesce &&
+                !this->inflight_queries->dispatch_or_wait(query_batch.query_text(i), hash_embedding(emb, this->emb_dim),
+                                                         client_id, query_batch_id, query_batch.query_id(i), now_us)) {
+                this->coalesced_queries++;
+                continue;
+            }
+            if (this->semantic_cache) {
+                this->semantic_cache->add_pending(query_batch.query_id(i), emb);
+            }
+            query_indices.push_back(i);
+        }
+    }
+
+    /***
+     * Answer with an error, and no docs, the coalesced queries whose in-flight query got no result within coalesce_timeout_ms
+     */
+    void answer_expired_waiters(DefaultCascadeContextType* typed_ctxt, int64_t now_us){
+        std::vector<std::pair<std::string, InFlightQueryTable::Waiter>> expired_waiters;
+        this->inflight_queries->expire(now_us, expired_waiters);
+        for (const auto& [query_text, waiter] : expired_waiters) {
+            dbg_default_error("No result came back for the in-flight query of the coalesced query {}, answering it with an error.", waiter.query_id);
+            notify_client(typed_ctxt, waiter.client_id, waiter.query_batch_id, waiter.query_id, query_text, nlohmann::json::array(),
+                          "no result came back for the in-flight query this query was coalesced with");
         }
     }
 
+    /***
+     * Handle a final result sent back by the aggregate UDL, in the format of the results sent to the clients:
+     * {"query": query_text, "top_k_docs": [...], "query_id": query_id, ...}
+     * The result is cached in the semantic cache, and sent to the queries coalesced with it.
+     * Ignored if the query was not sent down the pipeline by this node.
+     */
+    void handle_query_result(const ObjectWithStringKey& object, DefaultCascadeContextType* typed_ctxt){
+        nlohmann::json result_json;
+        try {
+            result_json = nlohmann::json::parse(std::string(reinterpret_cast<const char*>(object.blob.bytes), object.blob.size));
+        } catch (const std::exception& e) {
+            dbg_default_error("{}, failed to parse the query result: {}", __func__, e.what());
+            return;
+        }
+        if (!result_json.contains("query_id") || !result_json["query_id"].is_number_unsigned() ||
+            !result_json.contains("query") || !result_json["query"].is_string() ||
+            !result_json.contains("top_k_docs") || !result_json["top_k_docs"].is_array()) {
+            dbg_default_error("{}, dropped a query result without a valid query_id, query or top_k_docs, key={}.", __func__, object.get_key_ref());
+            return;
+        }
+        const std::string query_text = result_json["query"].get<std::string>();
+        uint64_t query_id = result_json["query_id"].get<uint64_t>();
+        this->receives_query_results = true;
+        if (this->semantic_cache) {
+            this->semantic_cache->fill(query_id, query_text, result_json["top_k_docs"].dump());
+        }
+        if (this->inflight_queries) {
+            for (const auto& waiter : this->inflight_queries->complete(query_id)) {
+                notify_client(typed_ctxt, waiter.client_id, waiter.query_batch_id, waiter.query_id, query_text, result_json["top_k_docs"]);
+            }
+        }
+    }
 
     virtual void ocdpo_handler(const node_id_t sender,
                                const std::string& object_pool_pathname,
@@ -63,14 +676,25 @@ class CentroidsSearchOCDPO: public DefaultOffCriticalDataPathObserver {
                                uint32_t worker_id) override {
         /*** Note: this object_pool_pathname is trigger pathname prefix: /rag/emb/centroids_search instead of /rag/emb, i.e. the objp name***/
         dbg_default_trace("[Centroids search ocdpo]: I({}) received an object from sender:{} with key={}", worker_id, sender, key_string);
-#ifdef ENABLE_VORTEX_EVALUATION_LOGGING
-        // Logging purpose for performance evaluation
+        if (key_string == WARMUP_CONTROL_KEY) {
+            start_warmup(typed_ctxt);
+            return;
+        }
+        if (key_string == QUERY_RESULT_KEY) {
+            handle_query_result(object, typed_ctxt);
+            return;
+        }
         if (key_string == "flush_logs") {
+            flush_query_stats();
+#ifdef ENABLE_VORTEX_EVALUATION_LOGGING
+            // Logging purpose for performance evaluation
             std::string log_file_name = "node" + std::to_string(my_id) + "_udls_timestamp.dat";
             TimestampLogger::flush(log_file_name);
             std::cout << "Flushed logs to " << log_file_name <<"."<< std::endl;
+#endif
             return;
         }
+#ifdef ENABLE_VORTEX_EVALUATION_LOGGING
         int client_id = -1;
         int query_batch_id = -1;
         bool usable_logging_key = parse_batch_id(key_string, client_id, query_batch_id); // Logging purpose
@@ -78,49 +702,69 @@ class CentroidsSearchOCDPO: public DefaultOffCriticalDataPathObserver {
             dbg_default_error("Failed to parse client_id and query_batch_id from key: {}, unable to track correctly.", key_string);
         TimestampLogger::log(LOG_CENTROIDS_EMBEDDINGS_UDL_START,client_id,query_batch_id,this->my_id);
 #endif
-        // 0. check if local cache contains the centroids' embeddings
-        if (cached_centroids_embs == false ) {
-#ifdef ENABLE_VORTEX_EVALUATION_LOGGING
-            TimestampLogger::log(LOG_CENTROIDS_EMBEDDINGS_LOADING_START,this->my_id,0,0);
-#endif
-            //  Fill centroids embs and keep it in memory cache
-            int filled_centroid_embs = this->centroids_embs->retrieve_grouped_embeddings(this->centroids_emb_prefix,typed_ctxt);
-            if (filled_centroid_embs == -1) {
-                dbg_default_error("Failed to fill the centroids embeddings in cache, at centroids_search_udl.");
-                return;
-            }
-            cached_centroids_embs = true;
-#ifdef ENABLE_VORTEX_EVALUATION_LOGGING
-            TimestampLogger::log(LOG_CENTROIDS_EMBEDDINGS_LOADING_END,this->my_id,0,0);
-#endif
+        // 0. check if local cache contains the centroids' embeddings, load them if the warmup has not
+        if (!load_centroids_embs(typed_ctxt)) {
+            return;
         }
 
-        // 1. get the query embeddings from the object
-        float* data;
-        uint32_t nq;
-        std::vector<std::string> query_list;
+        // 1. get the query embeddings from the object, in place
+        QueryBatchView query_batch;
 #ifdef ENABLE_VORTEX_EVALUATION_LOGGING
         TimestampLogger::log(LOG_CENTROIDS_SEARCH_DESERIALIZE_START,client_id,query_batch_id,this->my_id);
 #endif
-        try{
-            deserialize_embeddings_and_quries_from_bytes(object.blob.bytes,object.blob.size,nq,this->emb_dim,data,query_list);
-        } catch (const std::exception& e) {
+        if (!query_batch.parse(object.blob.bytes, object.blob.size, this->emb_dim)) {
             std::cerr << "Error: failed to deserialize the query embeddings and query texts from the object." << std::endl;
-            dbg_default_error("{}, Failed to deserialize the query embeddings and query texts from the object.", __func__);
+            dbg_default_error("{}, Failed to deserialize the query batch of key: {}, size: {}.", __func__, key_string, object.blob.size);
             return;
         }
 #ifdef ENABLE_VORTEX_EVALUATION_LOGGING
         TimestampLogger::log(LOG_CENTROIDS_SEARCH_DESERIALIZE_END,client_id,query_batch_id,this->my_id);
 #endif
+        // 1.1. answer the queries close to a recently answered one, and hold the duplicates of in-flight ones,
+        //      without sending them down the pipeline
+        ScatterBuffers& buffers = get_scatter_buffers();
+        uint32_t nq = query_batch.size();
+        const float* data = query_batch.embeddings();
+        if (this->semantic_cache || this->inflight_queries) {
+            filter_queries_to_dispatch(key_string, query_batch, buffers.query_indices, typed_ctxt);
+            if (buffers.query_indices.empty()) {
+                return;
+            }
+        } else {
+            buffers.query_indices.resize(nq);
+            for (uint32_t i = 0; i < nq; i++) {
+                buffers.query_indices[i] = i;
+            }
+        }
+
+        // 1.2. with batch_centroids_search, leave the search and the emit to batch_search_thread,
+        //      which searches the queries together with those of the other requests pending at that time
+        if (this->batch_centroids_search) {
+            bool started_batch = this->centroids_embs->add_queries(query_batch, buffers.query_indices, key_string);
+            notify_batch_search(started_batch);
+#ifdef ENABLE_VORTEX_EVALUATION_LOGGING
+            TimestampLogger::log(LOG_CENTROIDS_EMBEDDINGS_UDL_END,client_id,query_batch_id,this->my_id);
+#endif
+            return;
+        }
+        if (buffers.query_indices.size() < nq) {
+            nq = static_cast<uint32_t>(buffers.query_indices.size());
+            buffers.dispatched_embs.resize(static_cast<size_t>(nq) * this->emb_dim);
+            for (uint32_t i = 0; i < nq; i++) {
+                std::memcpy(buffers.dispatched_embs.data() + static_cast<size_t>(i) * this->emb_dim,
+                            query_batch.embedding(buffers.query_indices[i]), sizeof(float) * this->emb_dim);
+            }
+            data = buffers.dispatched_embs.data();
+        }
 
         // 2. search the top_num_centroids that are close to the query
-        long* I = new long[this->top_num_centroids * nq];
-        float* D = new float[this->top_num_centroids * nq];
+        buffers.I.resize(static_cast<size_t>(this->top_num_centroids) * nq);
+        buffers.D.resize(static_cast<size_t>(this->top_num_centroids) * nq);
 #ifdef ENABLE_VORTEX_EVALUATION_LOGGING
         TimestampLogger::log(LOG_CENTROIDS_EMBEDDINGS_UDL_SEARCH_START,client_id,query_batch_id,this->my_id);
 #endif
         try{
-            this->centroids_embs->search(nq, data, this->top_num_centroids, D, I);
+            this->centroids_embs->search(nq, const_cast<float*>(data), this->top_num_centroids, buffers.D.data(), buffers.I.data());
         } catch (const std::exception& e) {
             std::cerr << "Error: failed to search the top_num_centroids for the queries." << std::endl;
             dbg_default_error("{}, Failed to search the top_num_centroids for the queries.", __func__);
@@ -135,53 +779,15 @@ class CentroidsSearchOCDPO: public DefaultOffCriticalDataPathObserver {
               trigger the subsequent UDL by evict the queries to shards that contains its top cluster_embs 
               according to affinity set sharding policy
         ***/
-        std::map<long, std::vector<int>> cluster_ids_to_query_ids = std::map<long, std::vector<int>>();
-        combine_common_clusters(I, nq, cluster_ids_to_query_ids);
-#ifdef ENABLE_VORTEX_EVALUATION_LOGGING
-            TimestampLogger::log(LOG_CENTROIDS_EMBEDDINGS_UDL_COMBINE_END,client_id,query_batch_id,this->my_id);
-#endif
-        for (const auto& pair : cluster_ids_to_query_ids) {
-            if (pair.first == -1) {
-                dbg_default_error( "Error: [CentroidsSearchOCDPO] for key: {} a selected cluster among top {}, has cluster_id -1", key_string, this->top_num_centroids);
-                continue;
-            }
-            std::string new_key = key_string + "_cluster" + std::to_string(pair.first);
-            std::vector<int> query_ids = pair.second;
-
-            // create an bytes object by concatenating: num_queries + float array of emebddings + list of query_text
-            uint32_t num_queries = static_cast<uint32_t>(query_ids.size());
-            std::string nq_bytes(4, '\0');
-            nq_bytes[0] = (num_queries >> 24) & 0xFF;
-            nq_bytes[1] = (num_queries >> 16) & 0xFF;
-            nq_bytes[2] = (num_queries >> 8) & 0xFF;
-            nq_bytes[3] = num_queries & 0xFF;
-            float* query_embeddings = new float[this->emb_dim * num_queries];
-            for (uint32_t i = 0; i < num_queries; i++) {
-                int query_id = query_ids[i];
-                for (int j = 0; j < this->emb_dim; j++) {
-                    query_embeddings[i * this->emb_dim + j] = data[query_id * this->emb_dim + j];
-                }
-            }
-            std::vector<std::string> query_texts;
-            for (uint32_t i = 0; i < num_queries; i++) {
-                query_texts.push_back(query_list[query_ids[i]]);
-            }
-            // serialize the query embeddings and query texts, formated as num_queries + query_embeddings + query_texts
-            std::string query_emb_string = nq_bytes +
-                                        std::string(reinterpret_cast<const char*>(query_embeddings), sizeof(float) * this->emb_dim * num_queries) +
-                                        nlohmann::json(query_texts).dump();
-            Blob blob(reinterpret_cast<const uint8_t*>(query_emb_string.c_str()), query_emb_string.size());
+        select_probes(buffers.I.data(), buffers.D.data(), nq, buffers.probe_counts);
+        scatter_to_clusters(buffers, buffers.I.data(), nq, key_string, typed_ctxt);
 #ifdef ENABLE_VORTEX_EVALUATION_LOGGING
-            TimestampLogger::log(LOG_CENTROIDS_EMBEDDINGS_UDL_EMIT_START,client_id,query_batch_id,pair.first);
+        TimestampLogger::log(LOG_CENTROIDS_EMBEDDINGS_UDL_COMBINE_END,client_id,query_batch_id,this->my_id);
 #endif
-            emit(new_key, EMIT_NO_VERSION_AND_TIMESTAMP , blob);
-#ifdef ENABLE_VORTEX_EVALUATION_LOGGING
-            TimestampLogger::log(LOG_CENTROIDS_EMBEDDINGS_UDL_EMIT_END,client_id,query_batch_id,pair.first);
-#endif
-            dbg_default_trace("[Centroids search ocdpo]: Emitted key: {}",new_key);
-        }
-        delete[] I;
-        delete[] D;
+        emit_to_clusters(buffers, RequestQueries{query_batch, buffers.query_indices, data, buffers.probe_counts.data(), this->emb_dim}, key_string,
+                         [&emit](const std::string& key, const Blob& blob){
+                             emit(key, EMIT_NO_VERSION_AND_TIMESTAMP , blob);
+                         });
 #ifdef ENABLE_VORTEX_EVALUATION_LOGGING
         TimestampLogger::log(LOG_CENTROIDS_EMBEDDINGS_UDL_END,client_id,query_batch_id,this->my_id);
 #endif
@@ -202,6 +808,8 @@ public:
 
     void set_config(DefaultCascadeContextType* typed_ctxt, const nlohmann::json& config){
         this->my_id = typed_ctxt->get_service_client_ref().get_my_id();
+        // centroids_embs is replaced below: the threads started by a previous call must not use it meanwhile
+        stop_background_threads();
         try{
             if (config.contains("centroids_emb_prefix")) {
                 this->centroids_emb_prefix = config["centroids_emb_prefix"].get<std::string>();
@@ -215,11 +823,119 @@ public:
             if (config.contains("faiss_search_type")) {
                 this->faiss_search_type = config["faiss_search_type"].get<int>();
             }
-            this->centroids_embs = std::make_unique<GroupedEmbeddingsForSearch>(this->faiss_search_type, this->emb_dim);
+            parse_faiss_index_params(config, this->faiss_index_params);
+            if (config.contains("snapshot_dir")) {
+                this->snapshot_dir = config["snapshot_dir"].get<std::string>();
+            }
+            if (config.contains("snapshot_verify_version")) {
+                this->snapshot_verify_version = config["snapshot_verify_version"].get<bool>();
+            }
+            if (config.contains("warmup")) {
+                this->warmup = config["warmup"].get<bool>();
+            }
+            if (config.contains("semantic_cache_capacity")) {
+                this->semantic_cache_capacity = std::max(0, config["semantic_cache_capacity"].get<int>());
+            }
+            if (config.contains("semantic_cache_threshold")) {
+                this->semantic_cache_threshold = config["semantic_cache_threshold"].get<float>();
+            }
+            if (this->semantic_cache_capacity > SEMANTIC_CACHE_MAX_CAPACITY) {
+                dbg_default_warn("semantic_cache_capacity {} is reduced to {}, the semantic cache is searched by brute force.",
+                                 this->semantic_cache_capacity, SEMANTIC_CACHE_MAX_CAPACITY);
+                this->semantic_cache_capacity = SEMANTIC_CACHE_MAX_CAPACITY;
+            }
+            if (this->semantic_cache_capacity > 0) {
+                this->semantic_cache = std::make_unique<SemanticQueryCache>(this->emb_dim, this->semantic_cache_capacity, this->semantic_cache_threshold);
+            }
+            if (config.contains("coalesce_inflight_queries")) {
+                this->coalesce_inflight_queries = config["coalesce_inflight_queries"].get<bool>();
+            }
+            if (config.contains("coalesce_timeout_ms")) {
+                this->coalesce_timeout_ms = config["coalesce_timeout_ms"].get<int>();
+            }
+            if (config.contains("bundle_cluster_emits")) {
+                this->bundle_cluster_emits = config["bundle_cluster_emits"].get<bool>();
+            }
+            if (config.contains("batch_centroids_search")) {
+                this->batch_centroids_search = config["batch_centroids_search"].get<bool>();
+            }
+            if (config.contains("max_batch_size")) {
+                this->max_batch_size = std::max(1, config["max_batch_size"].get<int>());
+            }
+            if (config.contains("max_batch_wait_us")) {
+                this->max_batch_wait_us = std::max<int64_t>(0, config["max_batch_wait_us"].get<int64_t>());
+            }
+            if (config.contains("batch_destinations")) {
+                // same format as the "destinations" of a DFG vertex: {"pathname": "put" or "trigger_put", ...}
+                this->batch_destinations.clear();
+                for (const auto& [pathname, put_type] : config["batch_destinations"].items()) {
+                    this->batch_destinations.emplace_back(pathname, put_type.get<std::string>() == "trigger_put");
+                }
+            }
+            if (config.contains("max_pending_queries")) {
+                this->max_pending_queries = std::max(0, config["max_pending_queries"].get<int>());
+                if (this->max_pending_queries > 0) {
+                    // a full batch must fit, or it would never be searched before the producers wait for it
+                    this->max_pending_queries = std::max(this->max_pending_queries, this->max_batch_size);
+                }
+            }
+            if (config.contains("adaptive_probe")) {
+                this->adaptive_probe = config["adaptive_probe"].get<bool>();
+            }
+            if (config.contains("min_probe")) {
+                this->min_probe = std::max(1, config["min_probe"].get<int>());
+            }
+            if (config.contains("max_probe")) {
+                this->max_probe = config["max_probe"].get<int>();
+            }
+            if (config.contains("probe_distance_ratio")) {
+                this->probe_distance_ratio = config["probe_distance_ratio"].get<float>();
+            }
+            if (this->adaptive_probe) {
+                // search the max_probe closest clusters, among which select_probes() keeps the ones to send each query to
+                if (this->max_probe > 0) {
+                    this->top_num_centroids = this->max_probe;
+                }
+                this->min_probe = std::min(this->min_probe, this->top_num_centroids);
+            }
+            if (this->coalesce_inflight_queries && this->coalesce_timeout_ms <= 0) {
+                // the timeout is what answers the waiters of a lost result
+                std::cerr << "Error: coalesce_inflight_queries needs a positive coalesce_timeout_ms, queries are not coalesced." << std::endl;
+                dbg_default_error("coalesce_inflight_queries needs a positive coalesce_timeout_ms, queries are not coalesced.");
+                this->coalesce_inflight_queries = false;
+            }
+            if (this->coalesce_inflight_queries) {
+                this->inflight_queries = std::make_unique<InFlightQueryTable>(static_cast<int64_t>(this->coalesce_timeout_ms) * 1000);
+            }
+            // not while a handler is loading the centroids; the new ones are loaded again by the warmup or the next query
+            std::lock_guard<std::mutex> lock(centroids_load_mutex);
+            this->centroids_embs = std::make_unique<GroupedEmbeddingsForSearch>(this->faiss_search_type, this->emb_dim, this->faiss_index_params);
+            if (!this->snapshot_dir.empty()) {
+                this->centroids_embs->enable_snapshots(this->snapshot_dir, this->snapshot_verify_version);
+            }
+            this->centroids_embs->set_max_pending_queries(this->max_pending_queries);
+            this->cached_centroids_embs = false;
         } catch (const std::exception& e) {
             std::cerr << "Error: failed to convert emb_dim or top_num_centroids from config" << std::endl;
             dbg_default_error("Failed to convert emb_dim or top_num_centroids from config, at centroids_search_udl.");
         }
+        stop_warmup = false;
+        {
+            std::lock_guard<std::mutex> lock(batch_search_mutex);
+            stop_batch_search = false;
+        }
+        if (this->warmup) {
+            start_warmup(typed_ctxt);
+        }
+        if (this->batch_centroids_search && this->centroids_embs && !batch_search_thread.joinable()) {
+            batch_search_thread = std::thread([this, typed_ctxt](){
+                batch_search_loop(typed_ctxt);
+            });
+        }
+    }
+
+    ~CentroidsSearchOCDPO() {
+        stop_background_threads();
     }
 };
 
@@ -0,0 +1,69 @@
+#pragma once
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/***
+* Recency order of the clusters cached by a clusters search UDL, for the eviction under its memory budget.
+* A cluster is moved to the front in O(1) when a query reaches it, and victims are taken from the back,
+* so that choosing them does not scan every cached cluster.
+* Thread-safe: touched by the handler threads and the load threads, under its own mutex, never while loading or searching.
+***/
+class ClusterLRU {
+     std::list<int> cluster_ids; // most recently queried at the front
+     std::unordered_map<int, std::list<int>::iterator> positions;
+     mutable std::mutex mutex;
+
+public:
+     /***
+     * Mark a cluster as the most recently queried one, adding it if it is not tracked
+     ***/
+     void touch(int cluster_id) {
+          std::lock_guard<std::mutex> lock(mutex);
+          auto it = positions.find(cluster_id);
+          if (it != positions.end()) {
+               cluster_ids.splice(cluster_ids.begin(), cluster_ids, it->second);
+               return;
+          }
+          cluster_ids.push_front(cluster_id);
+          positions[cluster_id] = cluster_ids.begin();
+     }
+
+     void erase(int cluster_id) {
+          std::lock_guard<std::mutex> lock(mutex);
+          auto it = positions.find(cluster_id);
+          if (it == positions.end()) {
+               return;
+          }
+          cluster_ids.erase(it->second);
+          positions.erase(it);
+     }
+
+     /***
+     * Pick the least recently queried clusters to free bytes_to_free, walking from the back until enough is freed.
+     * @param can_evict: called with (cluster_id, int64_t& memory_bytes), returns false for the clusters that cannot be evicted
+     *                   now, else sets their memory. Called with the mutex of this LRU held: must not touch() it.
+     * @return the victims, least recently queried first; fewer bytes than bytes_to_free if not enough clusters can be evicted
+     ***/
+     template <typename CanEvictFn>
+     std::vector<int> select_victims(int64_t bytes_to_free, CanEvictFn can_evict) const {
+          std::vector<int> victims;
+          std::lock_guard<std::mutex> lock(mutex);
+          int64_t freed_bytes = 0;
+          for (auto it = cluster_ids.rbegin(); it != cluster_ids.rend() && freed_bytes < bytes_to_free; ++it) {
+               int64_t memory_bytes = 0;
+               if (can_evict(*it, memory_bytes)) {
+                    victims.push_back(*it);
+                    freed_bytes += memory_bytes;
+               }
+          }
+          return victims;
+     }
+
+     size_t size() const {
+          std::lock_guard<std::mutex> lock(mutex);
+          return positions.size();
+     }
+};
@@ -1,6 +1,13 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
 #include <iostream>
+#include <set>
 #include <thread>
 
+#include "cluster_lru.hpp"
 #include "search_worker.hpp"
 
 
@@ -9,6 +16,7 @@ namespace cascade{
 
 #define MY_UUID     "11a2c123-2200-21ac-1755-0002ac220000"
 #define MY_DESC     "UDL search within the clusters to find the top K embeddings that the queries close to."
+#define CLUSTER_EMB_PREFIX "/rag/emb/cluster" // the embeddings of cluster i are under /rag/emb/cluster<i>
 
 std::string get_uuid() {
     return MY_UUID;
@@ -22,20 +30,434 @@ class ClustersSearchOCDPO: public DefaultOffCriticalDataPathObserver {
     // These two values could be set by config in dfgs.json.tmp file
     int emb_dim = 64; // dimension of each embedding
     uint32_t top_k = 4; // number of top K embeddings to search
-    int faiss_search_type = 0; // 0: CPU flat search, 1: GPU flat search, 2: GPU IVF search
+    int faiss_search_type = 0; // 0: CPU flat search, 1: GPU flat search, 2: GPU IVF search, 3: CPU IVF search, 4: CPU HNSW search, 5: CPU PQ search with rerank, 6: CPU SIMD flat search, 7: CPU hierarchical search
+    FaissIndexParams faiss_index_params; // IVF, HNSW and PQ parameters, see FaissIndexParams
+    int max_batch_size = MAX_NUM_QUERIES_PER_BATCH; // number of pending queries of a cluster that triggers a batched search
+    int64_t max_batch_wait_us = 0; // max time a query waits for its cluster's batch to fill up; 0: search immediately
+    int max_pending_queries = 0; // max queries buffered per cluster, the handler waits for the search beyond it; 0: unbounded
+    int num_search_workers = std::max(1u, std::thread::hardware_concurrency()); // number of threads searching clusters in parallel
+    ClusterSchedulingPolicy cluster_scheduling = ClusterSchedulingPolicy::ROUND_ROBIN; // "round_robin" or "edf"
+    std::string snapshot_dir; // local directory of the cluster snapshots, reused across restarts; empty: no snapshot
+    bool snapshot_verify_version = true; // fetch the first object of a cluster to check its version before using its snapshot
+    bool warmup = false; // load the clusters of this shard in the background once they are in the KV store, instead of on their first query
+    int num_load_threads = 2; // number of threads loading the clusters missed by queries, in parallel
+    size_t result_cache_capacity = 0; // number of query results cached per cluster, to answer repeated query embeddings without searching; 0: no cache
+    int64_t cluster_cache_memory_bytes = 0; // memory budget of the loaded clusters, the least recently queried idle clusters are evicted beyond it; 0: unbounded
 
     // maps from cluster ID -> embeddings of that cluster, 
-    // use std::unique_ptr to allow multithreading adding queries to different GroupedEmbeddingsForSearch objects
-    std::unordered_map<int, std::unique_ptr<GroupedEmbeddingsForSearch>> cluster_search_index;
+    // use std::shared_ptr to allow multithreading adding queries to different GroupedEmbeddingsForSearch objects,
+    // and to keep an evicted cluster alive until the threads using it are done
+    // A cluster is inserted as soon as a query misses it, as the placeholder of its asynchronous loading:
+    // it buffers the queries of that cluster until its embeddings are loaded, see EmbeddingsLoadState.
+    std::unordered_map<int, std::shared_ptr<GroupedEmbeddingsForSearch>> cluster_search_index;
+    ClusterLRU cluster_lru; // recency of the clusters in cluster_search_index, only maintained with a cluster_cache_memory_bytes budget
+
+    // cluster cache statistics, written by flush_logs
+    std::atomic<uint64_t> cache_hits = 0; // query objects to a loaded cluster
+    std::atomic<uint64_t> cache_misses = 0; // query objects that waited for the loading of their cluster
+    std::atomic<uint64_t> cache_loads = 0;
+    std::atomic<uint64_t> cache_evictions = 0;
+    std::atomic<int64_t> cache_resident_bytes = 0; // get_memory_bytes() of the loaded clusters
+    std::atomic<uint64_t> result_cache_hits = 0; // queries answered from the result cache of their cluster
+    std::atomic<uint64_t> result_cache_misses = 0;
 
     int my_id; // the node id of this node; logging purpose
 
     mutable std::shared_mutex cluster_search_index_map_mutex;
-    mutable std::condition_variable_any cluster_search_index_cv;
-    std::atomic<bool> execution_thread_running = true;
-    std::thread search_worker_thread;
+    std::unique_ptr<ClusterSearchWorkerPool> search_worker_pool;
+
+    std::thread warmup_thread;
+    std::atomic<bool> warmup_running = false;
+    std::atomic<bool> stop_warmup = false;
+
+    // clusters claimed by try_start_loading(), loaded by the load threads in the order they were missed
+    std::deque<std::pair<int, std::shared_ptr<GroupedEmbeddingsForSearch>>> clusters_to_load;
+    std::mutex load_queue_mutex;
+    std::condition_variable load_queue_cv;
+    bool loaders_running = false;
+    std::vector<std::thread> load_threads;
     
 private:
+    /***
+     * Write the queueing delay (from add_queries to the start of its batched search) of the queries of each cluster
+     * Format per line: cluster_id,num_queries,mean_us,p50_us,p99_us,max_us
+     */
+    void flush_queueing_delay_stats() {
+        std::string stats_file_name = "node" + std::to_string(my_id) + "_cluster_queueing_delay.csv";
+        std::ofstream stats_file(stats_file_name);
+        if (!stats_file.is_open()) {
+            std::cerr << "Error: failed to open " << stats_file_name << std::endl;
+            return;
+        }
+        stats_file << "cluster_id,num_queries,mean_us,p50_us,p99_us,max_us" << std::endl;
+        std::shared_lock<std::shared_mutex> read_lock(cluster_search_index_map_mutex);
+        for (const auto& [cluster_id, cluster_index] : cluster_search_index) {
+            const LatencyHistogram& queueing_delay = cluster_index->get_queueing_delay();
+            stats_file << cluster_id << "," << queueing_delay.get_count() << "," << queueing_delay.get_mean_us() << ","
+                       << queueing_delay.get_percentile_us(50) << "," << queueing_delay.get_percentile_us(99) << ","
+                       << queueing_delay.get_max_us() << std::endl;
+        }
+        std::cout << "Flushed cluster queueing delay to " << stats_file_name << "." << std::endl;
+    }
+
+    /***
+     * Write the cluster cache counters. 
+     * Format: hits,misses,loads,evictions,resident_bytes,memory_budget_bytes,result_cache_hits,result_cache_misses
+     */
+    void flush_cache_stats() {
+        std::string stats_file_name = "node" + std::to_string(my_id) + "_cluster_cache_stats.csv";
+        std::ofstream stats_file(stats_file_name);
+        if (!stats_file.is_open()) {
+            std::cerr << "Error: failed to open " << stats_file_name << std::endl;
+            return;
+        }
+        stats_file << "hits,misses,loads,evictions,resident_bytes,memory_budget_bytes,result_cache_hits,result_cache_misses" << std::endl;
+        stats_file << cache_hits << "," << cache_misses << "," << cache_loads << "," << cache_evictions << ","
+                   << cache_resident_bytes << "," << cluster_cache_memory_bytes << ","
+                   << result_cache_hits << "," << result_cache_misses << std::endl;
+        std::cout << "Flushed cluster cache stats to " << stats_file_name << "." << std::endl;
+    }
+
+    /***
+     * Get the cluster from the map, inserting an empty placeholder for it if it is not cached.
+     * Must be called with the exclusive lock of the map held.
+     */
+    std::shared_ptr<GroupedEmbeddingsForSearch>& find_or_insert_cluster(int cluster_id){
+        auto& cluster_index = this->cluster_search_index[cluster_id];
+        if (!cluster_index) {
+            cluster_index = std::make_shared<GroupedEmbeddingsForSearch>(this->faiss_search_type, this->emb_dim, this->faiss_index_params);
+            if (!this->snapshot_dir.empty()) {
+                cluster_index->enable_snapshots(this->snapshot_dir, this->snapshot_verify_version);
+            }
+            cluster_index->enable_result_cache(this->result_cache_capacity);
+            cluster_index->set_max_pending_queries(this->max_pending_queries);
+        }
+        return cluster_index;
+    }
+
+    /***
+     * Get the search index of a cluster, or insert an empty placeholder for it if the cluster is not cached.
+     * The exclusive lock of the map is only held to insert the placeholder, never while loading.
+     */
+    std::shared_ptr<GroupedEmbeddingsForSearch> get_or_create_cluster_index(int cluster_id){
+        {
+            std::shared_lock<std::shared_mutex> read_lock(cluster_search_index_map_mutex);
+            auto it = this->cluster_search_index.find(cluster_id);
+            if (it != this->cluster_search_index.end()){
+                return it->second;
+            }
+        }
+        std::unique_lock<std::shared_mutex> write_lock(cluster_search_index_map_mutex);
+        return find_or_insert_cluster(cluster_id);
+    }
+
+    /***
+     * Add queries to a cluster, or to a new placeholder of it if the cluster is not cached.
+     * The queries are added while holding the lock of the map, so that a cluster cannot be evicted 
+     * between its lookup and try_add_queries(), which would lose the queries.
+     * If the pending batch of the cluster is full (max_pending_queries), waits for its search without holding the lock,
+     * then looks the cluster up again, since it may have been evicted once its batch was searched.
+     * @param started_batch set by try_add_queries()
+     */
+    std::shared_ptr<GroupedEmbeddingsForSearch> add_queries_to_cluster(int cluster_id, const QueryBatchView& query_batch,
+                                                                       const std::vector<uint32_t>& query_indices,
+                                                                       const std::string& key_string, bool& started_batch){
+        while (true) {
+            std::shared_ptr<GroupedEmbeddingsForSearch> full_cluster_index;
+            {
+                std::shared_lock<std::shared_mutex> read_lock(cluster_search_index_map_mutex);
+                auto it = this->cluster_search_index.find(cluster_id);
+                if (it != this->cluster_search_index.end()){
+                    if (it->second->try_add_queries(query_batch, query_indices, key_string, started_batch)) {
+                        return it->second;
+                    }
+                    full_cluster_index = it->second;
+                }
+            }
+            if (!full_cluster_index) {
+                std::unique_lock<std::shared_mutex> write_lock(cluster_search_index_map_mutex);
+                std::shared_ptr<GroupedEmbeddingsForSearch>& cluster_index = find_or_insert_cluster(cluster_id);
+                if (cluster_index->try_add_queries(query_batch, query_indices, key_string, started_batch)) {
+                    return cluster_index;
+                }
+                full_cluster_index = cluster_index;
+            }
+            full_cluster_index->wait_for_pending_space(static_cast<int>(query_indices.size()));
+        }
+    }
+
+    /***
+     * Emit the results of the queries that are in the result cache of their loaded cluster, and keep the others to search
+     * @param query_indices: the indices in query_batch of the queries to answer; on return, only the queries to search
+     */
+    void answer_cached_queries(int cluster_id, const QueryBatchView& query_batch, std::vector<uint32_t>& query_indices,
+                               const std::string& key_string){
+        std::shared_ptr<GroupedEmbeddingsForSearch> cluster_index;
+        {
+            std::shared_lock<std::shared_mutex> read_lock(cluster_search_index_map_mutex);
+            auto it = this->cluster_search_index.find(cluster_id);
+            if (it == this->cluster_search_index.end() || !it->second->is_loaded() || !it->second->has_result_cache()){
+                return;
+            }
+            cluster_index = it->second;
+        }
+        std::vector<long> hit_I(query_indices.size() * this->top_k);
+        std::vector<float> hit_D(query_indices.size() * this->top_k);
+        StringList hit_texts;
+        StringList hit_keys;
+        std::vector<uint64_t> hit_ids;
+        std::vector<uint32_t> hit_probe_counts;
+        size_t num_missed = 0;
+        for (uint32_t i : query_indices) {
+            const float* emb = query_batch.embedding(i);
+            size_t hit_offset = hit_ids.size() * this->top_k;
+            if (cluster_index->lookup_cached_result(emb, this->top_k, hit_I.data() + hit_offset, hit_D.data() + hit_offset)) {
+                hit_texts.add(query_batch.query_text(i));
+                hit_keys.add(key_string);
+                hit_ids.push_back(query_batch.query_id(i));
+                hit_probe_counts.push_back(query_batch.probe_count(i));
+            } else {
+                query_indices[num_missed++] = i;
+            }
+        }
+        query_indices.resize(num_missed);
+        this->result_cache_hits += hit_ids.size();
+        this->result_cache_misses += num_missed;
+        if (!hit_ids.empty()) {
+            search_worker_pool->emit_results(hit_keys, hit_texts, hit_ids, hit_probe_counts, hit_I.data(), hit_D.data());
+        }
+    }
+
+    /***
+     * Answer the queries of a cluster from its result cache, and add the others to its pending batch
+     * @param query_indices: the indices in query_batch of the queries of the cluster, modified
+     * @param key_string: the key of the queries of this cluster, client{client_id}_qb{query_batch_id}_cluster{cluster_id}
+     */
+    void search_cluster_queries(int cluster_id, const QueryBatchView& query_batch, std::vector<uint32_t>& query_indices,
+                                const std::string& key_string){
+        // 2. answer the repeated queries from the result cache of the cluster
+        if (this->result_cache_capacity > 0) {
+            answer_cached_queries(cluster_id, query_batch, query_indices, key_string);
+        }
+        if (query_indices.empty()) {
+            return;
+        }
+        // 3. add the queries to the local cache of the cluster, or to its placeholder if its embeddings are not loaded yet
+        bool started_batch = false;
+        std::shared_ptr<GroupedEmbeddingsForSearch> cluster_index = add_queries_to_cluster(cluster_id, query_batch, query_indices, key_string, started_batch);
+        if (this->cluster_cache_memory_bytes > 0) {
+            this->cluster_lru.touch(cluster_id);
+        }
+        if (!cluster_index->is_loaded()) {
+            // the queries wait in the placeholder, and are scheduled by the load of the cluster
+            this->cache_misses++;
+            request_cluster_load(cluster_id, cluster_index);
+            return;
+        }
+        this->cache_hits++;
+        search_worker_pool->notify_queries_added(cluster_id, cluster_index.get(), started_batch);
+    }
+
+    /***
+     * Evict the least recently queried idle clusters, until the loaded clusters fit in cluster_cache_memory_bytes.
+     * Clusters with pending or in-flight queries are never evicted; the search workers keep a shared_ptr to the cluster they search.
+     * The victims are picked from the back of cluster_lru under the shared lock of the map, 
+     * and the exclusive lock is only held to check that they are still idle and erase them.
+     * @param loaded_cluster_id the cluster that was just loaded, not evicted
+     */
+    void evict_clusters_over_budget(int loaded_cluster_id){
+        int64_t bytes_to_free = this->cache_resident_bytes - this->cluster_cache_memory_bytes;
+        if (this->cluster_cache_memory_bytes <= 0 || bytes_to_free <= 0) {
+            return;
+        }
+        std::vector<int> victim_ids;
+        std::vector<std::shared_ptr<GroupedEmbeddingsForSearch>> victims;
+        {
+            std::shared_lock<std::shared_mutex> read_lock(cluster_search_index_map_mutex);
+            victim_ids = this->cluster_lru.select_victims(bytes_to_free, [&](int cluster_id, int64_t& memory_bytes){
+                auto it = this->cluster_search_index.find(cluster_id);
+                if (cluster_id == loaded_cluster_id || it == this->cluster_search_index.end() || !it->second->is_idle()) {
+                    return false;
+                }
+                memory_bytes = it->second->get_memory_bytes();
+                victims.push_back(it->second);
+                return true;
+            });
+        }
+        if (victim_ids.empty()) {
+            dbg_default_warn("[{}]: {} bytes of clusters loaded, over the budget of {} bytes, but no idle cluster to evict.",
+                             __func__, this->cache_resident_bytes.load(), this->cluster_cache_memory_bytes);
+            return;
+        }
+        std::vector<std::shared_ptr<GroupedEmbeddingsForSearch>> evicted_clusters; // freed after the lock is released
+        {
+            std::unique_lock<std::shared_mutex> write_lock(cluster_search_index_map_mutex);
+            for (size_t i = 0; i < victim_ids.size(); i++) {
+                // a query may have reached the victim, or it may have been evicted and reloaded, since it was picked
+                auto it = this->cluster_search_index.find(victim_ids[i]);
+                if (it == this->cluster_search_index.end() || it->second != victims[i] || !it->second->is_idle()) {
+                    continue;
+                }
+                dbg_default_debug("[{}]: evicting cluster {}.", __func__, victim_ids[i]);
+                this->cache_resident_bytes -= it->second->get_memory_bytes();
+                evicted_clusters.push_back(std::move(it->second));
+                this->cluster_search_index.erase(it);
+                this->cluster_lru.erase(victim_ids[i]);
+                this->cache_evictions++;
+            }
+        }
+    }
+
+    /***
+     * Load the embeddings of a cluster claimed by try_start_loading(), without holding any lock of the map, 
+     * then schedule the queries that were buffered during the loading.
+     * @return false if the cluster failed to load, then the next query to the cluster retries
+     */
+    bool load_cluster(int cluster_id, GroupedEmbeddingsForSearch* cluster_index, DefaultCascadeContextType* typed_ctxt){
+#ifdef ENABLE_VORTEX_EVALUATION_LOGGING
+        TimestampLogger::log(LOG_CLUSTER_SEARCH_UDL_LOADEMB_START,this->my_id,cluster_id,0);
+#endif
+        // load the embeddings of the cluster from the cascade
+        std::string cluster_prefix = CLUSTER_EMB_PREFIX + std::to_string(cluster_id);
+        int filled_cluster_embs = cluster_index->retrieve_grouped_embeddings(cluster_prefix,typed_ctxt);
+        if (filled_cluster_embs == -1) {
+            std::cerr << "Error: failed to fill the cluster embeddings in cache" << std::endl;
+            dbg_default_error("Failed to fill the cluster embeddings in cache for cluster_id={}, at clusters_search_udl.", cluster_id);
+            // answer the queries that waited for this load with no results, so that the aggregate UDL does not wait for them;
+            // the next query of this cluster retries the load
+            PendingQueryBatch failed_queries;
+            cluster_index->finish_loading(false, &failed_queries);
+            if (!failed_queries.query_ids.empty()) {
+                dbg_default_error("Answered {} queries of cluster_id={} with no results, after its load failed.", failed_queries.query_ids.size(), cluster_id);
+                search_worker_pool->emit_empty_results(failed_queries.query_keys, failed_queries.query_texts, failed_queries.query_ids,
+                                                       failed_queries.query_probe_counts);
+            }
+            return false;
+        }
+#ifdef ENABLE_VORTEX_EVALUATION_LOGGING
+        TimestampLogger::log(LOG_CLUSTER_SEARCH_UDL_LOADEMB_END,this->my_id,cluster_id,0);
+#endif
+        cluster_index->finish_loading(true);
+        this->cache_loads++;
+        this->cache_resident_bytes += cluster_index->get_memory_bytes();
+        if (this->cluster_cache_memory_bytes > 0) {
+            // also tracks the clusters loaded by the warmup, before their first query
+            this->cluster_lru.touch(cluster_id);
+        }
+        evict_clusters_over_budget(cluster_id);
+        if (cluster_index->has_pending_queries()) {
+            search_worker_pool->notify_queries_added(cluster_id, cluster_index, true);
+        }
+        return true;
+    }
+
+    /***
+     * Queue the loading of a cluster to the load threads, unless it is loaded or already being loaded
+     */
+    void request_cluster_load(int cluster_id, const std::shared_ptr<GroupedEmbeddingsForSearch>& cluster_index){
+        if (!cluster_index->try_start_loading()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(load_queue_mutex);
+            clusters_to_load.emplace_back(cluster_id, cluster_index);
+        }
+        load_queue_cv.notify_one();
+    }
+
+    void start_load_threads(DefaultCascadeContextType* typed_ctxt){
+        std::lock_guard<std::mutex> lock(load_queue_mutex);
+        if (loaders_running) {
+            return;
+        }
+        loaders_running = true;
+        for (int i = 0; i < num_load_threads; i++) {
+            load_threads.emplace_back([this, typed_ctxt](){
+                while (true) {
+                    std::pair<int, std::shared_ptr<GroupedEmbeddingsForSearch>> cluster_to_load;
+                    {
+                        std::unique_lock<std::mutex> lock(load_queue_mutex);
+                        load_queue_cv.wait(lock, [this](){ return !loaders_running || !clusters_to_load.empty(); });
+                        if (!loaders_running) {
+                            return;
+                        }
+                        cluster_to_load = clusters_to_load.front();
+                        clusters_to_load.pop_front();
+                    }
+                    load_cluster(cluster_to_load.first, cluster_to_load.second.get(), typed_ctxt);
+                }
+            });
+        }
+    }
+
+    void stop_load_threads(){
+        {
+            std::lock_guard<std::mutex> lock(load_queue_mutex);
+            loaders_running = false;
+        }
+        load_queue_cv.notify_all();
+        for (auto& thread : load_threads) {
+            if (thread.joinable()) {
+                thread.join();
+            }
+        }
+    }
+
+    /***
+     * Load the clusters of this shard, i.e. the clusters whose trigger keys hash to this shard by the affinity set regex,
+     * once their embeddings are in the KV store
+     */
+    void warm_up_clusters(DefaultCascadeContextType* typed_ctxt){
+        auto& service_client = typed_ctxt->get_service_client_ref();
+        std::vector<std::string> emb_keys = wait_for_keys(service_client, CLUSTER_EMB_PREFIX, CURRENT_VERSION, true, this->stop_warmup);
+        std::set<int> cluster_ids;
+        for (const auto& emb_key : emb_keys) {
+            int cluster_id;
+            if (parse_number(emb_key, CLUSTER_EMB_PREFIX, cluster_id)) {
+                cluster_ids.insert(cluster_id);
+            }
+        }
+        int num_loaded_clusters = 0;
+        for (int cluster_id : cluster_ids) {
+            if (this->stop_warmup.load()) {
+                break;
+            }
+            if (this->cluster_cache_memory_bytes > 0 && this->cache_resident_bytes >= this->cluster_cache_memory_bytes) {
+                // the remaining clusters are loaded by their first query, instead of evicting the warmed up ones
+                break;
+            }
+            // the shard that the centroids search UDL emits the queries of this cluster to
+            std::string trigger_key = std::string(CLUSTERS_SEARCH_PATHNAME) + "/" + WARMUP_CONTROL_KEY + CLUSTER_KEY_DELIMITER + std::to_string(cluster_id);
+            auto [subgroup_type_index, subgroup_index, shard_index] = service_client.key_to_shard(trigger_key);
+            if (static_cast<int>(shard_index) != get_my_shard_index<VolatileCascadeStoreWithStringKey>(service_client, subgroup_index)) {
+                continue;
+            }
+            // loaded on this thread, unless a query has already requested it
+            std::shared_ptr<GroupedEmbeddingsForSearch> cluster_index = get_or_create_cluster_index(cluster_id);
+            if (cluster_index->try_start_loading() && load_cluster(cluster_id, cluster_index.get(), typed_ctxt)) {
+                num_loaded_clusters++;
+            }
+        }
+        std::cout << "Warmed up " << num_loaded_clusters << " clusters of this shard." << std::endl;
+    }
+
+    /***
+     * Start warm_up_clusters() on a background thread, unless a warmup is already in progress.
+     * Started by set_config() with "warmup", or by putting the WARMUP_CONTROL_KEY to the trigger path.
+     */
+    void start_warmup(DefaultCascadeContextType* typed_ctxt){
+        if (warmup_running.exchange(true)) {
+            return;
+        }
+        if (warmup_thread.joinable()) {
+            warmup_thread.join();
+        }
+        warmup_thread = std::thread([this, typed_ctxt](){
+            warm_up_clusters(typed_ctxt);
+            warmup_running = false;
+        });
+    }
+
     virtual void ocdpo_handler(const node_id_t sender,
                                const std::string& object_pool_pathname,
                                const std::string& key_string,
@@ -46,6 +468,15 @@ private:
 
         /*** Note: this object_pool_pathname is trigger pathname prefix: /rag/emb/clusteres_search instead of /rag/emb, i.e. the objp name***/
         dbg_default_trace("[Clusters search ocdpo]: I({}) received an object from sender:{} with key={}", worker_id, sender, key_string);
+        if (key_string == "flush_logs") {
+            flush_queueing_delay_stats();
+            flush_cache_stats();
+            return;
+        }
+        if (key_string == WARMUP_CONTROL_KEY) {
+            start_warmup(typed_ctxt);
+            return;
+        }
         // 0. get the cluster ID
         int cluster_id;
         bool extracted_clusterid = parse_number(key_string, CLUSTER_KEY_DELIMITER, cluster_id); 
@@ -62,54 +493,41 @@ private:
             dbg_default_error("Failed to parse client_id and query_batch_id from key: {}, unable to track correctly.", key_string);
         TimestampLogger::log(LOG_CLUSTER_SEARCH_UDL_START,client_id,query_batch_id,cluster_id);
 #endif
-        // 1. check if local cache contains the embeddings of the cluster
-        // std::unique_lock<std::mutex> lock(this->cluster_search_index_map_mutex);
-        {
-            std::shared_lock<std::shared_mutex> read_lock(cluster_search_index_map_mutex);
-            auto it = this->cluster_search_index.find(cluster_id);
-            if (it == this->cluster_search_index.end()){
-#ifdef ENABLE_VORTEX_EVALUATION_LOGGING
-                TimestampLogger::log(LOG_CLUSTER_SEARCH_UDL_LOADEMB_START,this->my_id,cluster_id,0);
-#endif
-                read_lock.unlock();
-                std::unique_lock<std::shared_mutex> write_lock(cluster_search_index_map_mutex);
-                // load the embeddings of the cluster from the cascade
-                
-                this->cluster_search_index[cluster_id]= std::make_unique<GroupedEmbeddingsForSearch>(this->faiss_search_type, this->emb_dim);
-                std::string cluster_prefix = "/rag/emb/cluster" + std::to_string(cluster_id);
-                int filled_cluster_embs = this->cluster_search_index[cluster_id]->retrieve_grouped_embeddings(cluster_prefix,typed_ctxt);
-                if (filled_cluster_embs == -1) {
-                    std::cerr << "Error: failed to fill the cluster embeddings in cache" << std::endl;
-                    dbg_default_error("Failed to fill the cluster embeddings in cache, at clusters_search_udl.");
-                    return;
-                }
-#ifdef ENABLE_VORTEX_EVALUATION_LOGGING
-                TimestampLogger::log(LOG_CLUSTER_SEARCH_UDL_LOADEMB_END,this->my_id,cluster_id,0);
-#endif
-                it = this->cluster_search_index.find(cluster_id);
-            }
-        }
-
-        // 2. get the query embeddings from the object
-
-        float* data;
-        uint32_t nq;
-        std::vector<std::string> query_list;
+        // 1. get the query embeddings from the object, in place:
+        //    the queries of one cluster, or a bundle of the queries of the clusters of this shard
+        QueryBatchView query_batch;
+        ClusterBundleView cluster_bundle;
+        bool is_bundle = is_cluster_bundle(object.blob.bytes, object.blob.size);
 #ifdef ENABLE_VORTEX_EVALUATION_LOGGING
         TimestampLogger::log(LOG_CLUSTER_SEARCH_DESERIALIZE_START,client_id,query_batch_id,cluster_id);
 #endif
-        try{
-            deserialize_embeddings_and_quries_from_bytes(object.blob.bytes,object.blob.size,nq,this->emb_dim,data,query_list);
-        } catch (const std::exception& e) {
+        bool parsed = is_bundle ? cluster_bundle.parse(object.blob.bytes, object.blob.size, this->emb_dim)
+                                : query_batch.parse(object.blob.bytes, object.blob.size, this->emb_dim);
+        if (!parsed) {
             std::cerr << "Error: failed to deserialize the query embeddings and query texts from the object." << std::endl;
-            dbg_default_error("{}, Failed to deserialize the query embeddings and query texts from the object.", __func__);
+            dbg_default_error("{}, Failed to deserialize the query batch of key: {}, size: {}.", __func__, key_string, object.blob.size);
             return;
         }
 #ifdef ENABLE_VORTEX_EVALUATION_LOGGING
         TimestampLogger::log(LOG_CLUSTER_SEARCH_DESERIALIZE_END,client_id,query_batch_id,cluster_id);
 #endif
-        cluster_search_index.at(cluster_id)->add_queries(nq, data, std::move(query_list), key_string);
-        cluster_search_index_cv.notify_one();
+        std::vector<uint32_t> query_indices; // indices in the query batch of the queries of a cluster
+        if (!is_bundle) {
+            query_indices.resize(query_batch.size());
+            for (uint32_t i = 0; i < query_batch.size(); i++) {
+                query_indices[i] = i;
+            }
+            search_cluster_queries(cluster_id, query_batch, query_indices, key_string);
+        } else {
+            // the key of the bundle names its first cluster; each cluster gets its own key, by which the aggregate UDL tells its results apart
+            std::string key_prefix = key_string.substr(0, key_string.rfind(CLUSTER_KEY_DELIMITER)) + CLUSTER_KEY_DELIMITER;
+            for (uint32_t c = 0; c < cluster_bundle.size(); c++) {
+                cluster_bundle.get_query_indices(c, query_indices);
+                long bundle_cluster_id = cluster_bundle.cluster_id(c);
+                search_cluster_queries(static_cast<int>(bundle_cluster_id), cluster_bundle.query_batch(), query_indices,
+                                       key_prefix + std::to_string(bundle_cluster_id));
+            }
+        }
         dbg_default_trace("[Cluster search ocdpo]: FINISHED knn search for key: {}.", key_string );
     }
 
@@ -137,23 +555,78 @@ public:
             if (config.contains("faiss_search_type")) {
                 this->faiss_search_type = config["faiss_search_type"].get<int>();
             }
+            parse_faiss_index_params(config, this->faiss_index_params);
+            if (config.contains("max_batch_size")) {
+                this->max_batch_size = std::max(1, config["max_batch_size"].get<int>());
+            }
+            if (config.contains("max_batch_wait_us")) {
+                this->max_batch_wait_us = std::max<int64_t>(0, config["max_batch_wait_us"].get<int64_t>());
+            }
+            if (config.contains("max_pending_queries")) {
+                this->max_pending_queries = std::max(0, config["max_pending_queries"].get<int>());
+            }
+            if (config.contains("num_search_workers")) {
+                this->num_search_workers = std::max(1, config["num_search_workers"].get<int>());
+            }
+            if (config.contains("snapshot_dir")) {
+                this->snapshot_dir = config["snapshot_dir"].get<std::string>();
+            }
+            if (config.contains("snapshot_verify_version")) {
+                this->snapshot_verify_version = config["snapshot_verify_version"].get<bool>();
+            }
+            if (config.contains("warmup")) {
+                this->warmup = config["warmup"].get<bool>();
+            }
+            if (config.contains("num_load_threads")) {
+                this->num_load_threads = std::max(1, config["num_load_threads"].get<int>());
+            }
+            if (config.contains("result_cache_capacity")) {
+                this->result_cache_capacity = config["result_cache_capacity"].get<size_t>();
+            }
+            if (config.contains("cluster_cache_memory_mb")) {
+                this->cluster_cache_memory_bytes = std::max<int64_t>(0, config["cluster_cache_memory_mb"].get<int64_t>()) * 1024 * 1024;
+            }
+            if (config.contains("cluster_scheduling")) {
+                std::string cluster_scheduling_name = config["cluster_scheduling"].get<std::string>();
+                if (cluster_scheduling_name == "edf") {
+                    this->cluster_scheduling = ClusterSchedulingPolicy::EDF;
+                } else if (cluster_scheduling_name == "round_robin") {
+                    this->cluster_scheduling = ClusterSchedulingPolicy::ROUND_ROBIN;
+                } else {
+                    std::cerr << "Error: unknown cluster_scheduling " << cluster_scheduling_name << ", use round_robin" << std::endl;
+                    dbg_default_error("Unknown cluster_scheduling {}, at clusters_search_udl.", cluster_scheduling_name);
+                }
+            }
         } catch (const std::exception& e) {
-            std::cerr << "Error: failed to convert emb_dim or top_k from config" << std::endl;
-            dbg_default_error("Failed to convert emb_dim or top_k from config, at clusters_search_udl.");
+            std::cerr << "Error: failed to convert emb_dim, top_k, batching policy or num_search_workers from config" << std::endl;
+            dbg_default_error("Failed to convert emb_dim, top_k, batching policy or num_search_workers from config, at clusters_search_udl.");
+        }
+        if (this->max_pending_queries > 0) {
+            // a full batch must fit, or it would never be searched before the producers wait for it
+            this->max_pending_queries = std::max(this->max_pending_queries, this->max_batch_size);
+        }
+        if (!search_worker_pool) {
+            search_worker_pool = std::make_unique<ClusterSearchWorkerPool>(static_cast<int>(top_k), cluster_search_index,
+                                                                           cluster_search_index_map_mutex,
+                                                                           max_batch_size, max_batch_wait_us,
+                                                                           cluster_scheduling, typed_ctxt);
+            search_worker_pool->start(num_search_workers);
+        }
+        start_load_threads(typed_ctxt);
+        if (this->warmup) {
+            start_warmup(typed_ctxt);
         }
-        search_worker_thread = std::thread([this, typed_ctxt]() {
-        ClusterSearchWorker worker(static_cast<int>(top_k), cluster_search_index, cluster_search_index_cv,
-                                       cluster_search_index_map_mutex, execution_thread_running);
-            worker.search_and_emit(typed_ctxt);
-        });
     }
 
     /*** TODO: double check the correct way to clean up thread */
     ~ClustersSearchOCDPO() {
-        execution_thread_running = false;
-        cluster_search_index_cv.notify_all();
-        if (search_worker_thread.joinable()) {
-            search_worker_thread.join();
+        stop_warmup = true;
+        if (warmup_thread.joinable()) {
+            warmup_thread.join();
+        }
+        stop_load_threads();
+        if (search_worker_pool) {
+            search_worker_pool->stop();
         }
     }
 };
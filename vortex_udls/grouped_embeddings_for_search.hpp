@@ -1,72 +1,293 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <condition_variable>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <limits>
 #include <memory>
 #include <mutex>
 #include <random>
+#include <string>
+#include <string_view>
 #include <unordered_map>
+#include <vector>
 
 #include <cascade/user_defined_logic_interface.hpp>
 #include <cascade/utils.hpp>
 #include <cascade/cascade_interface.hpp>
 
 #include <faiss/IndexFlat.h>
+#include <faiss/IndexHNSW.h>
+#include <faiss/IndexIVFFlat.h>
+#include <faiss/IndexPQ.h>
+#include <faiss/IndexPreTransform.h>
+#include <faiss/VectorTransform.h>
+#include <faiss/index_io.h>
+#include <faiss/impl/io.h>
+#include <faiss/utils/distances.h>
 #include <faiss/gpu/GpuIndexFlat.h>
 #include <faiss/gpu/GpuIndexIVFFlat.h>
 #include <faiss/gpu/StandardGpuResources.h>
 
+#include "hierarchical_index.hpp"
+#include "query_result_cache.hpp"
 #include "rag_utils.hpp"
+#include "simd_flat_search.hpp"
+#include "snapshot.hpp"
 
-#define MAX_NUM_QUERIES_PER_BATCH 100
+#define IVF_TRAINING_POINTS_PER_LIST 256 // training embeddings per IVF list or PQ centroid, when they have to be copied together
+#define MAX_NUM_QUERIES_PER_BATCH 100 // initial capacity of each query batch buffer, and default max_batch_size
 
 namespace derecho{
 namespace cascade{
 
+/***
+ * Strings stored back to back in one buffer, so that adding a string does not allocate once the buffers have grown.
+ */
+struct StringList{
+     std::string blob;
+     std::vector<uint32_t> ends; // end offset in blob of each string
+
+     void add(std::string_view str){
+          blob.append(str.data(), str.size());
+          ends.push_back(static_cast<uint32_t>(blob.size()));
+     }
+
+     std::string_view operator[](size_t i) const{
+          size_t begin = (i == 0) ? 0 : ends[i - 1];
+          return std::string_view(blob.data() + begin, ends[i] - begin);
+     }
+
+     size_t size() const{
+          return ends.size();
+     }
+
+     void clear(){
+          blob.clear();
+          ends.clear();
+     }
+};
+
+/***
+ * Queries accumulated for one batchedSearch() call of a GroupedEmbeddingsForSearch.
+ * query_ids, query_probe_counts, query_texts and query_keys are 1-1 correspondence with the embeddings in embs.
+ */
+struct PendingQueryBatch{
+     std::vector<float> embs; // flatten query embeddings
+     std::vector<uint64_t> query_ids; // client-assigned query ids
+     std::vector<uint32_t> query_probe_counts; // number of clusters each query is sent to, set by the centroids search UDL
+     StringList query_texts; // query texts list
+     StringList query_keys; // query key list 1-1 correspondence with query_texts
+     std::vector<int64_t> arrival_us; // steady_clock_now_us() when each query was added
+
+     void reserve(int num_queries, int emb_dim){
+          embs.reserve(static_cast<size_t>(num_queries) * emb_dim);
+          query_ids.reserve(num_queries);
+          query_probe_counts.reserve(num_queries);
+          query_texts.ends.reserve(num_queries);
+          query_keys.ends.reserve(num_queries);
+          arrival_us.reserve(num_queries);
+     }
+
+     int num_queries(int emb_dim) const{
+          return static_cast<int>(embs.size() / emb_dim);
+     }
+
+     void clear(){
+          embs.clear();
+          query_ids.clear();
+          query_probe_counts.clear();
+          query_texts.clear();
+          query_keys.clear();
+          arrival_us.clear();
+     }
+};
+
+/***
+ * Loading state of a GroupedEmbeddingsForSearch whose embeddings are loaded asynchronously, 
+ * while it already buffers the queries that arrive for it
+ */
+enum class EmbeddingsLoadState : int {
+     NOT_LOADED,
+     LOADING,
+     LOADED,
+     FAILED, // the next query retries the loading
+};
+
+/***
+ * Parameters of the approximate FAISS indices, set by the UDL config in dfgs.json
+ */
+struct FaissIndexParams{
+     int nlist = 100; // IVF: number of inverted lists, capped by the number of embeddings
+     int nprobe = 1; // IVF: number of inverted lists visited per query
+     int hnsw_m = 32; // HNSW: number of neighbors per node
+     int hnsw_ef_construction = 40; // HNSW: size of the candidate list when building the graph
+     int hnsw_ef_search = 16; // HNSW: size of the candidate list when searching, should be >= top_k
+     int pq_m = 64; // PQ: number of sub-quantizers, i.e. bytes per code with 8 bits; reduced to a divisor of emb_dim
+     int pq_nbits = 8; // PQ: bits per sub-quantizer code
+     bool use_opq = false; // PQ: rotate the embeddings with a trained OPQ matrix before quantization
+     int rerank_k = 0; // PQ: number of candidates reranked with full-precision embeddings, read from the mapped snapshot if there is one; 0: no rerank, and full-precision embeddings are released
+     int tree_fanout = 32; // hierarchical: average number of children of each node of the tree
+     std::vector<int> tree_beam_widths = {8}; // hierarchical: nodes kept per level, from the top level down, the last one for the levels below
+};
+
+/***
+ * Helper function to set_config() of the UDLs
+ * Read the FaissIndexParams fields that are present in the UDL config
+ ***/
+inline void parse_faiss_index_params(const nlohmann::json& config, FaissIndexParams& params){
+     if (config.contains("nlist")) {
+          params.nlist = std::max(1, config["nlist"].get<int>());
+     }
+     if (config.contains("nprobe")) {
+          params.nprobe = std::max(1, config["nprobe"].get<int>());
+     }
+     if (config.contains("hnsw_m")) {
+          params.hnsw_m = std::max(2, config["hnsw_m"].get<int>());
+     }
+     if (config.contains("hnsw_ef_construction")) {
+          params.hnsw_ef_construction = std::max(1, config["hnsw_ef_construction"].get<int>());
+     }
+     if (config.contains("hnsw_ef_search")) {
+          params.hnsw_ef_search = std::max(1, config["hnsw_ef_search"].get<int>());
+     }
+     if (config.contains("pq_m")) {
+          params.pq_m = std::max(1, config["pq_m"].get<int>());
+     }
+     if (config.contains("pq_nbits")) {
+          params.pq_nbits = std::min(16, std::max(1, config["pq_nbits"].get<int>()));
+     }
+     if (config.contains("use_opq")) {
+          params.use_opq = config["use_opq"].get<bool>();
+     }
+     if (config.contains("rerank_k")) {
+          params.rerank_k = std::max(0, config["rerank_k"].get<int>());
+     }
+     if (config.contains("tree_fanout")) {
+          params.tree_fanout = std::max(2, config["tree_fanout"].get<int>());
+     }
+     if (config.contains("tree_beam_width")) {
+          // one beam width for every level, or a list of beam widths from the top level down
+          params.tree_beam_widths.clear();
+          if (config["tree_beam_width"].is_array()) {
+               for (const auto& beam_width : config["tree_beam_width"]) {
+                    params.tree_beam_widths.push_back(std::max(1, beam_width.get<int>()));
+               }
+          } else {
+               params.tree_beam_widths.push_back(std::max(1, config["tree_beam_width"].get<int>()));
+          }
+          if (params.tree_beam_widths.empty()) {
+               params.tree_beam_widths.push_back(FaissIndexParams().tree_beam_widths.front());
+          }
+     }
+}
+
+/***
+ * Embeddings received in one object from the KV store. The blob is emplaced and searched in place, 
+ * so a group of embeddings split into multiple objects is kept as a list of segments instead of being copied together.
+ */
+struct EmbeddingSegment {
+     float* data; // bytes of the emplaced blob, owned by GroupedEmbeddingsForSearch, or of its mapped snapshot
+     int64_t num_embs;
+     int64_t first_id; // index of data[0] among all the embeddings of the group
+     bool owned; // false if data points into the mapped snapshot
+};
+
+/***
+ * FAISS reader over the index section of a mapped snapshot
+ */
+struct SnapshotIndexReader : faiss::IOReader {
+     const uint8_t* data;
+     size_t size;
+     size_t pos = 0;
+
+     SnapshotIndexReader(const uint8_t* data, size_t size): data(data), size(size) {}
+
+     size_t operator()(void* ptr, size_t item_size, size_t nitems) override {
+          if (item_size == 0) {
+               return nitems;
+          }
+          size_t n = std::min(nitems, (size - pos) / item_size);
+          std::memcpy(ptr, data + pos, n * item_size);
+          pos += n * item_size;
+          return n;
+     }
+};
+
 class GroupedEmbeddingsForSearch{
 // Class to store group of embeddings, which could be the embeddings of a cluster or embeddings of all centroids
 
-     int faiss_search_type; // 0: CPU flat search, 1: GPU flat search, 2: GPU IVF search
+     int faiss_search_type; // 0: CPU flat search, 1: GPU flat search, 2: GPU IVF search, 3: CPU IVF search, 4: CPU HNSW search, 5: CPU PQ search with rerank, 6: CPU SIMD flat search, 7: CPU hierarchical search
      int emb_dim;  //  e.g. 512. The dimension of each embedding
      int num_embs;  //  e.g. 1000. The number of embeddings in the array
+     FaissIndexParams index_params;
 
-     float* embeddings; 
+     std::vector<EmbeddingSegment> segments; // embeddings of the group, in the order of their object keys
+     std::string snapshot_dir; // local directory of the snapshots of this group, empty if snapshots are disabled
+     bool snapshot_verify_version = true; // check the version of the first object before using a snapshot, see load_snapshot()
+     std::unique_ptr<MappedSnapshot> snapshot; // the snapshot this group was loaded from, while segments point into it
 
      std::unique_ptr<faiss::IndexFlatL2> cpu_flatl2_index; // FAISS index object. Initialize if use CPU Flat search
+     std::unique_ptr<faiss::IndexIVFFlat> cpu_ivf_flatl2_index; // FAISS index object. Initialize if use CPU IVF search
+     std::unique_ptr<faiss::IndexHNSWFlat> cpu_hnsw_flatl2_index; // FAISS index object. Initialize if use CPU HNSW search
+     std::unique_ptr<faiss::Index> cpu_pq_index; // FAISS IndexPQ, or OPQ + IndexPQ. Initialize if use CPU PQ search
+     std::vector<float> embedding_norms; // squared L2 norms of the embeddings. Initialize if use CPU SIMD flat search
+     std::unique_ptr<HierarchicalFlatIndex> cpu_tree_index; // tree of k-means centroids over the embeddings. Initialize if use CPU hierarchical search
      std::unique_ptr<faiss::gpu::StandardGpuResources> gpu_res;  // FAISS GPU resources. Initialize if use GPU search
      std::unique_ptr<faiss::gpu::GpuIndexFlatL2> gpu_flatl2_index; // FAISS index object. Initialize if use GPU Flat search
      std::unique_ptr<faiss::gpu::GpuIndexIVFFlat> gpu_ivf_flatl2_index; // FAISS index object. Initialize if use GPU IVF search
 
-     std::vector<std::string> query_texts; // query texts list
-     std::vector<std::string> query_keys; // query key list 1-1 correspondence with query_texts
-     float* query_embs; // query embeddings
-     std::atomic<int> added_query_offset; // the offset of the query embeddings added so far in the query_embs array
-     mutable std::mutex query_embs_mutex; 
-     mutable std::condition_variable query_embs_cv;
-     std::atomic<bool> query_embs_in_search;
+     /*** Double-buffered query batches:
+      *   add_queries() appends to active_batch, batchedSearch() swaps it with search_batch and searches the swapped-out
+      *   batch without holding query_embs_mutex, so producers only contend with the search thread on the pointer swap.
+      *   search_batch is only touched by the thread running batchedSearch().
+      */
+     std::unique_ptr<PendingQueryBatch> active_batch;
+     std::unique_ptr<PendingQueryBatch> search_batch;
+     std::atomic<int> num_pending_queries; // number of queries in active_batch
+     std::atomic<int64_t> oldest_pending_arrival_us; // steady_clock_now_us() when the first query of active_batch arrived
+     std::atomic<bool> scheduled_for_search; // true while queued in a search worker's ready queue or being searched
+     std::atomic<EmbeddingsLoadState> load_state; // the pending queries are only searched once LOADED
+     std::unique_ptr<QueryResultCache> result_cache; // results of the recently searched query embeddings, if enabled
+     mutable std::mutex query_embs_mutex; // protects active_batch and the swap
+     std::condition_variable pending_space_cv; // notified when active_batch is swapped out or dropped, for the producers over max_pending_queries
+     int max_pending_queries = 0; // maximum number of queries in active_batch, 0 for unbounded
+     LatencyHistogram queueing_delay; // time from add_queries() to the start of the batchedSearch() of each query
 
 
 
 public:
 
-     GroupedEmbeddingsForSearch(int type, int dim) 
-          : faiss_search_type(type), emb_dim(dim), num_embs(0), added_query_offset(0), query_embs_in_search(false) {
-          query_embs = new float[dim * MAX_NUM_QUERIES_PER_BATCH];
+     GroupedEmbeddingsForSearch(int type, int dim, const FaissIndexParams& params = FaissIndexParams()) 
+          : faiss_search_type(type), emb_dim(dim), num_embs(0), index_params(params), num_pending_queries(0), oldest_pending_arrival_us(0), scheduled_for_search(false),
+            load_state(EmbeddingsLoadState::NOT_LOADED) {
+          initialize_query_batches();
      }
 
      GroupedEmbeddingsForSearch(int dim, int num, float* data) 
-          : faiss_search_type(0), emb_dim(dim), num_embs(num), embeddings(data), added_query_offset(0), query_embs_in_search(false) {
-          query_embs = new float[dim * MAX_NUM_QUERIES_PER_BATCH];
+          : faiss_search_type(0), emb_dim(dim), num_embs(num), num_pending_queries(0), oldest_pending_arrival_us(0), scheduled_for_search(false),
+            load_state(EmbeddingsLoadState::LOADED) {
+          this->segments.push_back({data, num, 0, true});
+          initialize_query_batches();
+     }
+
+     void initialize_query_batches(){
+          this->active_batch = std::make_unique<PendingQueryBatch>();
+          this->search_batch = std::make_unique<PendingQueryBatch>();
+          this->active_batch->reserve(MAX_NUM_QUERIES_PER_BATCH, this->emb_dim);
+          this->search_batch->reserve(MAX_NUM_QUERIES_PER_BATCH, this->emb_dim);
      }
 
      /*** 
-     * Helper function to fill_cluster_embs_in_cache()
+     * Helper function to retrieve_grouped_embeddings()
      * Retrieve the embeddings of a single object from the KV store in Cascade. 
      * This retrive doesn't involve copying the data.
-     * @param retrieved_num_embs the number of embeddings in the cluster
+     * @param retrieved_num_embs the number of embeddings in the object
      * @param cluster_emb_key the key of the object to retrieve
      * @param typed_ctxt the context to get the service client reference
      * @param version the version of the object to retrieve
@@ -76,59 +297,128 @@ public:
                                              std::string& cluster_emb_key,
                                              DefaultCascadeContextType* typed_ctxt,
                                              persistent::version_t version,
-                                             bool stable = 1){
+                                             bool stable = 1,
+                                             persistent::version_t* retrieved_version = nullptr){
           float* data;
           // 1. get the object from KV store
           auto get_query_results = typed_ctxt->get_service_client_ref().get(cluster_emb_key,version, stable);
           auto& reply = get_query_results.get().begin()->second.get();
           Blob blob = std::move(const_cast<Blob&>(reply.blob));
-          blob.memory_mode = derecho::cascade::object_memory_mode_t::EMPLACED; // Avoid copy, use bytes from reply.blob, transfer its ownership to GroupedEmbeddingsForSearch.emb_data
+          blob.memory_mode = derecho::cascade::object_memory_mode_t::EMPLACED; // Avoid copy, use bytes from reply.blob, transfer its ownership to GroupedEmbeddingsForSearch.segments
           // 2. get the embeddings from the object
           data = const_cast<float*>(reinterpret_cast<const float *>(blob.bytes));
           size_t num_points = blob.size / sizeof(float);
-          retrieved_num_embs += num_points / this->emb_dim;
+          retrieved_num_embs = num_points / this->emb_dim;
+          if (retrieved_version != nullptr) {
+               *retrieved_version = reply.version;
+          }
           return data;
      }
 
      /*** 
-     * Helper function to fill_cluster_embs_in_cache()
-     * Retrieve the embeddings of multiple objects from the KV store in Cascade. 
-     * This involve copying the data from received blobs.
+     * Helper function to retrieve_grouped_embeddings()
+     * Retrieve the embeddings of multiple objects from the KV store in Cascade, one segment per object.
+     * The gets are pipelined with up to MAX_IN_FLIGHT_GETS outstanding requests.
+     * This retrive doesn't involve copying the data either, the search goes through the segments.
+     * @param retrieved_num_embs the total number of embeddings in the objects
+     * @param retrieved_versions set to the version of each retrieved object, 1-1 correspondence with emb_obj_keys
      ***/
-     float* multi_emb_object_retrieve(int& retrieved_num_embs,
-                                        std::priority_queue<std::string, std::vector<std::string>, CompareObjKey>& emb_obj_keys,
+     void multi_emb_object_retrieve(int& retrieved_num_embs,
+                                        const std::vector<std::string>& emb_obj_keys,
                                         DefaultCascadeContextType* typed_ctxt,
                                         persistent::version_t version,
-                                        bool stable = 1){
-          float* data;
-          size_t num_obj = emb_obj_keys.size();
-          size_t data_size = 0;
-          Blob blobs[num_obj];
-          size_t i = 0;
-          while (!emb_obj_keys.empty()){
-               std::string emb_obj_key = emb_obj_keys.top();
-               emb_obj_keys.pop();
-               auto get_query_results = typed_ctxt->get_service_client_ref().get(emb_obj_key,version, stable);
-               auto& reply = get_query_results.get().begin()->second.get();
-               blobs[i] = std::move(const_cast<Blob&>(reply.blob));
-               data_size += blobs[i].size / sizeof(float);  
-               i++;
-          }
-          // 2. copy the embeddings from the blobs to the data
-          data = (float*)malloc(data_size * sizeof(float));
-          size_t offset = 0;
-          for (size_t i = 0; i < num_obj; i++) {
-               memcpy(data + offset, blobs[i].bytes, blobs[i].size);
-               offset += blobs[i].size / sizeof(float);
-          }
-          retrieved_num_embs = data_size / this->emb_dim;
-          return data;
+                                        bool stable,
+                                        std::vector<persistent::version_t>& retrieved_versions){
+          retrieved_versions.resize(emb_obj_keys.size(), CURRENT_VERSION);
+          pipelined_get(typed_ctxt->get_service_client_ref(), emb_obj_keys, MAX_IN_FLIGHT_GETS, version, stable,
+                        [&](size_t key_index, const ObjectWithStringKey& reply) {
+               retrieved_versions[key_index] = reply.version;
+               Blob blob = std::move(const_cast<Blob&>(reply.blob));
+               blob.memory_mode = derecho::cascade::object_memory_mode_t::EMPLACED; // transfer its ownership to GroupedEmbeddingsForSearch.segments
+               int obj_num_embs = blob.size / sizeof(float) / this->emb_dim;
+               add_segment(const_cast<float*>(reinterpret_cast<const float *>(blob.bytes)), obj_num_embs);
+               retrieved_num_embs += obj_num_embs;
+               return true;
+          });
+     }
+
+     void add_segment(float* data, int64_t segment_num_embs){
+          int64_t first_id = this->segments.empty() ? 0 : this->segments.back().first_id + this->segments.back().num_embs;
+          this->segments.push_back({data, segment_num_embs, first_id, true});
+     }
+
+     /***
+      * Free the received blobs (or unmap the snapshot), once the search index holds its own copy of the embeddings
+      */
+     void release_segments(){
+          for (auto& segment : this->segments) {
+               if (segment.owned) {
+                    delete[] segment.data;
+               }
+          }
+          this->segments.clear();
+          this->snapshot.reset();
+     }
+
+     /***
+      * The search reads the segments after the index is built, for the PQ rerank and the built-in flat search.
+      * The other FAISS indices hold their own copy of the embeddings.
+      */
+     bool search_uses_segments() const{
+          return (this->faiss_search_type == 5 && this->index_params.rerank_k > 0) || this->faiss_search_type == 6;
+     }
+
+     /***
+      * Full-precision embedding by its index in the group, only while the segments are kept
+      */
+     const float* get_embedding(int64_t id) const{
+          auto it = std::upper_bound(this->segments.begin(), this->segments.end(), id,
+                                     [](int64_t id, const EmbeddingSegment& segment) { return id < segment.first_id; });
+          --it;
+          return it->data + (id - it->first_id) * this->emb_dim;
+     }
+
+     /***
+      * Add the embeddings of all segments to a FAISS index, which assigns them consecutive ids
+      */
+     template <typename IndexType>
+     void add_segments_to_index(IndexType& index){
+          for (const auto& segment : this->segments) {
+               index.add(segment.num_embs, segment.data);
+          }
+     }
+
+     /***
+      * Contiguous embeddings to train a FAISS index on.
+      * With a single segment, it is the segment itself. Otherwise, the first max_num_train embeddings are copied to buffer,
+      * FAISS subsamples its training set to a few hundred points per centroid anyway.
+      * @param max_num_train maximum number of embeddings to copy with multiple segments
+      * @param num_train set to the number of returned embeddings
+      * @param buffer holds the copy, should outlive the training
+      */
+     const float* get_training_embeddings(int64_t max_num_train, int64_t& num_train, std::vector<float>& buffer) const{
+          if (this->segments.size() == 1) {
+               num_train = this->segments[0].num_embs;
+               return this->segments[0].data;
+          }
+          num_train = std::min<int64_t>(this->num_embs, max_num_train);
+          buffer.resize(num_train * this->emb_dim);
+          int64_t copied = 0;
+          for (const auto& segment : this->segments) {
+               if (copied == num_train) {
+                    break;
+               }
+               int64_t n = std::min(segment.num_embs, num_train - copied);
+               std::copy(segment.data, segment.data + n * this->emb_dim, buffer.data() + copied * this->emb_dim);
+               copied += n;
+          }
+          return buffer.data();
      }
 
      /***
      * Fill in the embeddings of that cluster by getting the clusters' embeddings from KV store in Cascade
-     * This function is called when this UDL is first triggered by caller to operator(),
-     * it sacrifices the first request to this node, but the following requests will benefit from this cache.
+     * This function is called by the background warmup of the UDL, or otherwise when this UDL is first triggered by caller to operator(),
+     * in which case it sacrifices the first request to this node, but the following requests will benefit from this cache.
      * In static RAG setting, this function should be called only once at the begining
      * In dynamic RAG setting, this function could be extended to call periodically or upon notification 
      * (The reason of not filling it at initialization, is that initialization is called upon server starts, 
@@ -151,32 +441,281 @@ public:
                dbg_default_error("[{}]at {}, Failed to find object prefix {} in the KV store.", gettid(), __func__, embs_prefix);
                return -1;
           }
-          std::priority_queue<std::string, std::vector<std::string>, CompareObjKey> emb_obj_keys = filter_exact_matched_keys(listed_emb_obj_keys, embs_prefix);
+          std::priority_queue<std::string, std::vector<std::string>, CompareObjKey> filtered_keys = filter_exact_matched_keys(listed_emb_obj_keys, embs_prefix);
+          std::vector<std::string> emb_obj_keys = drain_keys(filtered_keys);
 
-          // 1. Get the cluster embeddings from KV store in Cascade
-          float* data;
+          // 1. Load the embeddings and the index from the local snapshot, if it was built from the current objects
+          std::string snapshot_file;
+          std::vector<uint64_t> obj_sizes;
+          if (!this->snapshot_dir.empty()) {
+               snapshot_file = snapshot_path(this->snapshot_dir, embs_prefix);
+               obj_sizes = get_object_sizes(typed_ctxt->get_service_client_ref(), emb_obj_keys, version, stable);
+               if (load_snapshot(snapshot_file, emb_obj_keys, obj_sizes, typed_ctxt)) {
+                    dbg_default_info("[{}]: embs_prefix={}, num_embs={} loaded from snapshot {}.", __func__, embs_prefix, this->num_embs, snapshot_file);
+                    return 0;
+               }
+          }
+
+          // 2. Get the cluster embeddings from KV store in Cascade
           int num_retrieved_embs = 0;
+          std::vector<persistent::version_t> obj_versions(emb_obj_keys.size(), CURRENT_VERSION);
           if (emb_obj_keys.size() == 1) {
-               std::string emb_obj_key = emb_obj_keys.top();
-               data = single_emb_object_retrieve(num_retrieved_embs, emb_obj_key, typed_ctxt, version, stable);
+               float* data = single_emb_object_retrieve(num_retrieved_embs, emb_obj_keys[0], typed_ctxt, version, stable, &obj_versions[0]);
+               add_segment(data, num_retrieved_embs);
           } else {
-               data = multi_emb_object_retrieve(num_retrieved_embs, emb_obj_keys, typed_ctxt, version ,stable);
+               multi_emb_object_retrieve(num_retrieved_embs, emb_obj_keys, typed_ctxt, version, stable, obj_versions);
           }
           if (num_retrieved_embs == 0) {
                std::cerr << "Error: embs_prefix:" << embs_prefix <<" has no embeddings found in the KV store" << std::endl;
                dbg_default_error("[{}]at {}, There is no embeddings for prefix{} in the KV store.", gettid(), __func__, embs_prefix);
                return -1;
           }
-          dbg_default_trace("[{}]: embs_prefix={}, num_emb_objects={} retrieved.", __func__, embs_prefix, num_retrieved_embs);
+          dbg_default_trace("[{}]: embs_prefix={}, num_embs={} in {} segments retrieved.", __func__, embs_prefix, num_retrieved_embs, this->segments.size());
 
-          // 2. assign the retrieved embeddings to the object
+          // 3. build the search index on the retrieved segments, and snapshot it for the next restart
           this->num_embs = num_retrieved_embs;
-          this->embeddings = data;
-          // this->centroids_embs[cluster_id]= std::make_unique<GroupedEmbeddingsForSearch>(this->emb_dim, retrieved_num_embs, data);
           int init_search_res = this->initialize_groupped_embeddings_for_search();
+          if (init_search_res == 0 && !snapshot_file.empty()) {
+               std::vector<SnapshotSource> sources;
+               for (size_t i = 0; i < emb_obj_keys.size(); i++) {
+                    sources.push_back({emb_obj_keys[i], obj_versions[i], obj_sizes[i]});
+               }
+               if (save_snapshot(snapshot_file, sources) && this->faiss_search_type == 5 && search_uses_segments()) {
+                    remap_segments_from_snapshot(snapshot_file);
+               }
+          }
+          if (!search_uses_segments()) {
+               release_segments();
+          }
           return init_search_res;
      }
 
+     /***
+      * Keep snapshots of the embeddings and the built index in snapshot_dir, 
+      * so that retrieve_grouped_embeddings() maps them instead of fetching the objects and rebuilding the index
+      */
+     void enable_snapshots(const std::string& snapshot_dir, bool verify_version = true){
+          this->snapshot_dir = snapshot_dir;
+          this->snapshot_verify_version = verify_version;
+     }
+
+     /***
+      * Cache the top_k results of up to capacity query embeddings searched by batchedSearch(), 
+      * to answer the repeated ones with lookup_cached_result() instead of searching them again
+      */
+     void enable_result_cache(size_t capacity){
+          if (capacity > 0) {
+               this->result_cache = std::make_unique<QueryResultCache>(capacity, this->emb_dim);
+          }
+     }
+
+     bool has_result_cache() const{
+          return this->result_cache != nullptr;
+     }
+
+     /***
+      * Get the cached top_k results of a query embedding
+      * @param emb the query embedding, of emb_dim floats
+      * @return false if there is no cached result for it
+      */
+     bool lookup_cached_result(const float* emb, int top_k, long* I, float* D){
+          return this->result_cache && this->result_cache->lookup(hash_embedding(emb, this->emb_dim), emb, top_k, I, D);
+     }
+
+     /***
+      * Parameters the built index depends on. A snapshot built with other parameters is rebuilt.
+      * The search-time parameters (nprobe, hnsw_ef_search, rerank_k) are applied after loading instead.
+      */
+     std::string get_index_fingerprint() const{
+          return "type=" + std::to_string(this->faiss_search_type) + ";emb_dim=" + std::to_string(this->emb_dim) +
+                 ";nlist=" + std::to_string(this->index_params.nlist) + ";hnsw_m=" + std::to_string(this->index_params.hnsw_m) +
+                 ";hnsw_ef_construction=" + std::to_string(this->index_params.hnsw_ef_construction) +
+                 ";pq_m=" + std::to_string(this->index_params.pq_m) + ";pq_nbits=" + std::to_string(this->index_params.pq_nbits) +
+                 ";use_opq=" + std::to_string(this->index_params.use_opq) + ";tree_fanout=" + std::to_string(this->index_params.tree_fanout);
+     }
+
+     /***
+      * The CPU FAISS index, saved in the snapshots. The GPU indices, the built-in flat search and the hierarchical index are rebuilt
+      * from the saved embeddings.
+      */
+     faiss::Index* get_cpu_faiss_index() const{
+          if (this->faiss_search_type == 0){
+               return this->cpu_flatl2_index.get();
+          } else if (this->faiss_search_type == 3){
+               return this->cpu_ivf_flatl2_index.get();
+          } else if (this->faiss_search_type == 4){
+               return this->cpu_hnsw_flatl2_index.get();
+          } else if (this->faiss_search_type == 5){
+               return this->cpu_pq_index.get();
+          }
+          return nullptr;
+     }
+
+     bool snapshot_has_index() const{
+          return this->faiss_search_type == 0 || this->faiss_search_type == 3 || this->faiss_search_type == 4 || this->faiss_search_type == 5;
+     }
+
+     bool snapshot_has_embeddings() const{
+          return !snapshot_has_index() || search_uses_segments();
+     }
+
+     /***
+      * Write the snapshot of this group: its index fingerprint, number of embeddings, embeddings and/or serialized index
+      * @param sources the objects the group was retrieved from
+      * @return true if the snapshot was written
+      */
+     bool save_snapshot(const std::string& snapshot_file, const std::vector<SnapshotSource>& sources){
+          std::string fingerprint = get_index_fingerprint();
+          int64_t snapshot_num_embs = this->num_embs;
+          std::vector<SnapshotSection> sections;
+          sections.push_back({"config", {{fingerprint.data(), fingerprint.size()}}});
+          sections.push_back({"num_embs", {{&snapshot_num_embs, sizeof(snapshot_num_embs)}}});
+          if (snapshot_has_embeddings()) {
+               SnapshotSection embeddings_section{"embeddings", {}};
+               for (const auto& segment : this->segments) {
+                    embeddings_section.pieces.emplace_back(segment.data, segment.num_embs * this->emb_dim * sizeof(float));
+               }
+               sections.push_back(std::move(embeddings_section));
+          }
+          faiss::VectorIOWriter index_writer;
+          try {
+               if (snapshot_has_index()) {
+                    faiss::write_index(get_cpu_faiss_index(), &index_writer);
+                    sections.push_back({"index", {{index_writer.data.data(), index_writer.data.size()}}});
+               }
+          } catch (const std::exception& e) {
+               dbg_default_warn("{}, failed to serialize the index for snapshot {}: {}", __func__, snapshot_file, e.what());
+               return false;
+          }
+          if (!write_snapshot(snapshot_file, sources, sections)) {
+               dbg_default_warn("{}, failed to write snapshot {}.", __func__, snapshot_file);
+               return false;
+          }
+          return true;
+     }
+
+     /***
+      * Replace the received blobs by the embeddings section of the snapshot just written, mapped in place.
+      * Used by the PQ rerank, which only reads the embeddings of a few candidates per query: 
+      * the rest of the full-precision embeddings stay in the page cache, reclaimable by the OS, instead of in the heap.
+      */
+     void remap_segments_from_snapshot(const std::string& snapshot_file){
+          std::unique_ptr<MappedSnapshot> mapped = MappedSnapshot::open(snapshot_file);
+          const uint8_t* section_data = nullptr;
+          uint64_t section_size = 0;
+          if (!mapped || !mapped->get_section("embeddings", section_data, section_size) ||
+              section_size != static_cast<uint64_t>(this->num_embs) * this->emb_dim * sizeof(float)) {
+               dbg_default_warn("{}, failed to map the embeddings of snapshot {}, keep them in memory.", __func__, snapshot_file);
+               return;
+          }
+          release_segments();
+          float* data = const_cast<float*>(reinterpret_cast<const float*>(section_data));
+          this->segments.push_back({data, this->num_embs, 0, false});
+          this->snapshot = std::move(mapped);
+     }
+
+     /***
+      * Load this group from its snapshot, if the snapshot was built from the given objects with the same index parameters.
+      * The embeddings are used in place from the mapped file, the CPU FAISS index is deserialized without training or adding.
+      * @param obj_keys, obj_sizes: the current objects of this group in the KV store
+      * @param typed_ctxt: to get the version of the first object, unless snapshot_verify_version is false
+      * @return false if there is no up-to-date snapshot, and the group is left empty
+      */
+     bool load_snapshot(const std::string& snapshot_file, const std::vector<std::string>& obj_keys, const std::vector<uint64_t>& obj_sizes,
+                        DefaultCascadeContextType* typed_ctxt){
+          std::unique_ptr<MappedSnapshot> mapped = MappedSnapshot::open(snapshot_file);
+          if (!mapped || !mapped->matches_sources(obj_keys, obj_sizes)) {
+               return false;
+          }
+          if (this->snapshot_verify_version &&
+              !mapped->matches_first_version(get_object_version(typed_ctxt->get_service_client_ref(), obj_keys.front(), CURRENT_VERSION, true))) {
+               dbg_default_info("{}, snapshot {} was built from another version of {}, rebuilding it.", __func__, snapshot_file, obj_keys.front());
+               return false;
+          }
+          const uint8_t* section_data = nullptr;
+          uint64_t section_size = 0;
+          if (!mapped->get_section("config", section_data, section_size) ||
+              std::string(reinterpret_cast<const char*>(section_data), section_size) != get_index_fingerprint()) {
+               return false;
+          }
+          int64_t snapshot_num_embs = 0;
+          if (!mapped->get_section("num_embs", section_data, section_size) || section_size != sizeof(snapshot_num_embs)) {
+               return false;
+          }
+          std::memcpy(&snapshot_num_embs, section_data, sizeof(snapshot_num_embs));
+          if (snapshot_has_embeddings()) {
+               if (!mapped->get_section("embeddings", section_data, section_size) ||
+                   section_size != static_cast<uint64_t>(snapshot_num_embs) * this->emb_dim * sizeof(float)) {
+                    return false;
+               }
+               float* data = const_cast<float*>(reinterpret_cast<const float*>(section_data));
+               this->segments.push_back({data, snapshot_num_embs, 0, false});
+          }
+          this->num_embs = static_cast<int>(snapshot_num_embs);
+          this->snapshot = std::move(mapped);
+          bool loaded = false;
+          try {
+               if (snapshot_has_index()) {
+                    loaded = this->snapshot->get_section("index", section_data, section_size) &&
+                             restore_cpu_faiss_index(section_data, section_size);
+               } else {
+                    loaded = (this->initialize_groupped_embeddings_for_search() == 0);
+               }
+          } catch (const std::exception& e) {
+               dbg_default_warn("{}, failed to load the index from snapshot {}: {}", __func__, snapshot_file, e.what());
+               loaded = false;
+          }
+          if (!loaded) {
+               release_segments();
+               this->num_embs = 0;
+               return false;
+          }
+          if (!search_uses_segments()) {
+               release_segments();
+          }
+          return true;
+     }
+
+     /***
+      * Deserialize the CPU FAISS index of a snapshot, and apply the search-time parameters
+      */
+     bool restore_cpu_faiss_index(const uint8_t* data, uint64_t size){
+          SnapshotIndexReader reader(data, size);
+          std::unique_ptr<faiss::Index> index(faiss::read_index(&reader));
+          if (!index || index->d != this->emb_dim || index->ntotal != this->num_embs) {
+               return false;
+          }
+          if (this->faiss_search_type == 0){
+               auto* flat_index = dynamic_cast<faiss::IndexFlatL2*>(index.get());
+               if (flat_index == nullptr) {
+                    return false;
+               }
+               index.release();
+               this->cpu_flatl2_index.reset(flat_index);
+          } else if (this->faiss_search_type == 3){
+               auto* ivf_index = dynamic_cast<faiss::IndexIVFFlat*>(index.get());
+               if (ivf_index == nullptr) {
+                    return false;
+               }
+               index.release();
+               this->cpu_ivf_flatl2_index.reset(ivf_index);
+               this->cpu_ivf_flatl2_index->nprobe = std::min<size_t>(this->index_params.nprobe, ivf_index->nlist);
+          } else if (this->faiss_search_type == 4){
+               auto* hnsw_index = dynamic_cast<faiss::IndexHNSWFlat*>(index.get());
+               if (hnsw_index == nullptr) {
+                    return false;
+               }
+               index.release();
+               this->cpu_hnsw_flatl2_index.reset(hnsw_index);
+               this->cpu_hnsw_flatl2_index->hnsw.efSearch = this->index_params.hnsw_ef_search;
+          } else if (this->faiss_search_type == 5){
+               this->cpu_pq_index = std::move(index);
+          } else {
+               return false;
+          }
+          return true;
+     }
+
      int get_num_embeddings(){
           return this->num_embs;
      }   
@@ -188,6 +727,21 @@ public:
                initialize_gpu_flat_search();
           } else if (this->faiss_search_type == 2){
                initialize_gpu_ivf_flat_search();
+          } else if (this->faiss_search_type == 3){
+               initialize_cpu_ivf_flat_search();
+          } else if (this->faiss_search_type == 4){
+               initialize_cpu_hnsw_flat_search();
+          } else if (this->faiss_search_type == 5){
+               initialize_cpu_pq_search();
+          } else if (this->faiss_search_type == 6){
+               // the built-in flat search scans the segments directly, only their norms are precomputed for batched search
+               this->embedding_norms.resize(this->num_embs);
+               for (const auto& segment : this->segments) {
+                    simd_l2_norms(segment.data, segment.num_embs, this->emb_dim, this->embedding_norms.data() + segment.first_id);
+               }
+               dbg_default_info("CPU SIMD flat search uses the {} kernels for emb_dim={}.", simd_flat_l2_kernel_name(), this->emb_dim);
+          } else if (this->faiss_search_type == 7){
+               initialize_cpu_hierarchical_search();
           } else {
                std::cerr << "Error: faiss_search_type not supported" << std::endl;
                dbg_default_error("Failed to initialize faiss search type, at clusters_search_udl.");
@@ -197,59 +751,283 @@ public:
      }
 
      /***
-      * Add the query embeddings to the query_embs array to be processed by batch
-      * @param nq: number of queries
-      * @param xq: flaten queries to search
-      * @param query_list: the list of query texts to be added to the cache
-      * TODO: current implementation incurs one copy of the xq array, need to optimize
+      * Bound the number of queries buffered in the active batch. A producer that would go over the bound
+      * is held back by try_add_queries() until batchedSearch() swaps the active batch out.
+      * @param max_pending: maximum number of pending queries, 0 for unbounded. 
+      *                     An empty batch always accepts one call, so a larger call is not held back forever.
       */
-     void add_queries(int nq, float* xq, std::vector<std::string>&& query_list, std::string key_string){
+     void set_max_pending_queries(int max_pending){
           std::unique_lock<std::mutex> lock(query_embs_mutex);
-          // wait if query_embs is in search or if offset is full
-          query_embs_cv.wait(lock, [this, nq] { return !query_embs_in_search && this->added_query_offset + nq * this->emb_dim <= MAX_NUM_QUERIES_PER_BATCH * this->emb_dim; });
-          memcpy(query_embs + this->added_query_offset, xq, nq * this->emb_dim * sizeof(float));
-          this->added_query_offset += nq * this->emb_dim;
-          this->query_texts.reserve(this->query_texts.size() + query_list.size());
-          this->query_texts.insert(this->query_texts.end(), std::make_move_iterator(query_list.begin()), std::make_move_iterator(query_list.end()));
-          for (int i = 0; i < nq; i++) {
-               this->query_keys.push_back(key_string);
+          this->max_pending_queries = std::max(0, max_pending);
+     }
+
+     /***
+      * Add the query embeddings to the active batch to be processed by batchedSearch, unless it is full.
+      * It does not wait for an ongoing batchedSearch, which works on the other buffer.
+      * The queries are copied, since query_batch points into an object that is only valid during the UDL handler.
+      * @param query_batch: the query batch received
+      * @param query_indices: the indices in query_batch of the queries to add
+      * @param key_string: the key of the object of query_batch
+      * @param started_batch: set to true if the pending batch was empty before this call, i.e. this call started a new batch
+      * @return false if the queries would go over max_pending_queries, in which case none of them is added:
+      *         the caller waits with wait_for_pending_space() and tries again
+      */
+     bool try_add_queries(const QueryBatchView& query_batch, const std::vector<uint32_t>& query_indices, const std::string& key_string,
+                          bool& started_batch){
+          int nq = static_cast<int>(query_indices.size());
+          std::unique_lock<std::mutex> lock(query_embs_mutex);
+          if (is_pending_batch_full(nq)) {
+               return false;
+          }
+          PendingQueryBatch& batch = *this->active_batch;
+          started_batch = (this->num_pending_queries == 0);
+          int64_t now_us = steady_clock_now_us();
+          if (started_batch) {
+               // set before num_pending_queries, so that a pending batch never exposes a stale arrival time
+               this->oldest_pending_arrival_us = now_us;
+          }
+          for (uint32_t i : query_indices) {
+               const float* emb = query_batch.embedding(i);
+               batch.embs.insert(batch.embs.end(), emb, emb + this->emb_dim);
+               batch.query_ids.push_back(query_batch.query_id(i));
+               batch.query_probe_counts.push_back(query_batch.probe_count(i));
+               batch.query_texts.add(query_batch.query_text(i));
+               batch.query_keys.add(key_string);
+          }
+          batch.arrival_us.insert(batch.arrival_us.end(), nq, now_us);
+          this->num_pending_queries += nq;
+          return true;
+     }
+
+     /***
+      * Block until nq queries fit in the active batch, i.e. until batchedSearch() swaps it out or a failed load drops it.
+      * The caller must not hold a lock that the search of this group waits for.
+      */
+     void wait_for_pending_space(int nq){
+          std::unique_lock<std::mutex> lock(query_embs_mutex);
+          this->pending_space_cv.wait(lock, [&]{ return !is_pending_batch_full(nq); });
+     }
+
+     /***
+      * Add the query embeddings to the active batch, waiting for space if it is full
+      * @return true if this call started a new batch, see try_add_queries()
+      */
+     bool add_queries(const QueryBatchView& query_batch, const std::vector<uint32_t>& query_indices, const std::string& key_string){
+          bool started_batch = false;
+          while (!try_add_queries(query_batch, query_indices, key_string, started_batch)) {
+               wait_for_pending_space(static_cast<int>(query_indices.size()));
           }
-          query_embs_cv.notify_one(); 
+          return started_batch;
      }
 
      bool has_pending_queries() const{
-          return this->added_query_offset > 0;
+          return this->num_pending_queries > 0;
+     }
+
+     /***
+      * Whether adding nq queries would go over max_pending_queries. Called with query_embs_mutex held.
+      */
+     bool is_pending_batch_full(int nq) const{
+          int num_pending = this->num_pending_queries;
+          return this->max_pending_queries > 0 && num_pending > 0 && num_pending + nq > this->max_pending_queries;
+     }
+
+     /***
+      * Check if the pending queries should be flushed to batchedSearch, 
+      * either because the batch is full, or the oldest pending query has waited long enough.
+      * @param max_batch_size: number of pending queries that triggers a search
+      * @param max_batch_wait_us: maximum time the oldest pending query waits before a search is triggered
+      * @param now_us: current time from steady_clock_now_us()
+      */
+     bool is_batch_ready(int max_batch_size, int64_t max_batch_wait_us, int64_t now_us) const{
+          int num_pending = this->num_pending_queries;
+          if (num_pending == 0) {
+               return false;
+          }
+          return num_pending >= max_batch_size || now_us - this->oldest_pending_arrival_us >= max_batch_wait_us;
+     }
+
+     const LatencyHistogram& get_queueing_delay() const{
+          return this->queueing_delay;
+     }
+
+     int64_t get_oldest_pending_arrival_us() const{
+          return this->oldest_pending_arrival_us;
+     }
+
+     /***
+      * Claim this cluster for scheduling, so that it is queued to at most one search worker at a time
+      * @return true if the caller should queue this cluster, false if it is already queued or being searched
+      */
+     bool try_mark_scheduled(){
+          return !this->scheduled_for_search.exchange(true);
+     }
+
+     void clear_scheduled(){
+          this->scheduled_for_search = false;
+     }
+
+     /***
+      * Claim the loading of the embeddings, so that concurrent misses on this group start one load
+      * @return true if the caller should load the embeddings, false if they are loaded or being loaded
+      */
+     bool try_start_loading(){
+          EmbeddingsLoadState state = this->load_state;
+          while (state == EmbeddingsLoadState::NOT_LOADED || state == EmbeddingsLoadState::FAILED) {
+               if (this->load_state.compare_exchange_weak(state, EmbeddingsLoadState::LOADING)) {
+                    return true;
+               }
+          }
+          return false;
+     }
+
+     /***
+      * End the loading claimed by try_start_loading(). 
+      * The state is set under query_embs_mutex, so that each add_queries() either lands in the batch handed over here,
+      * or sees the new state: after a failure, its caller requests a new load (see try_start_loading).
+      * The caller schedules the pending queries for search after a successful load: 
+      * add_queries() before the state is LOADED leaves the scheduling to the loader.
+      * @param failed_queries: on failure, receives the queries buffered during the loading, which the caller answers
+      */
+     void finish_loading(bool loaded, PendingQueryBatch* failed_queries = nullptr){
+          if (this->result_cache) {
+               // results searched in the previously loaded embeddings
+               this->result_cache->clear();
+          }
+          std::unique_lock<std::mutex> lock(query_embs_mutex);
+          this->load_state = loaded ? EmbeddingsLoadState::LOADED : EmbeddingsLoadState::FAILED;
+          if (!loaded) {
+               if (failed_queries) {
+                    std::swap(*failed_queries, *this->active_batch);
+               }
+               this->active_batch->clear();
+               this->num_pending_queries = 0;
+               this->pending_space_cv.notify_all();
+          }
+     }
+
+     bool is_loaded() const{
+          return this->load_state == EmbeddingsLoadState::LOADED;
+     }
+
+     /***
+      * Loaded, with no pending queries and not queued or being searched: can be evicted from the cache of the UDL
+      * without dropping queries. Only stable while the UDL holds the exclusive lock of its cache, under which no query is added.
+      */
+     bool is_idle() const{
+          return is_loaded() && this->num_pending_queries == 0 && !this->scheduled_for_search;
+     }
+
+     /***
+      * Approximate memory used by the loaded embeddings and search index, for the memory budget of the cluster cache
+      * The embeddings mapped from a snapshot for the PQ rerank are not counted: only the pages of the reranked candidates
+      * are read, and the OS can reclaim them.
+      */
+     int64_t get_memory_bytes() const{
+          int64_t emb_bytes = static_cast<int64_t>(this->num_embs) * this->emb_dim * sizeof(float);
+          int64_t memory_bytes = 0;
+          for (const auto& segment : this->segments) {
+               if (segment.owned || this->faiss_search_type != 5) {
+                    memory_bytes += segment.num_embs * this->emb_dim * sizeof(float);
+               }
+          }
+          if (this->faiss_search_type == 0 || this->faiss_search_type == 1 || this->faiss_search_type == 2 || this->faiss_search_type == 3) {
+               memory_bytes += emb_bytes;
+          } else if (this->faiss_search_type == 4) {
+               // the HNSW graph has about 2 * hnsw_m links per embedding
+               memory_bytes += emb_bytes + static_cast<int64_t>(this->num_embs) * 2 * this->index_params.hnsw_m * sizeof(int32_t);
+          } else if (this->faiss_search_type == 5 && this->cpu_pq_index) {
+               memory_bytes += get_pq_index_memory_bytes();
+          }
+          memory_bytes += this->embedding_norms.size() * sizeof(float);
+          if (this->cpu_tree_index) {
+               memory_bytes += this->cpu_tree_index->get_memory_bytes();
+          }
+          return memory_bytes;
+     }
+
+     /***
+      * Memory of the PQ index: the codes, the sub-quantizer centroids, and the OPQ rotation if any
+      */
+     int64_t get_pq_index_memory_bytes() const{
+          int64_t memory_bytes = 0;
+          const faiss::Index* index = this->cpu_pq_index.get();
+          if (auto* pre_transform = dynamic_cast<const faiss::IndexPreTransform*>(index)) {
+               for (const faiss::VectorTransform* transform : pre_transform->chain) {
+                    if (auto* linear = dynamic_cast<const faiss::LinearTransform*>(transform)) {
+                         memory_bytes += (linear->A.size() + linear->b.size()) * sizeof(float);
+                    }
+               }
+               index = pre_transform->index;
+          }
+          if (auto* pq_index = dynamic_cast<const faiss::IndexPQ*>(index)) {
+               memory_bytes += pq_index->codes.size() + pq_index->pq.centroids.size() * sizeof(float);
+          }
+          return memory_bytes;
+     }
+
+     /***
+      * The time at which the pending batch becomes ready because of max_batch_wait_us
+      * Only meaningful if has_pending_queries()
+      */
+     int64_t get_batch_deadline_us(int64_t max_batch_wait_us) const{
+          return this->oldest_pending_arrival_us + max_batch_wait_us;
      }
 
      /***
       * Search the top K embeddings that are close to the queries in batch
+      * The active batch is swapped out under query_embs_mutex, and searched after the lock is released.
+      * Should be called by at most one thread at a time for a given GroupedEmbeddingsForSearch.
       * @param top_k: number of top embeddings to return
       * @param D: distance array, storing the distance of the top_k embeddings
       * @param I: index array, storing the index of the top_k embeddings
-      * @param query_list: the list of query texts that have been batchSearched on  
+      * @param query_texts: the list of query texts that have been batchSearched on  
+      * @param query_ids: the ids of the queries, in the order of query_texts
+      * @param query_keys: the keys of the objects of the queries, in the order of query_texts
+      * @param query_embs: if not null, swapped with the searched query embeddings, in the order of query_texts
+      * @param query_probe_counts: if not null, the number of clusters each query is sent to, in the order of query_texts
       * @return true if the search is successful, false otherwise
       */
-     bool batchedSearch(int top_k, float** D, long** I, std::vector<std::string>& query_list, std::vector<std::string>& query_keys){
-          std::unique_lock<std::mutex> lock(query_embs_mutex);
-          query_embs_in_search = true;
-          int nq = this->added_query_offset / this->emb_dim;
+     bool batchedSearch(int top_k, float** D, long** I, StringList& query_texts, std::vector<uint64_t>& query_ids,
+                        StringList& query_keys, std::vector<float>* query_embs = nullptr,
+                        std::vector<uint32_t>* query_probe_counts = nullptr){
+          {
+               std::unique_lock<std::mutex> lock(query_embs_mutex);
+               std::swap(this->active_batch, this->search_batch);
+               this->num_pending_queries = 0;
+               this->pending_space_cv.notify_all();
+          }
+          PendingQueryBatch& batch = *this->search_batch;
+          int nq = batch.num_queries(this->emb_dim);
           if (nq == 0) {
                // This case should not happen
-               query_embs_in_search = false;
-               query_embs_cv.notify_one();
-               std::cerr << "Error: no query embeddings to search, offset="<< this->added_query_offset << std::endl;
+               std::cerr << "Error: no query embeddings to search." << std::endl;
                return false;
           }
+          int64_t search_start_us = steady_clock_now_us();
+          for (int64_t arrival_us : batch.arrival_us) {
+               this->queueing_delay.record(search_start_us - arrival_us);
+          }
           *I = new long[top_k * nq];
           *D = new float[top_k * nq];
-          search(nq, this->query_embs, top_k, *D, *I);
-          // reset the query_embs array and transfer ownership of the query_texts
-          this->added_query_offset = 0;
-          query_list = std::move(this->query_texts);
-          query_keys = std::move(this->query_keys);
-          // std::fill(this->query_embs, this->query_embs + nq * this->emb_dim, 0);  // could be skipped since already reset the offset
-          query_embs_in_search = false;
-          query_embs_cv.notify_one();
+          search(nq, batch.embs.data(), top_k, *D, *I);
+          if (this->result_cache) {
+               for (int q = 0; q < nq; q++) {
+                    const float* emb = batch.embs.data() + static_cast<size_t>(q) * this->emb_dim;
+                    this->result_cache->insert(hash_embedding(emb, this->emb_dim), emb, top_k, *I + static_cast<size_t>(q) * top_k, *D + static_cast<size_t>(q) * top_k);
+               }
+          }
+          // transfer ownership of the query_texts, and keep the embs capacity for the next swap
+          query_texts = std::move(batch.query_texts);
+          query_ids = std::move(batch.query_ids);
+          query_keys = std::move(batch.query_keys);
+          if (query_embs) {
+               std::swap(*query_embs, batch.embs);
+          }
+          if (query_probe_counts) {
+               std::swap(*query_probe_counts, batch.query_probe_counts);
+          }
+          batch.clear();
           return true;
      }    
 
@@ -268,6 +1046,16 @@ public:
                faiss_gpu_flat_search(nq, xq, top_k, D, I);
           } else if (this->faiss_search_type == 2){
                faiss_gpu_ivf_flat_search(nq, xq, top_k, D, I);
+          } else if (this->faiss_search_type == 3){
+               faiss_cpu_ivf_flat_search(nq, xq, top_k, D, I);
+          } else if (this->faiss_search_type == 4){
+               faiss_cpu_hnsw_flat_search(nq, xq, top_k, D, I);
+          } else if (this->faiss_search_type == 5){
+               faiss_cpu_pq_search(nq, xq, top_k, D, I);
+          } else if (this->faiss_search_type == 6){
+               cpu_simd_flat_search(nq, xq, top_k, D, I);
+          } else if (this->faiss_search_type == 7){
+               cpu_hierarchical_search(nq, xq, top_k, D, I);
           } else {
                std::cerr << "Error: faiss_search_type not supported" << std::endl;
                dbg_default_error("Failed to search the top K embeddings, at clusters_search_udl.");
@@ -280,7 +1068,7 @@ public:
      ***/
      void initialize_cpu_flat_search(){
           this->cpu_flatl2_index = std::make_unique<faiss::IndexFlatL2>(this->emb_dim); 
-          this->cpu_flatl2_index->add(this->num_embs, this->embeddings); // add vectors to the index
+          add_segments_to_index(*this->cpu_flatl2_index); // add vectors to the index
      }
 
      /***
@@ -305,7 +1093,7 @@ public:
      void initialize_gpu_flat_search(){
           this->gpu_res = std::make_unique<faiss::gpu::StandardGpuResources>();
           this->gpu_flatl2_index = std::make_unique<faiss::gpu::GpuIndexFlatL2>(this->gpu_res.get(), this->emb_dim);
-          this->gpu_flatl2_index->add(this->num_embs, this->embeddings); // add vectors to the index
+          add_segments_to_index(*this->gpu_flatl2_index); // add vectors to the index
      }
 
      /***
@@ -324,15 +1112,27 @@ public:
           return 0;
      }
 
+     /***
+      * Number of inverted lists for the IVF indices, capped so that every list can get a trained centroid
+      */
+     int get_ivf_nlist() const{
+          return std::max(1, std::min(this->index_params.nlist, this->num_embs));
+     }
+
      /*** 
       * Initialize the GPU ivf search index based on the embeddings.
       * initalize it if use faiss_gpu_ivf_flat_search()
      ***/
      void initialize_gpu_ivf_flat_search(){
-          int nlist = 100;
+          int nlist = get_ivf_nlist();
           this->gpu_res = std::make_unique<faiss::gpu::StandardGpuResources>();
           this->gpu_ivf_flatl2_index = std::make_unique<faiss::gpu::GpuIndexIVFFlat>(this->gpu_res.get(), this->emb_dim, nlist, faiss::METRIC_L2);
-          this->gpu_ivf_flatl2_index->add(this->num_embs, this->embeddings); // add vectors to the index
+          std::vector<float> train_buffer;
+          int64_t num_train = 0;
+          const float* train_embs = get_training_embeddings(IVF_TRAINING_POINTS_PER_LIST * nlist, num_train, train_buffer);
+          this->gpu_ivf_flatl2_index->train(num_train, train_embs); // train the coarse quantizer on the embeddings
+          add_segments_to_index(*this->gpu_ivf_flatl2_index); // add vectors to the index
+          this->gpu_ivf_flatl2_index->nprobe = std::min(this->index_params.nprobe, nlist);
      }
 
      /***
@@ -345,29 +1145,233 @@ public:
       * @param I: index array to store the index of the top_k embeddings
      ***/
      int faiss_gpu_ivf_flat_search(int nq, float* xq, int top_k, float* D, long* I){
-          dbg_default_error("FAISS GPU ivf flatl2 Search in [GroupedEmbeddingsForSearch] class");
+          dbg_default_trace("FAISS GPU ivf flatl2 Search in [GroupedEmbeddingsForSearch] class");
           this->gpu_ivf_flatl2_index->search(nq, xq, top_k, D, I);
-          // print results
-          printf("I (5 first results)=\n");
-          for (int i = 0; i < 5; i++) {
-               for (int j = 0; j < top_k; j++)
-                    printf("%5ld ", I[i * top_k + j]);
-               printf("\n");
+          return 0;
+     }
+
+     /*** 
+      * Initialize the CPU ivf search index based on the embeddings.
+      * The coarse quantizer is trained on the embeddings of this group with nlist lists.
+      * initalize it if use faiss_cpu_ivf_flat_search()
+     ***/
+     void initialize_cpu_ivf_flat_search(){
+          int nlist = get_ivf_nlist();
+          faiss::IndexFlatL2* quantizer = new faiss::IndexFlatL2(this->emb_dim);
+          this->cpu_ivf_flatl2_index = std::make_unique<faiss::IndexIVFFlat>(quantizer, this->emb_dim, nlist, faiss::METRIC_L2);
+          this->cpu_ivf_flatl2_index->own_fields = true; // the index deletes the quantizer
+          std::vector<float> train_buffer;
+          int64_t num_train = 0;
+          const float* train_embs = get_training_embeddings(IVF_TRAINING_POINTS_PER_LIST * nlist, num_train, train_buffer);
+          this->cpu_ivf_flatl2_index->train(num_train, train_embs);
+          add_segments_to_index(*this->cpu_ivf_flatl2_index);
+          this->cpu_ivf_flatl2_index->nprobe = std::min(this->index_params.nprobe, nlist);
+     }
+
+     /***
+      * FAISS knn search based on ivf search on CPU
+      * https://github.com/facebookresearch/faiss/blob/main/tutorial/cpp/2-IVFFlat.cpp
+      * @param nq: number of queries
+      * @param xq: flaten queries to search 
+      * @param top_k: number of top embeddings to return
+      * @param D: distance array to store the distance of the top_k embeddings
+      * @param I: index array to store the index of the top_k embeddings
+     ***/
+     int faiss_cpu_ivf_flat_search(int nq, float* xq, int top_k, float* D, long* I){
+          dbg_default_trace("FAISS CPU ivf flatl2 Search in [GroupedEmbeddingsForSearch] class");
+          this->cpu_ivf_flatl2_index->search(nq, xq, top_k, D, I);
+          return 0;
+     }
+
+     /*** 
+      * Initialize the CPU HNSW search index based on the embeddings.
+      * initalize it if use faiss_cpu_hnsw_flat_search()
+     ***/
+     void initialize_cpu_hnsw_flat_search(){
+          this->cpu_hnsw_flatl2_index = std::make_unique<faiss::IndexHNSWFlat>(this->emb_dim, this->index_params.hnsw_m);
+          this->cpu_hnsw_flatl2_index->hnsw.efConstruction = this->index_params.hnsw_ef_construction;
+          add_segments_to_index(*this->cpu_hnsw_flatl2_index);
+          this->cpu_hnsw_flatl2_index->hnsw.efSearch = this->index_params.hnsw_ef_search;
+     }
+
+     /***
+      * FAISS knn search based on HNSW graph on CPU
+      * @param nq: number of queries
+      * @param xq: flaten queries to search 
+      * @param top_k: number of top embeddings to return
+      * @param D: distance array to store the distance of the top_k embeddings
+      * @param I: index array to store the index of the top_k embeddings
+     ***/
+     int faiss_cpu_hnsw_flat_search(int nq, float* xq, int top_k, float* D, long* I){
+          dbg_default_trace("FAISS CPU HNSW flatl2 Search in [GroupedEmbeddingsForSearch] class");
+          this->cpu_hnsw_flatl2_index->search(nq, xq, top_k, D, I);
+          return 0;
+     }
+
+     /***
+      * Built-in knn search on CPU without FAISS, scanning the embeddings with kernels specialized for emb_dim
+      * @param nq: number of queries
+      * @param xq: flaten queries to search 
+      * @param top_k: number of top embeddings to return
+      * @param D: distance array to store the distance of the top_k embeddings
+      * @param I: index array to store the index of the top_k embeddings
+     ***/
+     int cpu_simd_flat_search(int nq, float* xq, int top_k, float* D, long* I){
+          dbg_default_trace("CPU SIMD flatl2 Search in [GroupedEmbeddingsForSearch] class");
+          if (this->segments.empty()) {
+               return -1;
+          }
+          const EmbeddingSegment& first = this->segments[0];
+          simd_flat_l2_search(first.data, this->embedding_norms.data(), first.num_embs, this->emb_dim, nq, xq, top_k, D, I);
+          if (this->segments.size() == 1) {
+               return 0;
+          }
+          // search the other segments one by one, and merge their top_k into D and I
+          std::vector<float> segment_D(static_cast<size_t>(nq) * top_k);
+          std::vector<long> segment_I(static_cast<size_t>(nq) * top_k);
+          std::vector<float> merged_D(top_k);
+          std::vector<long> merged_I(top_k);
+          for (size_t s = 1; s < this->segments.size(); s++) {
+               const EmbeddingSegment& segment = this->segments[s];
+               simd_flat_l2_search(segment.data, this->embedding_norms.data() + segment.first_id, segment.num_embs, this->emb_dim,
+                                   nq, xq, top_k, segment_D.data(), segment_I.data());
+               for (int i = 0; i < nq; i++) {
+                    float* d_a = D + static_cast<size_t>(i) * top_k;
+                    long* i_a = I + static_cast<size_t>(i) * top_k;
+                    const float* d_b = segment_D.data() + static_cast<size_t>(i) * top_k;
+                    const long* i_b = segment_I.data() + static_cast<size_t>(i) * top_k;
+                    int a = 0, b = 0;
+                    for (int j = 0; j < top_k; j++) {
+                         // both lists are sorted, with -1 ids padding the end
+                         bool a_valid = a < top_k && i_a[a] >= 0;
+                         bool b_valid = b < top_k && i_b[b] >= 0;
+                         if (a_valid && (!b_valid || d_a[a] <= d_b[b])) {
+                              merged_D[j] = d_a[a];
+                              merged_I[j] = i_a[a++];
+                         } else if (b_valid) {
+                              merged_D[j] = d_b[b];
+                              merged_I[j] = i_b[b++] + segment.first_id;
+                         } else {
+                              merged_D[j] = std::numeric_limits<float>::max();
+                              merged_I[j] = -1;
+                         }
+                    }
+                    std::copy(merged_D.begin(), merged_D.end(), d_a);
+                    std::copy(merged_I.begin(), merged_I.end(), i_a);
+               }
+          }
+          return 0;
+     }
+
+     /***
+      * Initialize the CPU hierarchical search index: a tree of k-means centroids built bottom-up over the embeddings,
+      * with about tree_fanout children per node. The tree holds its own copy of the embeddings, grouped by parent.
+      * initalize it if use cpu_hierarchical_search()
+     ***/
+     void initialize_cpu_hierarchical_search(){
+          std::vector<std::pair<const float*, int64_t>> blocks;
+          for (const auto& segment : this->segments) {
+               blocks.emplace_back(segment.data, segment.num_embs);
           }
+          this->cpu_tree_index = std::make_unique<HierarchicalFlatIndex>();
+          this->cpu_tree_index->build(blocks, this->emb_dim, this->index_params.tree_fanout);
+          dbg_default_info("CPU hierarchical search tree over {} embeddings has {} levels, {} nodes in its top level.",
+                           this->num_embs, this->cpu_tree_index->num_levels(), this->cpu_tree_index->top_level_size());
+     }
 
-          printf("I (5 last results)=\n");
-          for (int i = nq - 5; i < nq; i++) {
-               for (int j = 0; j < top_k; j++)
-                    printf("%5ld ", I[i * top_k + j]);
-               printf("\n");
+     /***
+      * Beam search in the tree of initialize_cpu_hierarchical_search() on CPU, keeping tree_beam_widths nodes per level
+      * @param nq: number of queries
+      * @param xq: flaten queries to search 
+      * @param top_k: number of top embeddings to return
+      * @param D: distance array to store the distance of the top_k embeddings
+      * @param I: index array to store the index of the top_k embeddings
+     ***/
+     int cpu_hierarchical_search(int nq, float* xq, int top_k, float* D, long* I){
+          dbg_default_trace("CPU hierarchical Search in [GroupedEmbeddingsForSearch] class");
+          this->cpu_tree_index->search(nq, xq, top_k, this->index_params.tree_beam_widths, D, I);
+          return 0;
+     }
+
+     /*** 
+      * Initialize the CPU PQ search index based on the embeddings.
+      * Each embedding is stored as pq_m codes of pq_nbits bits (optionally after an OPQ rotation), instead of emb_dim floats.
+      * If rerank_k is 0 (the default), the full-precision embeddings are released after the codes are built (see initialize_groupped_embeddings_for_search).
+      * Otherwise they are kept for the rerank: mapped from the snapshot if snapshot_dir is set, or in memory, which costs as much as a flat index.
+      * initalize it if use faiss_cpu_pq_search()
+     ***/
+     void initialize_cpu_pq_search(){
+          // the sub-quantizers split the embedding evenly, and each needs at least 2^nbits training points
+          int pq_m = std::max(1, std::min(this->index_params.pq_m, this->emb_dim));
+          while (this->emb_dim % pq_m != 0) {
+               pq_m--;
+          }
+          int pq_nbits = this->index_params.pq_nbits;
+          while (pq_nbits > 1 && (1 << pq_nbits) > this->num_embs) {
+               pq_nbits--;
+          }
+          if (pq_m != this->index_params.pq_m || pq_nbits != this->index_params.pq_nbits) {
+               dbg_default_warn("PQ index uses pq_m={}, pq_nbits={} for emb_dim={}, num_embs={}.", pq_m, pq_nbits, this->emb_dim, this->num_embs);
+          }
+          faiss::IndexPQ* pq_index = new faiss::IndexPQ(this->emb_dim, pq_m, pq_nbits, faiss::METRIC_L2);
+          if (this->index_params.use_opq) {
+               auto opq_index = std::make_unique<faiss::IndexPreTransform>(new faiss::OPQMatrix(this->emb_dim, pq_m), pq_index);
+               opq_index->own_fields = true; // deletes the OPQ matrix and the PQ index
+               this->cpu_pq_index = std::move(opq_index);
+          } else {
+               this->cpu_pq_index.reset(pq_index);
+          }
+          std::vector<float> train_buffer;
+          int64_t num_train = 0;
+          const float* train_embs = get_training_embeddings(IVF_TRAINING_POINTS_PER_LIST * (int64_t(1) << pq_nbits), num_train, train_buffer);
+          this->cpu_pq_index->train(num_train, train_embs);
+          add_segments_to_index(*this->cpu_pq_index);
+     }
+
+     /***
+      * FAISS knn search on the PQ codes on CPU, 
+      * then rerank the max(top_k, rerank_k) candidates of each query by the exact distance to the full-precision embeddings
+      * @param nq: number of queries
+      * @param xq: flaten queries to search 
+      * @param top_k: number of top embeddings to return
+      * @param D: distance array to store the distance of the top_k embeddings
+      * @param I: index array to store the index of the top_k embeddings
+     ***/
+     int faiss_cpu_pq_search(int nq, float* xq, int top_k, float* D, long* I){
+          dbg_default_trace("FAISS CPU PQ Search in [GroupedEmbeddingsForSearch] class");
+          if (this->index_params.rerank_k == 0 || this->segments.empty()) {
+               this->cpu_pq_index->search(nq, xq, top_k, D, I);
+               return 0;
+          }
+          int num_candidates = std::max(top_k, this->index_params.rerank_k);
+          std::vector<float> candidate_distances(static_cast<size_t>(nq) * num_candidates);
+          std::vector<long> candidate_ids(static_cast<size_t>(nq) * num_candidates);
+          this->cpu_pq_index->search(nq, xq, num_candidates, candidate_distances.data(), candidate_ids.data());
+          std::vector<std::pair<float, long>> reranked;
+          reranked.reserve(num_candidates);
+          for (int i = 0; i < nq; i++) {
+               const float* query = xq + static_cast<size_t>(i) * this->emb_dim;
+               reranked.clear();
+               for (int j = 0; j < num_candidates; j++) {
+                    long id = candidate_ids[static_cast<size_t>(i) * num_candidates + j];
+                    if (id < 0) {
+                         continue; // fewer embeddings than candidates
+                    }
+                    float distance = faiss::fvec_L2sqr(query, get_embedding(id), this->emb_dim);
+                    reranked.emplace_back(distance, id);
+               }
+               int num_results = std::min(top_k, static_cast<int>(reranked.size()));
+               std::partial_sort(reranked.begin(), reranked.begin() + num_results, reranked.end());
+               for (int j = 0; j < top_k; j++) {
+                    D[i * top_k + j] = j < num_results ? reranked[j].first : std::numeric_limits<float>::max();
+                    I[i * top_k + j] = j < num_results ? reranked[j].second : -1;
+               }
           }
           return 0;
      }
 
      ~GroupedEmbeddingsForSearch() {
-          // free(embeddings);
-          delete[] this->embeddings;
-          delete[] this->query_embs;
+          release_segments();
      }
 
 };
@@ -0,0 +1,145 @@
+#include <algorithm>
+#include <limits>
+#include <numeric>
+
+#include <faiss/Clustering.h>
+#include <faiss/IndexFlat.h>
+#include <faiss/utils/distances.h>
+
+#include "hierarchical_index.hpp"
+
+void HierarchicalFlatIndex::build(const std::vector<std::pair<const float*, int64_t>>& blocks, int emb_dim, int fanout) {
+     this->emb_dim = emb_dim;
+     fanout = std::max(2, fanout);
+     levels.clear();
+     Level base;
+     for (const auto& block : blocks) {
+          base.vectors.insert(base.vectors.end(), block.first, block.first + block.second * emb_dim);
+     }
+     ids.resize(base.num_nodes(emb_dim));
+     std::iota(ids.begin(), ids.end(), 0);
+     levels.push_back(std::move(base));
+
+     while (levels.back().num_nodes(emb_dim) > static_cast<uint32_t>(fanout)) {
+          Level& below = levels.back();
+          uint32_t n = below.num_nodes(emb_dim);
+          uint32_t k = (n + fanout - 1) / fanout;
+          // 1. cluster the nodes of the level below into k coarse centroids
+          faiss::ClusteringParameters params;
+          params.niter = HIERARCHICAL_KMEANS_ITERATIONS;
+          params.min_points_per_centroid = 1; // a few nodes per centroid is the point here, do not warn about it
+          faiss::Clustering clustering(emb_dim, k, params);
+          faiss::IndexFlatL2 quantizer(emb_dim);
+          clustering.train(n, below.vectors.data(), quantizer);
+          // after training, the quantizer holds the centroids: the parent of a node is its closest centroid
+          std::vector<float> distances(n);
+          std::vector<long> parents(n);
+          quantizer.search(n, below.vectors.data(), 1, distances.data(), parents.data());
+
+          // 2. the centroids with children form the level above, each with the range of its children
+          std::vector<uint32_t> offsets(k, 0);
+          for (long parent : parents) {
+               offsets[parent]++;
+          }
+          Level above;
+          uint32_t offset = 0;
+          for (uint32_t c = 0; c < k; c++) {
+               uint32_t count = offsets[c];
+               offsets[c] = offset;
+               if (count == 0) {
+                    continue;
+               }
+               const float* centroid = clustering.centroids.data() + static_cast<size_t>(c) * emb_dim;
+               above.vectors.insert(above.vectors.end(), centroid, centroid + emb_dim);
+               above.child_begin.push_back(offset);
+               offset += count;
+               above.child_end.push_back(offset);
+          }
+
+          // 3. reorder the level below so that the children of each node are contiguous
+          Level reordered;
+          reordered.vectors.resize(below.vectors.size());
+          reordered.child_begin.resize(below.child_begin.size());
+          reordered.child_end.resize(below.child_end.size());
+          std::vector<int64_t> reordered_ids(levels.size() == 1 ? n : 0);
+          for (uint32_t i = 0; i < n; i++) {
+               uint32_t pos = offsets[parents[i]]++;
+               std::copy(below.vectors.begin() + static_cast<size_t>(i) * emb_dim, below.vectors.begin() + static_cast<size_t>(i + 1) * emb_dim,
+                         reordered.vectors.begin() + static_cast<size_t>(pos) * emb_dim);
+               if (!below.child_begin.empty()) {
+                    reordered.child_begin[pos] = below.child_begin[i];
+                    reordered.child_end[pos] = below.child_end[i];
+               }
+               if (!reordered_ids.empty()) {
+                    reordered_ids[pos] = ids[i];
+               }
+          }
+          below = std::move(reordered);
+          if (!reordered_ids.empty()) {
+               ids = std::move(reordered_ids);
+          }
+          levels.push_back(std::move(above));
+     }
+}
+
+void HierarchicalFlatIndex::search(int nq, const float* xq, int top_k, const std::vector<int>& beam_widths, float* D, long* I) const {
+     std::vector<std::pair<float, uint32_t>> scored;
+     std::vector<uint32_t> frontier;
+     std::vector<uint32_t> next_frontier;
+     const int top = num_levels() - 1;
+     for (int q = 0; q < nq; q++) {
+          const float* query = xq + static_cast<size_t>(q) * emb_dim;
+          float* query_D = D + static_cast<size_t>(q) * top_k;
+          long* query_I = I + static_cast<size_t>(q) * top_k;
+          int num_results = 0;
+          if (top >= 0) {
+               frontier.resize(top_level_size());
+               std::iota(frontier.begin(), frontier.end(), 0);
+          }
+          for (int l = top; l >= 0; l--) {
+               const Level& level = levels[l];
+               scored.clear();
+               for (uint32_t node : frontier) {
+                    scored.emplace_back(faiss::fvec_L2sqr(query, level.vectors.data() + static_cast<size_t>(node) * emb_dim, emb_dim), node);
+               }
+               if (l == 0) {
+                    num_results = std::min(top_k, static_cast<int>(scored.size()));
+                    std::partial_sort(scored.begin(), scored.begin() + num_results, scored.end());
+                    for (int j = 0; j < num_results; j++) {
+                         query_D[j] = scored[j].first;
+                         query_I[j] = static_cast<long>(ids[scored[j].second]);
+                    }
+                    break;
+               }
+               // keep the beam_width closest nodes of this level, and go down to their children
+               int depth = top - l;
+               int beam_width = beam_widths.empty() ? 1 : beam_widths[std::min<size_t>(depth, beam_widths.size() - 1)];
+               size_t keep = std::min(scored.size(), static_cast<size_t>(std::max(1, beam_width)));
+               if (keep == 0) {
+                    break;
+               }
+               std::nth_element(scored.begin(), scored.begin() + (keep - 1), scored.end());
+               next_frontier.clear();
+               for (size_t j = 0; j < keep; j++) {
+                    uint32_t node = scored[j].second;
+                    for (uint32_t child = level.child_begin[node]; child < level.child_end[node]; child++) {
+                         next_frontier.push_back(child);
+                    }
+               }
+               std::swap(frontier, next_frontier);
+          }
+          // pad the results if the beam reached fewer than top_k embeddings, the same way as FAISS
+          for (int j = num_results; j < top_k; j++) {
+               query_D[j] = std::numeric_limits<float>::max();
+               query_I[j] = -1;
+          }
+     }
+}
+
+int64_t HierarchicalFlatIndex::get_memory_bytes() const {
+     int64_t memory_bytes = static_cast<int64_t>(ids.size() * sizeof(int64_t));
+     for (const auto& level : levels) {
+          memory_bytes += level.vectors.size() * sizeof(float) + (level.child_begin.size() + level.child_end.size()) * sizeof(uint32_t);
+     }
+     return memory_bytes;
+}
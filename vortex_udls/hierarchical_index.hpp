@@ -0,0 +1,52 @@
+#pragma once
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#define HIERARCHICAL_KMEANS_ITERATIONS 10 // k-means iterations to build each level of a HierarchicalFlatIndex
+
+/***
+* Multi-level tree over a set of embeddings, searched with a beam search from its top level down instead of a full scan.
+* Level 0 holds the embeddings; each level above holds the k-means centroids of the level below, with about fanout
+* children per node, up to a top level of at most fanout nodes. The children of a node are contiguous in the level below.
+* A query keeps the beam_width closest nodes of each level, and is only compared to their children in the level below,
+* so its cost grows with the beam widths and the fanout instead of the number of embeddings.
+* The search is approximate: an embedding is missed if its ancestor at some level is not among the kept nodes.
+***/
+class HierarchicalFlatIndex {
+     struct Level {
+          std::vector<float> vectors; // num_nodes x emb_dim
+          std::vector<uint32_t> child_begin; // range of the children of each node in the level below; empty in level 0
+          std::vector<uint32_t> child_end;
+
+          uint32_t num_nodes(int emb_dim) const { return static_cast<uint32_t>(vectors.size() / emb_dim); }
+     };
+
+     int emb_dim = 0;
+     std::vector<Level> levels; // levels[0]: the embeddings, levels.back(): the top level
+     std::vector<int64_t> ids; // id of each node of levels[0], i.e. the index of the embedding given to build()
+
+public:
+     /***
+     * Build the tree over the embeddings, given as one or more blocks of row-major embeddings
+     * @param blocks: (data, num_embs) of each block; the id of an embedding is its index across the blocks, in order
+     * @param fanout: average number of children per node, at least 2
+     ***/
+     void build(const std::vector<std::pair<const float*, int64_t>>& blocks, int emb_dim, int fanout);
+
+     /***
+     * Beam search of the top_k embeddings closest to each query
+     * @param beam_widths: number of nodes kept at each level above level 0, from the top level down;
+     *                     the last value is used for the levels below
+     * @param D: distance array to store the squared L2 distance of the top_k embeddings, sorted by increasing distance
+     * @param I: index array to store the id of the top_k embeddings, -1 if the beam reaches fewer than top_k embeddings
+     ***/
+     void search(int nq, const float* xq, int top_k, const std::vector<int>& beam_widths, float* D, long* I) const;
+
+     int num_levels() const { return static_cast<int>(levels.size()); }
+
+     /*** number of nodes in the top level, which every query is compared to ***/
+     uint32_t top_level_size() const { return levels.empty() ? 0 : levels.back().num_nodes(emb_dim); }
+
+     int64_t get_memory_bytes() const;
+};
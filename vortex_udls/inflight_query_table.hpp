@@ -0,0 +1,137 @@
+#pragma once
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/***
+* Single-flight table of the queries sent down the pipeline by a centroids search node, and not answered yet.
+* A query whose text and embedding are identical to an in-flight one is not sent again: it is attached to the in-flight
+* query as a waiter, and gets its result once the aggregate UDL sends back the final result of the in-flight query,
+* identified by its query id.
+* An in-flight query whose result did not come back within timeout_us (e.g. lost on a failure) is dispatched again
+* by its next duplicate, which keeps the waiters attached so far. Without such a duplicate, expire() removes it, and
+* returns its waiters to answer with an error, so that no client waits forever for a lost result.
+* Thread-safe.
+***/
+class InFlightQueryTable {
+public:
+     struct Waiter {
+          uint32_t client_id;
+          uint32_t query_batch_id;
+          uint64_t query_id;
+     };
+
+private:
+     struct InFlightQuery {
+          uint64_t emb_hash;
+          std::vector<uint64_t> query_ids; // ids of the queries sent down the pipeline for it, the first result to come back completes it
+          int64_t dispatch_us;
+          std::vector<Waiter> waiters;
+     };
+
+     int64_t timeout_us;
+     int64_t next_prune_us = 0;
+     std::unordered_map<std::string, InFlightQuery> queries; // query text -> in-flight query
+     std::unordered_map<uint64_t, std::string> query_id_texts; // query id -> query text, of the queries sent down the pipeline
+     std::string lookup_text; // key of the lookups in queries, reused so that looking up a query text does not allocate
+     mutable std::mutex mutex;
+
+     void erase_query_ids(const InFlightQuery& query) {
+          for (uint64_t query_id : query.query_ids) {
+               query_id_texts.erase(query_id);
+          }
+     }
+
+public:
+     explicit InFlightQueryTable(int64_t timeout_us): timeout_us(timeout_us) {}
+
+     /***
+     * Register a query about to be sent down the pipeline, or attach it to the identical in-flight query
+     * @param emb_hash hash_embedding() of the query embedding; a query with the same text but another embedding is not coalesced
+     * @param now_us steady_clock_now_us()
+     * @return true if the query should be sent down the pipeline, false if it waits for the in-flight one
+     ***/
+     bool dispatch_or_wait(std::string_view query_text, uint64_t emb_hash, uint32_t client_id, uint32_t query_batch_id,
+                           uint64_t query_id, int64_t now_us) {
+          std::lock_guard<std::mutex> lock(mutex);
+          lookup_text.assign(query_text.data(), query_text.size());
+          auto it = queries.find(lookup_text);
+          if (it == queries.end()) {
+               queries.emplace(lookup_text, InFlightQuery{emb_hash, {query_id}, now_us, {}});
+               query_id_texts[query_id] = lookup_text;
+               return true;
+          }
+          if (it->second.emb_hash != emb_hash) {
+               return true;
+          }
+          if (now_us - it->second.dispatch_us > timeout_us) {
+               // the result of the previous dispatch completes the query as well, if it eventually comes back
+               it->second.query_ids.push_back(query_id);
+               it->second.dispatch_us = now_us;
+               query_id_texts[query_id] = lookup_text;
+               return true;
+          }
+          it->second.waiters.push_back({client_id, query_batch_id, query_id});
+          return false;
+     }
+
+     /***
+     * Remove a query once its final result came back
+     * @return the waiters to send the result to; empty if the query is not in flight on this node
+     ***/
+     std::vector<Waiter> complete(uint64_t query_id) {
+          std::lock_guard<std::mutex> lock(mutex);
+          auto text_it = query_id_texts.find(query_id);
+          if (text_it == query_id_texts.end()) {
+               return {};
+          }
+          auto it = queries.find(text_it->second);
+          query_id_texts.erase(text_it);
+          if (it == queries.end()) {
+               return {};
+          }
+          std::vector<Waiter> waiters = std::move(it->second.waiters);
+          erase_query_ids(it->second);
+          queries.erase(it);
+          return waiters;
+     }
+
+     /***
+     * Remove the queries whose result did not come back within timeout_us, at most once per timeout_us,
+     * so that lost results do not accumulate
+     * @param expired_waiters output, the waiters of the removed queries with their query text, to answer with an error
+     ***/
+     void expire(int64_t now_us, std::vector<std::pair<std::string, Waiter>>& expired_waiters) {
+          std::lock_guard<std::mutex> lock(mutex);
+          if (now_us < next_prune_us) {
+               return;
+          }
+          next_prune_us = now_us + timeout_us;
+          for (auto it = queries.begin(); it != queries.end();) {
+               if (now_us - it->second.dispatch_us > timeout_us) {
+                    for (const Waiter& waiter : it->second.waiters) {
+                         expired_waiters.emplace_back(it->first, waiter);
+                    }
+                    erase_query_ids(it->second);
+                    it = queries.erase(it);
+               } else {
+                    ++it;
+               }
+          }
+     }
+
+     size_t size() const {
+          std::lock_guard<std::mutex> lock(mutex);
+          return queries.size();
+     }
+
+     /*** number of dispatched query ids still tracked, at least size() ***/
+     size_t num_query_ids() const {
+          std::lock_guard<std::mutex> lock(mutex);
+          return query_id_texts.size();
+     }
+};
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+namespace derecho{
+namespace cascade{
+
+/***
+ * Unbounded multi-producer single-consumer queue (Vyukov's intrusive MPSC queue, with one node allocated per push).
+ * push() is wait-free for the producers: one atomic exchange and one store.
+ * pop() must only be called by one consumer at a time. It may transiently miss an element whose push() is
+ * in progress, so producers should signal the consumer after push() returns.
+ */
+template <typename T>
+class MPSCQueue{
+     struct Node{
+          std::atomic<Node*> next;
+          T value;
+          Node(): next(nullptr), value() {}
+          explicit Node(T&& v): next(nullptr), value(std::move(v)) {}
+     };
+
+     Node stub;
+     std::atomic<Node*> head; // last pushed node, producers side
+     Node* tail; // last consumed node, consumer side
+
+public:
+     MPSCQueue(): head(&stub), tail(&stub) {}
+
+     MPSCQueue(const MPSCQueue&) = delete;
+     MPSCQueue& operator=(const MPSCQueue&) = delete;
+
+     void push(T value){
+          Node* node = new Node(std::move(value));
+          Node* prev = head.exchange(node, std::memory_order_acq_rel);
+          prev->next.store(node, std::memory_order_release);
+     }
+
+     bool pop(T& value){
+          Node* next = tail->next.load(std::memory_order_acquire);
+          if (next == nullptr) {
+               return false;
+          }
+          value = std::move(next->value);
+          if (tail != &stub) {
+               delete tail;
+          }
+          tail = next;
+          return true;
+     }
+
+     ~MPSCQueue(){
+          T value;
+          while (pop(value)) {}
+          if (tail != &stub) {
+               delete tail;
+          }
+     }
+};
+
+} // namespace cascade
+} // namespace derecho
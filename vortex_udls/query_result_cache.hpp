@@ -0,0 +1,87 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/***
+* Bounded LRU cache of the top_k search results (I, D) of query embeddings in one cluster, 
+* keyed by hash_embedding() of the query embedding bytes, so that a repeated query is answered without being searched.
+* Each entry keeps the embedding it was searched for, compared on a hit, so that two embeddings with the same hash never share results.
+* Results are only valid for the embeddings of the cluster they were searched in: the cache is cleared when the cluster is reloaded.
+* Thread-safe: looked up by the handler threads, filled by the search workers.
+***/
+class QueryResultCache {
+     struct Entry {
+          uint64_t emb_hash;
+          std::vector<float> emb;
+          std::vector<long> I;
+          std::vector<float> D;
+     };
+
+     size_t capacity;
+     int emb_dim;
+     std::list<Entry> lru_entries; // most recently used at the front
+     std::unordered_map<uint64_t, std::list<Entry>::iterator> entries;
+     mutable std::mutex mutex;
+
+public:
+     QueryResultCache(size_t capacity, int emb_dim): capacity(capacity), emb_dim(emb_dim) {}
+
+     /***
+     * Copy the cached top_k results of a query embedding to I and D
+     * @param emb_hash hash_embedding() of emb
+     * @param emb the query embedding, of emb_dim floats
+     * @return false if the embedding is not cached, or was cached with another top_k
+     ***/
+     bool lookup(uint64_t emb_hash, const float* emb, int top_k, long* I, float* D) {
+          std::lock_guard<std::mutex> lock(mutex);
+          auto it = entries.find(emb_hash);
+          if (it == entries.end() || it->second->I.size() != static_cast<size_t>(top_k) ||
+              std::memcmp(it->second->emb.data(), emb, sizeof(float) * emb_dim) != 0) {
+               return false;
+          }
+          lru_entries.splice(lru_entries.begin(), lru_entries, it->second);
+          std::copy(it->second->I.begin(), it->second->I.end(), I);
+          std::copy(it->second->D.begin(), it->second->D.end(), D);
+          return true;
+     }
+
+     /***
+     * Cache the top_k results of a query embedding. An entry with the same hash is replaced, even for another embedding.
+     ***/
+     void insert(uint64_t emb_hash, const float* emb, int top_k, const long* I, const float* D) {
+          if (capacity == 0) {
+               return;
+          }
+          std::lock_guard<std::mutex> lock(mutex);
+          auto it = entries.find(emb_hash);
+          if (it != entries.end()) {
+               lru_entries.splice(lru_entries.begin(), lru_entries, it->second);
+               it->second->emb.assign(emb, emb + emb_dim);
+               it->second->I.assign(I, I + top_k);
+               it->second->D.assign(D, D + top_k);
+               return;
+          }
+          if (entries.size() >= capacity) {
+               entries.erase(lru_entries.back().emb_hash);
+               lru_entries.pop_back();
+          }
+          lru_entries.push_front(Entry{emb_hash, std::vector<float>(emb, emb + emb_dim), std::vector<long>(I, I + top_k), std::vector<float>(D, D + top_k)});
+          entries[emb_hash] = lru_entries.begin();
+     }
+
+     void clear() {
+          std::lock_guard<std::mutex> lock(mutex);
+          entries.clear();
+          lru_entries.clear();
+     }
+
+     size_t size() const {
+          std::lock_guard<std::mutex> lock(mutex);
+          return entries.size();
+     }
+};
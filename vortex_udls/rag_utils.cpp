@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <iostream>    
 #include <limits>      
 #include <stdexcept>   
@@ -6,6 +7,64 @@
 #include "rag_utils.hpp"
 #include <cascade/service_client_api.hpp>
 
+LatencyHistogram::LatencyHistogram(): count(0), total_us(0), max_us(0) {
+     for (auto& bucket : buckets) {
+          bucket = 0;
+     }
+}
+
+int LatencyHistogram::bucket_index(uint64_t value_us) {
+     if (value_us < NUM_SUB_BUCKETS) {
+          return static_cast<int>(value_us);
+     }
+     // the position of the highest bit selects the power of two, the next SUB_BUCKET_BITS bits select the sub-bucket
+     int msb = 63 - __builtin_clzll(value_us);
+     int shift = msb - SUB_BUCKET_BITS;
+     int sub_bucket = static_cast<int>((value_us >> shift) & (NUM_SUB_BUCKETS - 1));
+     return (shift + 1) * NUM_SUB_BUCKETS + sub_bucket;
+}
+
+uint64_t LatencyHistogram::bucket_upper_bound(int index) {
+     if (index < NUM_SUB_BUCKETS) {
+          return static_cast<uint64_t>(index);
+     }
+     int shift = index / NUM_SUB_BUCKETS - 1;
+     uint64_t sub_bucket = static_cast<uint64_t>(index % NUM_SUB_BUCKETS);
+     return ((NUM_SUB_BUCKETS + sub_bucket + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(int64_t value_us) {
+     uint64_t value = value_us > 0 ? static_cast<uint64_t>(value_us) : 0;
+     buckets[bucket_index(value)].fetch_add(1, std::memory_order_relaxed);
+     count.fetch_add(1, std::memory_order_relaxed);
+     total_us.fetch_add(value, std::memory_order_relaxed);
+     if (value > max_us.load(std::memory_order_relaxed)) {
+          max_us.store(value, std::memory_order_relaxed);
+     }
+}
+
+double LatencyHistogram::get_mean_us() const {
+     uint64_t n = count;
+     return n == 0 ? 0.0 : static_cast<double>(total_us) / n;
+}
+
+uint64_t LatencyHistogram::get_percentile_us(double percentile) const {
+     uint64_t n = count;
+     if (n == 0) {
+          return 0;
+     }
+     uint64_t rank = static_cast<uint64_t>(percentile / 100.0 * n);
+     rank = std::max<uint64_t>(1, std::min(rank, n));
+     uint64_t seen = 0;
+     for (int i = 0; i < NUM_BUCKETS; i++) {
+          seen += buckets[i].load(std::memory_order_relaxed);
+          if (seen >= rank) {
+               return std::min(bucket_upper_bound(i), max_us.load(std::memory_order_relaxed));
+          }
+     }
+     return max_us;
+}
+
 /***
 * Helper function for logging purpose, to extract the query information from the key
 * @param key_string the key string to extract the query information from
@@ -58,7 +117,32 @@ bool parse_batch_id(const std::string& key_string, int& client_id, int& batch_id
 }
 
 
-bool parse_query_info(const std::string& key_string, int& client_id, int& batch_id, int& cluster_id, int& qid){
+bool parse_query_id(const std::string& key_string, uint64_t& query_id) {
+     size_t pos = key_string.rfind(QUERY_ID_DELIMITER);
+     if (pos == std::string::npos) {
+          return false;
+     }
+     pos += strlen(QUERY_ID_DELIMITER);
+     if (key_string.size() - pos != 16) {
+          return false;
+     }
+     query_id = 0;
+     for (; pos < key_string.size(); pos++) {
+          char c = key_string[pos];
+          uint64_t digit;
+          if (c >= '0' && c <= '9') {
+               digit = c - '0';
+          } else if (c >= 'a' && c <= 'f') {
+               digit = c - 'a' + 10;
+          } else {
+               return false;
+          }
+          query_id = (query_id << 4) | digit;
+     }
+     return true;
+}
+
+bool parse_query_info(const std::string& key_string, int& client_id, int& batch_id, int& cluster_id, uint64_t& query_id){
      if (!parse_number(key_string, "client", client_id)) {
           std::cerr << "Failed to parse client_id from key: " << key_string << std::endl;
           return false;
@@ -71,8 +155,8 @@ bool parse_query_info(const std::string& key_string, int& client_id, int& batch_
           std::cerr << "Failed to parse cluster_id from key: " << key_string << std::endl;
           return false;
      }
-     if (!parse_number(key_string, "_qid", qid)) {
-          std::cerr << "Failed to parse qid from key: " << key_string << std::endl;
+     if (!parse_query_id(key_string, query_id)) {
+          std::cerr << "Failed to parse query_id from key: " << key_string << std::endl;
           return false;
      }
      return true;
@@ -102,130 +186,3 @@ std::priority_queue<std::string, std::vector<std::string>, CompareObjKey> filter
      }
      return filtered_keys;
 }
-
-/*** 
-* Helper function to cdpo_handler()
-* @param bytes the bytes object to deserialize
-* @param data_size the size of the bytes object
-* @param nq the number of queries in the blob object, output. Used by FAISS search.
-     type is uint32_t because in previous encode_centroids_search_udl, it is serialized from an unsigned "big" ordered int
-* @param query_embeddings the embeddings of the queries, output. 
-***/
-void deserialize_embeddings_and_quries_from_bytes(const uint8_t* bytes,
-                                                            const std::size_t& data_size,
-                                                            uint32_t& nq,
-                                                            const int& emb_dim,
-                                                            float*& query_embeddings,
-                                                            std::vector<std::string>& query_list) {
-     if (data_size < 4) {
-          throw std::runtime_error("Data size is too small to deserialize its embeddings and queries.");
-     }
-     
-     // 0. get the number of queries in the blob object
-     nq = (static_cast<uint32_t>(bytes[0]) << 24) |
-                    (static_cast<uint32_t>(bytes[1]) << 16) |
-                    (static_cast<uint32_t>(bytes[2]) <<  8) |
-                    (static_cast<uint32_t>(bytes[3]));
-     dbg_default_trace("In [{}],Number of queries: {}",__func__,nq);
-     // 1. get the emebddings of the queries from the blob object
-     std::size_t float_array_start = 4;
-     std::size_t float_array_size = sizeof(float) * emb_dim * nq;
-     std::size_t float_array_end = float_array_start + float_array_size;
-     if (data_size < float_array_end) {
-          std::cerr << "Data size "<< data_size <<" is too small for the expected float array end: " << float_array_end <<"." << std::endl;
-          return;
-     }
-     query_embeddings = const_cast<float*>(reinterpret_cast<const float*>(bytes + float_array_start));
-
-     // 2. get the queries from the blob object
-     std::size_t json_start = float_array_end;
-     if (json_start >= data_size) {
-          std::cerr << "No space left for queries data." << std::endl;
-          return;
-     }
-     // Create a JSON string from the remainder of the bytes object
-     char* json_data = const_cast<char*>(reinterpret_cast<const char*>(bytes + json_start));
-     std::size_t json_size = data_size - json_start;
-     std::string json_string(json_data, json_size);
-
-     // Parse the JSON string using nlohmann/json
-     try {
-          nlohmann::json parsed_json = nlohmann::json::parse(json_string);
-          query_list = parsed_json.get<std::vector<std::string>>();
-     } catch (const nlohmann::json::parse_error& e) {
-          std::cerr << "JSON parse error: " << e.what() << std::endl;
-     }
-}
-
-/***
-* Format the search results for each query to send to the next UDL.
-* The format is | top_k | embeding_id_vector | distance_vector | query_text |
-***/
-std::string serialize_cluster_search_result(uint32_t top_k, long* I, float* D, int idx, std::string& query_text){
-     std::string query_search_result;
-     std::string num_embs(4, '\0');  // denotes the number of embedding_ids and distances 
-     num_embs[0] = (top_k >> 24) & 0xFF;
-     num_embs[1] = (top_k >> 16) & 0xFF;
-     num_embs[2] = (top_k >> 8) & 0xFF;
-     num_embs[3] = top_k & 0xFF;
-     query_search_result = num_embs +\
-                         std::string(reinterpret_cast<const char*>(&I[idx * top_k]) , sizeof(long) * top_k) +\
-                         std::string(reinterpret_cast<const char*>(&D[idx * top_k]) , sizeof(float) * top_k) +\
-                         query_text;
-     return query_search_result; // RVO
-}
-
-
-/***
- * Helper function to aggregate cdpo_handler()
- * 
-***/
-void deserialize_cluster_search_result_from_bytes(const int& cluster_id,
-                                                  const uint8_t* bytes,
-                                                  const size_t& data_size,
-                                                  std::string& query_text,
-                                                  std::vector<DocIndex>& cluster_results) {
-     if (data_size < 4) {
-          throw std::runtime_error("Data size is too small to deserialize the cluster searched result.");
-     }
-     
-     // 0. get the count of top_k selected from this cluster in the blob object
-     uint32_t cluster_selected_count = (static_cast<uint32_t>(bytes[0]) << 24) |
-                    (static_cast<uint32_t>(bytes[1]) << 16) |
-                    (static_cast<uint32_t>(bytes[2]) <<  8) |
-                    (static_cast<uint32_t>(bytes[3]));
-     dbg_default_trace("In [{}], cluster searched top_k: {}",__func__,cluster_selected_count);
-     // 1. get the cluster searched top_k emb index vector (I) from the blob object
-     std::size_t I_array_start = 4;
-     std::size_t I_array_size = sizeof(long) * cluster_selected_count;
-     std::size_t I_array_end = I_array_start + I_array_size;
-     if (data_size < I_array_end) {
-          std::cerr << "Data size "<< data_size <<" is too small for the I array: " << I_array_end <<"." << std::endl;
-          return;
-     }
-     long* I = const_cast<long*>(reinterpret_cast<const long*>(bytes + I_array_start));
-     // 2. get the distance vector (D)
-     std::size_t D_array_start = I_array_end;
-     std::size_t D_array_size = sizeof(float) * cluster_selected_count;
-     std::size_t D_array_end = D_array_start + D_array_size;
-     if (data_size < D_array_end) {
-          std::cerr << "Data size "<< data_size <<" is too small for the D array: " << D_array_end <<"." << std::endl;
-          return;
-     }
-     float* D = const_cast<float*>(reinterpret_cast<const float*>(bytes + D_array_start));
-     // 3. get the query text
-     std::size_t query_text_start = D_array_end;
-     if (query_text_start >= data_size) {
-          std::cerr << "No space left for query text." << std::endl;
-          return;
-     }
-     // convert the remaining bytes to std::string
-     char* query_text_data = const_cast<char*>(reinterpret_cast<const char*>(bytes + query_text_start));
-     std::size_t query_text_size = data_size - query_text_start;
-     query_text = std::string(query_text_data, query_text_size);
-     // 4. create the DocIndex vector
-     for (uint32_t i = 0; i < cluster_selected_count; i++) {
-          cluster_results.push_back(DocIndex{cluster_id, I[i], D[i]});
-     }
-
-}
\ No newline at end of file
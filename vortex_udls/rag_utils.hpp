@@ -1,10 +1,78 @@
 #pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
 #include <queue>
 #include <vector>
 #include <string>
+#include <thread>
+#include "wire_format.hpp"
 
-#define QUERY_BATCH_ID_MODULUS 100000
 #define CLUSTER_KEY_DELIMITER "_cluster"
+#define MAX_IN_FLIGHT_GETS 16 // window of outstanding get requests when loading an object split into chunks
+#define WARMUP_POLL_INTERVAL_MS 1000 // interval between the list_keys polls of a warmup waiting for its data
+#define WARMUP_CONTROL_KEY "warmup" // key put to a UDL trigger path to load its data in the background
+#define CENTROIDS_SEARCH_PATHNAME "/rag/emb/centroids_search"
+#define CLUSTERS_SEARCH_PATHNAME "/rag/emb/clusters_search"
+#define QUERY_RESULT_KEY "query_result" // key put by the aggregate UDL to the centroids search trigger path, with the final result of a query it sent
+
+/***
+* Monotonic timestamp in microseconds, used for batching deadlines and queueing delay.
+***/
+inline int64_t steady_clock_now_us() {
+     return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/***
+* Fast 64-bit hash of the bytes of an embedding, 8 bytes at a time, used to recognize repeated query embeddings.
+***/
+inline uint64_t hash_embedding(const float* emb, int emb_dim) {
+     const uint8_t* bytes = reinterpret_cast<const uint8_t*>(emb);
+     size_t size = static_cast<size_t>(emb_dim) * sizeof(float);
+     uint64_t hash = 0x9E3779B97F4A7C15ULL ^ size;
+     size_t i = 0;
+     for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+          uint64_t word;
+          std::memcpy(&word, bytes + i, sizeof(word));
+          hash = (hash ^ word) * 0xFF51AFD7ED558CCDULL;
+          hash ^= hash >> 32;
+     }
+     for (; i < size; i++) {
+          hash = (hash ^ bytes[i]) * 0xC4CEB9FE1A85EC53ULL;
+     }
+     hash ^= hash >> 33;
+     hash *= 0xC4CEB9FE1A85EC53ULL;
+     hash ^= hash >> 33;
+     return hash;
+}
+
+/***
+* Histogram of latencies in microseconds, with 8 buckets per power of two (<12.5% relative error on percentiles).
+* record() is meant to be called by one thread at a time; the counters are atomic so that it can be read concurrently.
+***/
+class LatencyHistogram {
+     static constexpr int SUB_BUCKET_BITS = 3;
+     static constexpr int NUM_SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+     static constexpr int NUM_BUCKETS = 64 * NUM_SUB_BUCKETS;
+     std::atomic<uint64_t> buckets[NUM_BUCKETS];
+     std::atomic<uint64_t> count;
+     std::atomic<uint64_t> total_us;
+     std::atomic<uint64_t> max_us;
+
+     static int bucket_index(uint64_t value_us);
+     static uint64_t bucket_upper_bound(int index);
+public:
+     LatencyHistogram();
+     void record(int64_t value_us);
+     uint64_t get_count() const { return count; }
+     double get_mean_us() const;
+     uint64_t get_max_us() const { return max_us; }
+     /*** @param percentile in [0,100], returns the upper bound of the bucket that contains it ***/
+     uint64_t get_percentile_us(double percentile) const;
+};
 
 /***
 * Helper function for logging purpose, to extract the query information from the key
@@ -19,7 +87,41 @@ bool parse_number(const std::string& key_string, const std::string& delimiter, i
 bool parse_batch_id(const std::string& key_string, int& client_id, int& batch_id);
 
 
-bool parse_query_info(const std::string& key_string, int& client_id, int& batch_id, int& cluster_id, int& qid);
+bool parse_query_info(const std::string& key_string, int& client_id, int& batch_id, int& cluster_id, uint64_t& query_id);
+
+/***
+* Query ids are assigned by the clients and identify a query across the pipeline: the client id in the high 32 bits,
+* and a sequence number of the client in the low 32 bits, incremented for each query it sends. The UDLs log and report
+* this sequence number as the query_batch_id of the query (get_query_batch_id), so that every stage reports the same value
+* for a query from its id alone. They are carried in the payloads of the queries, 
+* and in the keys of the search results emitted to the aggregate UDL, as QUERY_ID_DELIMITER followed by 16 hex digits,
+* which the affinity set regex of /rag/generate uses to send all the results of a query to the same shard.
+***/
+#define QUERY_ID_DELIMITER "_qid"
+
+inline uint64_t make_query_id(uint32_t client_id, uint32_t sequence) {
+     return (static_cast<uint64_t>(client_id) << 32) | sequence;
+}
+
+/*** The query_batch_id of a query, for logging: the sequence number its client put in its id ***/
+inline uint32_t get_query_batch_id(uint64_t query_id) {
+     return static_cast<uint32_t>(query_id);
+}
+
+/*** Append QUERY_ID_DELIMITER and the 16 hex digits of query_id to key ***/
+inline void append_query_id(std::string& key, uint64_t query_id) {
+     static const char hex_digits[] = "0123456789abcdef";
+     char digits[16];
+     for (int i = 15; i >= 0; i--) {
+          digits[i] = hex_digits[query_id & 0xF];
+          query_id >>= 4;
+     }
+     key.append(QUERY_ID_DELIMITER);
+     key.append(digits, sizeof(digits));
+}
+
+/*** Parse the query id appended by append_query_id() to a key ***/
+bool parse_query_id(const std::string& key_string, uint64_t& query_id);
 
 struct CompareObjKey {
      bool operator()(const std::string& key1, const std::string& key2) const {
@@ -38,27 +140,87 @@ struct CompareObjKey {
 */
 std::priority_queue<std::string, std::vector<std::string>, CompareObjKey> filter_exact_matched_keys(std::vector<std::string>& obj_keys, const std::string& prefix);
 
-/*** 
-* Helper function to cdpo_handler()
-* @param bytes the bytes object to deserialize
-* @param data_size the size of the bytes object
-* @param nq the number of queries in the blob object, output. Used by FAISS search.
-     type is uint32_t because in previous encode_centroids_search_udl, it is serialized from an unsigned "big" ordered int
-* @param query_embeddings the embeddings of the queries, output. 
-***/
-void deserialize_embeddings_and_quries_from_bytes(const uint8_t* bytes,
-                                                            const std::size_t& data_size,
-                                                            uint32_t& nq,
-                                                            const int& emb_dim,
-                                                            float*& query_embeddings,
-                                                            std::vector<std::string>& query_list);
+/*** Helper function to load objects split into chunks:
+*    get the objects of all keys from Cascade, with up to max_in_flight get requests outstanding at a time,
+*    instead of waiting for each reply before sending the next request.
+*    The replies are handled in the order of keys, each as soon as it and the ones before it have arrived.
+*    @param service_client the service client reference of the UDL context
+*    @param on_reply called with (index of the key in keys, reply object); returning false stops the retrieval
+*    @return false if on_reply returned false, true otherwise
+*/
+template <typename ServiceClientType, typename VersionType, typename ReplyHandler>
+bool pipelined_get(ServiceClientType& service_client, const std::vector<std::string>& keys, size_t max_in_flight,
+                   const VersionType& version, bool stable, ReplyHandler&& on_reply) {
+     using GetResultsType = decltype(service_client.get(keys.front(), version, stable));
+     std::deque<std::pair<size_t, GetResultsType>> in_flight;
+     max_in_flight = std::max<size_t>(1, max_in_flight);
+     size_t next_key = 0;
+     while (next_key < keys.size() || !in_flight.empty()) {
+          while (next_key < keys.size() && in_flight.size() < max_in_flight) {
+               in_flight.emplace_back(next_key, service_client.get(keys[next_key], version, stable));
+               next_key++;
+          }
+          auto& [key_index, get_results] = in_flight.front();
+          auto& reply = get_results.get().begin()->second.get();
+          bool keep_going = on_reply(key_index, reply);
+          in_flight.pop_front();
+          if (!keep_going) {
+               return false; // the outstanding replies are dropped
+          }
+     }
+     return true;
+}
+
+/*** Keys of a priority_queue returned by filter_exact_matched_keys(), in the order they are popped ***/
+inline std::vector<std::string> drain_keys(std::priority_queue<std::string, std::vector<std::string>, CompareObjKey>& obj_keys) {
+     std::vector<std::string> keys;
+     keys.reserve(obj_keys.size());
+     while (!obj_keys.empty()) {
+          keys.push_back(obj_keys.top());
+          obj_keys.pop();
+     }
+     return keys;
+}
 
 /***
-* Format the search results for each query to send to the next UDL.
-* The format is | top_k | embeding_id_vector | distance_vector | query_text |
-***/
-std::string serialize_cluster_search_result(uint32_t top_k, long* I, float* D, int idx, std::string& query_text);
+*    Helper function to the background warmup of the UDLs:
+*    wait until objects with the prefix are in Cascade, and their keys stay the same for one poll interval, 
+*    so that the warmup does not load a group whose objects are still being put.
+*    @param stop set by the UDL destructor to abort the wait
+*    @return the keys listed under the prefix, or an empty vector if the wait was stopped
+*/
+template <typename ServiceClientType, typename VersionType>
+std::vector<std::string> wait_for_keys(ServiceClientType& service_client, const std::string& prefix,
+                                       const VersionType& version, bool stable, const std::atomic<bool>& stop) {
+     std::vector<std::string> previous_keys;
+     while (!stop.load()) {
+          auto keys_future = service_client.list_keys(version, stable, prefix);
+          std::vector<std::string> keys = service_client.wait_list_keys(keys_future);
+          std::sort(keys.begin(), keys.end());
+          if (!keys.empty() && keys == previous_keys) {
+               return keys;
+          }
+          previous_keys = std::move(keys);
+          std::this_thread::sleep_for(std::chrono::milliseconds(WARMUP_POLL_INTERVAL_MS));
+     }
+     return {};
+}
 
+/***
+*    Index of the shard of the subgroup that this node is a member of
+*    @return -1 if this node is not a member of the subgroup
+*/
+template <typename SubgroupType, typename ServiceClientType>
+int get_my_shard_index(ServiceClientType& service_client, uint32_t subgroup_index) {
+     auto shard_members = service_client.template get_subgroup_members<SubgroupType>(subgroup_index);
+     auto my_id = service_client.get_my_id();
+     for (size_t shard_index = 0; shard_index < shard_members.size(); shard_index++) {
+          if (std::find(shard_members[shard_index].begin(), shard_members[shard_index].end(), my_id) != shard_members[shard_index].end()) {
+               return static_cast<int>(shard_index);
+          }
+     }
+     return -1;
+}
 
 struct DocIndex{
      int cluster_id;
@@ -73,14 +235,3 @@ inline std::ostream& operator<<(std::ostream& os, const DocIndex& doc_index) {
      os << "cluster_id: " << doc_index.cluster_id << ", emb_id: " << doc_index.emb_id << ", distance: " << doc_index.distance;
      return os;
 }
-
-
-/***
- * Helper function to aggregate cdpo_handler()
- * 
-***/
-void deserialize_cluster_search_result_from_bytes(const int& cluster_id,
-                                                  const uint8_t* bytes,
-                                                  const size_t& data_size,
-                                                  std::string& query_text,
-                                                  std::vector<DocIndex>& cluster_results);
\ No newline at end of file
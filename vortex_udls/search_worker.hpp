@@ -1,134 +1,401 @@
+#include <algorithm>
+#include <chrono>
 #include <condition_variable>
+#include <deque>
+#include <functional>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <queue>
 #include <shared_mutex>
+#include <thread>
 #include <unordered_map>
+#include <vector>
 
 
 #include <cascade/user_defined_logic_interface.hpp>
 #include <cascade/utils.hpp>
 #include <cascade/cascade_interface.hpp>
-#include <derecho/openssl/hash.hpp>
 
 #include "grouped_embeddings_for_search.hpp"
+#include "mpsc_queue.hpp"
 
 #define EMIT_AGGREGATE_PREFIX "/rag/generate/agg"
 
 namespace derecho{
 namespace cascade{
-class ClusterSearchWorker {
+/***
+ * Order in which the search workers pick the clusters with ready batches
+ */
+enum class ClusterSchedulingPolicy {
+    ROUND_ROBIN, // in the order the clusters became ready, per worker deque with work stealing
+    EDF,         // earliest deadline first: the cluster whose oldest pending query arrived first
+};
+
+/***
+ * Pool of search workers that run batchedSearch() on the clusters with ready batches and emit the results.
+ * Scheduling is driven by the clusters that have pending queries, instead of scanning cluster_search_index:
+ *  - A cluster is queued, by id, to the MPSC inbox of its home worker (cluster_id % num_workers) when its batch becomes ready,
+ *    i.e. when add_queries() makes it non-empty with max_batch_wait_us == 0, when it fills up to max_batch_size,
+ *    or when the deadline of its batch expires. Pending batches that are not ready yet wait in batch_timers,
+ *    which every worker checks before popping a cluster, so deadlines are met while the workers are busy.
+ *  - The inbox is drained into the worker's deque; workers pop from the front of their own deque and steal from the back
+ *    of the others' deques when they run out of work, so independent clusters are searched in parallel.
+ *  - A cluster is queued at most once at a time (see GroupedEmbeddingsForSearch::try_mark_scheduled), so its batches are
+ *    searched by one worker at a time.
+ * Workers only take cluster_search_index_map_mutex to look up a cluster id, never during search or emit.
+ * With ClusterSchedulingPolicy::EDF, ready clusters are instead kept in one heap shared by all workers, ordered by the
+ * arrival time of their oldest pending query, so that a cluster with a long-waiting query is not queued behind others.
+ */
+class ClusterSearchWorkerPool {
+    struct ReadyClusterQueue {
+        MPSCQueue<int> inbox; // producers: handler threads and workers scheduling a cluster
+        std::mutex inbox_consumer_mutex; // held by the one thread draining the inbox
+        std::deque<int> cluster_ids; // drained from inbox, popped by the owner and stolen by other workers
+        std::mutex mutex;
+    };
+
+    struct EDFReadyCluster {
+        int64_t oldest_arrival_us;
+        int cluster_id;
+        bool operator>(const EDFReadyCluster& other) const {
+            return oldest_arrival_us > other.oldest_arrival_us;
+        }
+    };
+
+    struct BatchTimer {
+        int64_t deadline_us;
+        int64_t arrival_us; // arrival time of the batch this timer is for, to skip timers of already searched batches
+        int cluster_id;
+        bool operator>(const BatchTimer& other) const {
+            return deadline_us > other.deadline_us;
+        }
+    };
+
     int top_k;
-    std::unordered_map<int, std::unique_ptr<GroupedEmbeddingsForSearch>>& cluster_search_index;
-    std::condition_variable_any& cluster_search_index_cv;
+    std::unordered_map<int, std::shared_ptr<GroupedEmbeddingsForSearch>>& cluster_search_index;
     std::shared_mutex& cluster_search_index_map_mutex;
-    // Keeps track of the last processed cluster for round-robin scheduling
-    int last_processed_cluster_index = 0;
-    std::atomic<bool>& execution_thread_running;
+    // Batching policy per cluster: a cluster is searched once it has max_batch_size pending queries,
+    // or once its oldest pending query has waited max_batch_wait_us, whichever comes first.
+    int max_batch_size;
+    int64_t max_batch_wait_us;
+    ClusterSchedulingPolicy scheduling_policy;
+    std::function<void(const ObjectWithStringKey&)> put_result; // puts a result object to the aggregate UDL
 
-public:
-    ClusterSearchWorker(int top_k,
-                        std::unordered_map<int, std::unique_ptr<GroupedEmbeddingsForSearch>>& index,
-                        std::condition_variable_any& cv,
-                        std::shared_mutex& mutex,
-                        std::atomic<bool>& running_flag)
-        : top_k(top_k),
-          cluster_search_index(index),
-          cluster_search_index_cv(cv),
-          cluster_search_index_map_mutex(mutex),
-          execution_thread_running(running_flag) {}
+    std::vector<std::unique_ptr<ReadyClusterQueue>> ready_queues; // one per worker, used by ROUND_ROBIN
+    std::priority_queue<EDFReadyCluster, std::vector<EDFReadyCluster>, std::greater<EDFReadyCluster>> edf_ready_clusters; // used by EDF
+    std::mutex edf_mutex;
+    std::atomic<int> num_ready_clusters = 0;
+    std::atomic<int> num_sleeping_workers = 0;
+    std::priority_queue<BatchTimer, std::vector<BatchTimer>, std::greater<BatchTimer>> batch_timers; // protected by pool_mutex
+    std::atomic<int64_t> next_batch_deadline_us = std::numeric_limits<int64_t>::max(); // deadline of batch_timers.top(), checked without pool_mutex
+    std::mutex pool_mutex;
+    std::condition_variable pool_cv;
+    std::atomic<bool> running = true;
+    std::vector<std::thread> worker_threads;
+
+    /***
+     * O(1) lookup of a cluster id popped from a ready queue.
+     * Idle clusters may be evicted from cluster_search_index, the returned shared_ptr keeps the cluster alive while it is used.
+     */
+    std::shared_ptr<GroupedEmbeddingsForSearch> find_cluster(int cluster_id) {
+        std::shared_lock<std::shared_mutex> read_lock(cluster_search_index_map_mutex);
+        auto it = cluster_search_index.find(cluster_id);
+        if (it == cluster_search_index.end()) {
+            return nullptr;
+        }
+        return it->second;
+    }
+
+    void schedule_cluster(int cluster_id, GroupedEmbeddingsForSearch* cluster_index) {
+        if (!cluster_index->try_mark_scheduled()) {
+            return;
+        }
+        if (scheduling_policy == ClusterSchedulingPolicy::EDF) {
+            // the oldest pending query does not change until the cluster is searched
+            std::lock_guard<std::mutex> lock(edf_mutex);
+            edf_ready_clusters.push(EDFReadyCluster{cluster_index->get_oldest_pending_arrival_us(), cluster_id});
+        } else {
+            ready_queues[cluster_id % ready_queues.size()]->inbox.push(cluster_id);
+        }
+        num_ready_clusters++;
+        // only pay for pool_mutex if a worker may be sleeping; pairs with the predicate check in wait_for_work()
+        if (num_sleeping_workers > 0) {
+            {
+                std::lock_guard<std::mutex> lock(pool_mutex);
+            }
+            pool_cv.notify_one();
+        }
+    }
 
+    /***
+     * Move the cluster ids from the inbox of a queue to its deque. 
+     * Skipped if another thread is draining this inbox, to keep the inbox single-consumer.
+     */
+    void drain_inbox(ReadyClusterQueue& queue) {
+        std::unique_lock<std::mutex> consumer_lock(queue.inbox_consumer_mutex, std::try_to_lock);
+        if (!consumer_lock.owns_lock()) {
+            return;
+        }
+        int cluster_id;
+        while (queue.inbox.pop(cluster_id)) {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.cluster_ids.push_back(cluster_id);
+        }
+    }
 
     /***
-     * Format the new_keys for the search results of the queries
-     * it is formated as client{client_id}qb{querybatch_id}qc{client_batch_query_count}_cluster{cluster_id}_qid{hash(query)}
-     * @param new_keys the new keys to be constructed
-     * @param key_string the key string of the object
-     * @param query_list a list of query strings
-    ***/
-    inline void construct_new_keys(std::vector<std::string>& new_keys,
-                                                       const std::vector<std::string>& query_keys, 
-                                                       const std::vector<std::string>& query_list) {
-        for (size_t i = 0; i < query_keys.size(); ++i) {
-            const std::string& key_string = query_keys[i];
-            const std::string& query = query_list[i];
-            std::string hashed_query;
-            try {
-                /*** TODO: do we need 32 bytes of hashed key? will simply int be sufficient? */
-                uint8_t digest[32];
-                openssl::Hasher sha256(openssl::DigestAlgorithm::SHA256);
-                const char* query_cstr = query.c_str();
-                sha256.hash_bytes(query_cstr, strlen(query_cstr), digest);
-                std::ostringstream oss;
-                for (int i = 0; i < 32; ++i) {
-                    // Output each byte as a decimal value (0-255) without any leading zeros
-                    oss << std::dec << static_cast<int>(digest[i]);
-                }
-                hashed_query = oss.str();
-            } catch(openssl::openssl_error& ex) {
-                dbg_default_error("Unable to compute SHA256 of typename. string = {}, exception name = {}", query, ex.what());
-                throw;
+     * Pop a ready cluster from the front of this worker's deque, or steal one from the back of another worker's deque
+     * With EDF, pop the ready cluster with the oldest pending query instead.
+     */
+    bool pop_ready_cluster(size_t worker_id, int& cluster_id) {
+        if (scheduling_policy == ClusterSchedulingPolicy::EDF) {
+            std::lock_guard<std::mutex> lock(edf_mutex);
+            if (edf_ready_clusters.empty()) {
+                return false;
             }
-            std::string new_key = key_string + "_qid" + hashed_query;
-            new_keys.push_back(new_key);
+            cluster_id = edf_ready_clusters.top().cluster_id;
+            edf_ready_clusters.pop();
+            num_ready_clusters--;
+            return true;
         }
+        size_t num_workers = ready_queues.size();
+        for (size_t i = 0; i < num_workers; ++i) {
+            ReadyClusterQueue& queue = *ready_queues[(worker_id + i) % num_workers];
+            drain_inbox(queue);
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.cluster_ids.empty()) {
+                continue;
+            }
+            if (i == 0) {
+                cluster_id = queue.cluster_ids.front();
+                queue.cluster_ids.pop_front();
+            } else {
+                cluster_id = queue.cluster_ids.back();
+                queue.cluster_ids.pop_back();
+            }
+            num_ready_clusters--;
+            return true;
+        }
+        return false;
     }
 
+    /***
+     * Schedule the clusters whose pending batch has reached its deadline.
+     * Called by every worker before it pops a cluster, so it only takes pool_mutex once a deadline has expired.
+     */
+    void schedule_expired_batches() {
+        int64_t now_us = steady_clock_now_us();
+        if (now_us < next_batch_deadline_us) {
+            return;
+        }
+        std::vector<BatchTimer> expired_timers;
+        {
+            std::lock_guard<std::mutex> lock(pool_mutex);
+            while (!batch_timers.empty() && batch_timers.top().deadline_us <= now_us) {
+                expired_timers.push_back(batch_timers.top());
+                batch_timers.pop();
+            }
+            next_batch_deadline_us = batch_timers.empty() ? std::numeric_limits<int64_t>::max() : batch_timers.top().deadline_us;
+        }
+        for (const auto& timer : expired_timers) {
+            std::shared_ptr<GroupedEmbeddingsForSearch> cluster_index = find_cluster(timer.cluster_id);
+            if (cluster_index && cluster_index->has_pending_queries() &&
+                cluster_index->get_oldest_pending_arrival_us() == timer.arrival_us) {
+                schedule_cluster(timer.cluster_id, cluster_index.get());
+            }
+        }
+    }
 
-    void search_and_emit(DefaultCascadeContextType* typed_ctxt) {
-        while (execution_thread_running) {
-            std::unique_lock<std::shared_mutex> map_lock(cluster_search_index_map_mutex);
+    /***
+     * Block until there is a ready cluster, or the earliest pending batch reaches its deadline.
+     */
+    void wait_for_work() {
+        std::unique_lock<std::mutex> lock(pool_mutex);
+        num_sleeping_workers++;
+        while (running && num_ready_clusters == 0) {
+            if (batch_timers.empty()) {
+                pool_cv.wait(lock);
+            } else if (batch_timers.top().deadline_us <= steady_clock_now_us()) {
+                break;
+            } else {
+                pool_cv.wait_until(lock, std::chrono::steady_clock::time_point(std::chrono::microseconds(batch_timers.top().deadline_us)));
+            }
+        }
+        num_sleeping_workers--;
+    }
 
-            cluster_search_index_cv.wait(map_lock, [this]() {
-                for (const auto& [id, cluster_index] : cluster_search_index) {
-                    if (cluster_index->has_pending_queries()) {
-                        return true;
-                    }
+    /***
+     * Search the pending batch of a cluster and emit the results of each query to the aggregate UDL
+     */
+    void search_and_emit(int cluster_id, GroupedEmbeddingsForSearch* cluster_index) {
+        long* I = nullptr; // searched result index, which should be allocated by the batched Search function
+        float* D = nullptr; // searched result distance
+        StringList query_texts;
+        std::vector<uint64_t> query_ids;
+        std::vector<uint32_t> query_probe_counts;
+        StringList query_keys;
+        bool search_success = cluster_index->batchedSearch(top_k, &D, &I, query_texts, query_ids, query_keys, nullptr, &query_probe_counts);
+        if (!search_success || !I || !D) {
+            dbg_default_error("Failed to batch search for cluster: {}", cluster_id);
+            return;
+        }
+        emit_results(query_keys, query_texts, query_ids, query_probe_counts, I, D);
+
+        delete[] I;
+        delete[] D;
+    }
+
+    void worker_loop(size_t worker_id) {
+        while (running) {
+            schedule_expired_batches();
+            int cluster_id;
+            if (!pop_ready_cluster(worker_id, cluster_id)) {
+                if (num_ready_clusters > 0) {
+                    // a cluster is being pushed to an inbox, or another worker holds the inbox: retry shortly
+                    std::this_thread::yield();
+                } else {
+                    wait_for_work();
                 }
-                return !execution_thread_running;
+                continue;
+            }
+            std::shared_ptr<GroupedEmbeddingsForSearch> cluster_index = find_cluster(cluster_id);
+            if (!cluster_index) {
+                continue;
+            }
+            search_and_emit(cluster_id, cluster_index.get());
+            cluster_index->clear_scheduled();
+            // queries that arrived during the search may have filled up the next batch, or passed its deadline
+            if (cluster_index->is_batch_ready(max_batch_size, max_batch_wait_us, steady_clock_now_us())) {
+                schedule_cluster(cluster_id, cluster_index.get());
+            }
+        }
+    }
+
+public:
+    /***
+     * Emit the top_k results of each query to the aggregate UDL
+     * The key of each result is formated as client{client_id}qb{querybatch_id}_cluster{cluster_id}_qid{query_id in hex},
+     * so that all the results of a query are sent to the same shard by the affinity set regex of the aggregate UDL.
+     * @param query_probe_counts: the number of clusters each query is sent to, passed on to the aggregate UDL
+     * @param I, D: top_k results per query, in the order of query_keys, query_texts and query_ids
+     */
+    void emit_results(const StringList& query_keys, const StringList& query_texts, const std::vector<uint64_t>& query_ids,
+                      const std::vector<uint32_t>& query_probe_counts, const long* I, const float* D) {
+        for (size_t k = 0; k < query_ids.size(); ++k) {
+            ObjectWithStringKey obj;
+            obj.key = std::string(EMIT_AGGREGATE_PREFIX) + "/";
+            obj.key.append(query_keys[k]);
+            append_query_id(obj.key, query_ids[k]);
+            std::string query_emit_content = serialize_cluster_search_result(query_ids[k], top_k, I + k * top_k, D + k * top_k, query_texts[k],
+                                                                             query_probe_counts[k]);
+            obj.blob = Blob(reinterpret_cast<const uint8_t*>(query_emit_content.c_str()), query_emit_content.size());
+            put_result(obj);
+        }
+    }
+
+    /***
+     * Emit a result with no embeddings for each query, for the queries of a cluster that could not be searched,
+     * so that the aggregate UDL still counts this cluster as answered for them
+     */
+    void emit_empty_results(const StringList& query_keys, const StringList& query_texts, const std::vector<uint64_t>& query_ids,
+                            const std::vector<uint32_t>& query_probe_counts) {
+        for (size_t k = 0; k < query_ids.size(); ++k) {
+            ObjectWithStringKey obj;
+            obj.key = std::string(EMIT_AGGREGATE_PREFIX) + "/";
+            obj.key.append(query_keys[k]);
+            append_query_id(obj.key, query_ids[k]);
+            std::string query_emit_content = serialize_cluster_search_result(query_ids[k], 0, nullptr, nullptr, query_texts[k],
+                                                                             query_probe_counts[k]);
+            obj.blob = Blob(reinterpret_cast<const uint8_t*>(query_emit_content.c_str()), query_emit_content.size());
+            put_result(obj);
+        }
+    }
+
+    ClusterSearchWorkerPool(int top_k,
+                            std::unordered_map<int, std::shared_ptr<GroupedEmbeddingsForSearch>>& index,
+                            std::shared_mutex& mutex,
+                            int max_batch_size,
+                            int64_t max_batch_wait_us,
+                            ClusterSchedulingPolicy scheduling_policy,
+                            DefaultCascadeContextType* typed_ctxt)
+        : ClusterSearchWorkerPool(top_k, index, mutex, max_batch_size, max_batch_wait_us, scheduling_policy,
+                                  [typed_ctxt](const ObjectWithStringKey& obj) {
+                                      typed_ctxt->get_service_client_ref().put_and_forget(obj);
+                                  }) {}
+
+    /***
+     * @param put_result: called by the search workers with each result object, instead of putting it to Cascade
+     */
+    ClusterSearchWorkerPool(int top_k,
+                            std::unordered_map<int, std::shared_ptr<GroupedEmbeddingsForSearch>>& index,
+                            std::shared_mutex& mutex,
+                            int max_batch_size,
+                            int64_t max_batch_wait_us,
+                            ClusterSchedulingPolicy scheduling_policy,
+                            std::function<void(const ObjectWithStringKey&)> put_result)
+        : top_k(top_k),
+          cluster_search_index(index),
+          cluster_search_index_map_mutex(mutex),
+          max_batch_size(max_batch_size),
+          max_batch_wait_us(max_batch_wait_us),
+          scheduling_policy(scheduling_policy),
+          put_result(std::move(put_result)) {}
+
+    void start(int num_workers) {
+        num_workers = std::max(1, num_workers);
+        for (int i = 0; i < num_workers; ++i) {
+            ready_queues.push_back(std::make_unique<ReadyClusterQueue>());
+        }
+        for (int i = 0; i < num_workers; ++i) {
+            worker_threads.emplace_back([this, i]() {
+                worker_loop(static_cast<size_t>(i));
             });
+        }
+    }
 
-            if (!execution_thread_running) break;
-
-            int clusters_size = cluster_search_index.size();
-            if (clusters_size == 0) continue;
-
-            auto it = cluster_search_index.begin();
-            std::advance(it, last_processed_cluster_index % clusters_size);
-
-            for (int j = 0; j < clusters_size; ++j) {
-                if (it == cluster_search_index.end()) it = cluster_search_index.begin();
-                auto& [cluster_id, cluster_index] = *it;
-
-                if (cluster_index->has_pending_queries()) {
-                    long* I = nullptr; // searched result index, which should be allocated by the batched Search function
-                    float* D = nullptr; // searched result distance
-                    std::vector<std::string> query_list;
-                    std::vector<std::string> query_keys;
-                    bool search_success = cluster_index->batchedSearch(top_k, &D, &I, query_list, query_keys);
-                    if (!search_success || !I || !D) {
-                        dbg_default_error("Failed to batch search for cluster: {}", cluster_id);
-                        continue;
-                    }
-                    std::vector<std::string> new_keys;
-                    construct_new_keys(new_keys, query_keys, query_list);
-
-                    for (size_t k = 0; k < query_list.size(); ++k) {
-                        ObjectWithStringKey obj;
-                        obj.key = std::string(EMIT_AGGREGATE_PREFIX) + "/" + new_keys[k];
-                        std::string query_emit_content = serialize_cluster_search_result(top_k, I, D, k, query_list[k]);
-                        obj.blob = Blob(reinterpret_cast<const uint8_t*>(query_emit_content.c_str()), query_emit_content.size());
-                        typed_ctxt->get_service_client_ref().put_and_forget(obj);
-                    }
-
-                    delete[] I;
-                    delete[] D;
-
-                    last_processed_cluster_index = (std::distance(cluster_search_index.begin(), it) + 1) % clusters_size;
-                    ++it;
-                    break;
-                }
-                ++it;
+    /***
+     * Called after add_queries() on a cluster, to queue it to a worker if its batch is ready,
+     * or to start the max_batch_wait_us timer of its batch when the batch was just started.
+     * @param cluster_id the id of the cluster
+     * @param cluster_index the cluster the queries were added to
+     * @param started_batch true if add_queries() made the pending batch of the cluster non-empty
+     */
+    void notify_queries_added(int cluster_id, GroupedEmbeddingsForSearch* cluster_index, bool started_batch) {
+        if (cluster_index->is_batch_ready(max_batch_size, max_batch_wait_us, steady_clock_now_us())) {
+            schedule_cluster(cluster_id, cluster_index);
+            return;
+        }
+        if (!started_batch) {
+            // the timer of this batch has been started by the add_queries() call that started the batch
+            return;
+        }
+        int64_t arrival_us = cluster_index->get_oldest_pending_arrival_us();
+        {
+            std::lock_guard<std::mutex> lock(pool_mutex);
+            batch_timers.push(BatchTimer{arrival_us + max_batch_wait_us, arrival_us, cluster_id});
+            next_batch_deadline_us = batch_timers.top().deadline_us;
+        }
+        // a sleeping worker may need to wake up earlier for this deadline
+        pool_cv.notify_one();
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(pool_mutex);
+            running = false;
+        }
+        pool_cv.notify_all();
+        for (auto& thread : worker_threads) {
+            if (thread.joinable()) {
+                thread.join();
             }
         }
+        worker_threads.clear();
+    }
+
+    ~ClusterSearchWorkerPool() {
+        stop();
     }
 };
 
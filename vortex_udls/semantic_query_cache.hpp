@@ -0,0 +1,133 @@
+#pragma once
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "simd_flat_search.hpp"
+
+#define SEMANTIC_CACHE_MAX_CAPACITY 4096 // maximum number of cached queries, since every lookup scans all of them
+
+/***
+* Cache of the final results of recently answered queries, looked up by query embedding: a query whose embedding is
+* within a squared L2 distance threshold of a cached one is answered with the cached result.
+* The cached embeddings are kept in a ring buffer of capacity embeddings, searched by brute force with simd_flat_l2_search(),
+* not with an ANN index: the lookup cost grows linearly with the capacity, which the UDL bounds by SEMANTIC_CACHE_MAX_CAPACITY,
+* i.e. a few thousands of the most recent queries.
+* The search is given no norms, so that it computes sum((x-q)^2) query by query: an exact duplicate is then at distance 0,
+* and a hit with the default threshold 0 does not depend on the number of queries looked up together.
+* The final results are computed by the aggregate UDL, which does not get the query embeddings: the embeddings of the queries
+* sent down the pipeline are kept as pending until fill() is called with the result of their query id.
+* Thread-safe: lookups share cache_mutex and only wait for fill(); the pending embeddings have their own mutex.
+***/
+class SemanticQueryCache {
+     int emb_dim;
+     size_t capacity;
+     float threshold; // maximum squared L2 distance to a cached embedding for a hit
+
+     std::vector<float> embs; // capacity x emb_dim ring buffer
+     std::vector<std::string> results;
+     std::vector<std::string> slot_query_texts;
+     std::unordered_map<std::string, size_t> query_text_slots; // query text -> slot of its cached result
+     size_t num_cached = 0;
+     size_t next_slot = 0;
+
+     std::unordered_map<uint64_t, std::vector<float>> pending_embs; // query id -> embedding, waiting for fill()
+     std::deque<uint64_t> pending_order; // oldest pending query first, bounds pending_embs to capacity
+
+     mutable std::shared_mutex cache_mutex; // protects the ring buffer
+     std::mutex pending_mutex; // protects pending_embs and pending_order
+
+public:
+     SemanticQueryCache(int emb_dim, size_t capacity, float threshold)
+          : emb_dim(emb_dim), capacity(capacity), threshold(threshold),
+            embs(capacity * emb_dim), results(capacity), slot_query_texts(capacity) {}
+
+     /***
+     * Look up the queries in the cache
+     * @param nq, xq: the query embeddings
+     * @param hit_results: for each query, the cached result if the query is a hit, an empty string otherwise;
+     *                    resized to nq, reusing the capacity of its strings across calls
+     * @return the number of hits
+     ***/
+     int lookup(int nq, const float* xq, std::vector<std::string>& hit_results) const {
+          hit_results.resize(nq);
+          for (auto& hit_result : hit_results) {
+               hit_result.clear();
+          }
+          std::shared_lock<std::shared_mutex> lock(cache_mutex);
+          if (num_cached == 0) {
+               return 0;
+          }
+          thread_local std::vector<float> D;
+          thread_local std::vector<long> I;
+          D.resize(nq);
+          I.resize(nq);
+          simd_flat_l2_search(embs.data(), nullptr, static_cast<int64_t>(num_cached), emb_dim, nq, xq, 1, D.data(), I.data());
+          int num_hits = 0;
+          for (int i = 0; i < nq; i++) {
+               if (I[i] >= 0 && D[i] <= threshold) {
+                    hit_results[i] = results[I[i]];
+                    num_hits++;
+               }
+          }
+          return num_hits;
+     }
+
+     /***
+     * Keep the embedding of a query sent down the pipeline, until its result is filled
+     ***/
+     void add_pending(uint64_t query_id, const float* emb) {
+          std::lock_guard<std::mutex> lock(pending_mutex);
+          auto inserted = pending_embs.emplace(query_id, std::vector<float>(emb, emb + emb_dim));
+          if (!inserted.second) {
+               return;
+          }
+          pending_order.push_back(query_id);
+          while (pending_order.size() > capacity) {
+               pending_embs.erase(pending_order.front());
+               pending_order.pop_front();
+          }
+     }
+
+     /***
+     * Cache the result of a pending query, replacing the oldest cached result if the cache is full
+     * @return false if the query is not pending on this node
+     ***/
+     bool fill(uint64_t query_id, const std::string& query_text, const std::string& result) {
+          std::vector<float> emb;
+          {
+               std::lock_guard<std::mutex> pending_lock(pending_mutex);
+               auto pending = pending_embs.find(query_id);
+               if (pending == pending_embs.end() || capacity == 0) {
+                    return false;
+               }
+               emb = std::move(pending->second);
+               pending_embs.erase(pending);
+               // the query stays in pending_order until it is the oldest, erasing a missing key is a no-op
+          }
+          std::unique_lock<std::shared_mutex> lock(cache_mutex);
+          size_t slot;
+          auto cached = query_text_slots.find(query_text);
+          if (cached != query_text_slots.end()) {
+               slot = cached->second;
+          } else {
+               slot = next_slot;
+               next_slot = (next_slot + 1) % capacity;
+               if (num_cached < capacity) {
+                    num_cached++;
+               } else {
+                    query_text_slots.erase(slot_query_texts[slot]);
+               }
+               query_text_slots[query_text] = slot;
+               slot_query_texts[slot] = query_text;
+          }
+          std::copy(emb.begin(), emb.end(), embs.begin() + slot * emb_dim);
+          results[slot] = result;
+          return true;
+     }
+};
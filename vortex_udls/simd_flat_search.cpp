@@ -0,0 +1,525 @@
+#include <algorithm>
+#include <limits>
+#include <vector>
+#include "simd_flat_search.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VORTEX_SIMD_X86 1
+#endif
+
+namespace {
+
+/***
+* Top_k results of one query, kept sorted by increasing distance directly in its rows of D and I.
+* The scan loops keep the current k-th distance in a register and only call push() for the candidates below it.
+***/
+class TopKBuffer {
+     float* D;
+     long* I;
+     int k;
+     int size;
+public:
+     TopKBuffer(int k, float* D, long* I): D(D), I(I), k(k), size(0) {}
+
+     inline float threshold() const {
+          return size < k ? std::numeric_limits<float>::max() : D[k - 1];
+     }
+
+     inline void push(float distance, long id) {
+          int pos = size < k ? size++ : k - 1;
+          while (pos > 0 && D[pos - 1] > distance) {
+               D[pos] = D[pos - 1];
+               I[pos] = I[pos - 1];
+               pos--;
+          }
+          D[pos] = distance;
+          I[pos] = id;
+     }
+
+     /*** pad the results if there are fewer than k embeddings, the same way as FAISS ***/
+     inline void finish() {
+          for (int j = size; j < k; j++) {
+               D[j] = std::numeric_limits<float>::max();
+               I[j] = -1;
+          }
+     }
+};
+
+/***
+* Top_k results of a batch of queries, fed with inner products: ||x-q||^2 = ||x||^2 + ||q||^2 - 2x.q
+***/
+class BatchTopK {
+     std::vector<TopKBuffer> tops;
+     std::vector<float> thresholds;
+public:
+     BatchTopK(int nq, int top_k, float* D, long* I) {
+          tops.reserve(nq);
+          for (int i = 0; i < nq; i++) {
+               tops.emplace_back(top_k, D + static_cast<int64_t>(i) * top_k, I + static_cast<int64_t>(i) * top_k);
+               thresholds.push_back(tops.back().threshold());
+          }
+     }
+
+     inline void push(int query_id, int64_t id, float dot, float emb_norm, float query_norm) {
+          // the expansion can go slightly negative by rounding for (near) duplicates
+          float distance = std::max(0.0f, emb_norm + query_norm - 2.0f * dot);
+          if (distance < thresholds[query_id]) {
+               tops[query_id].push(distance, id);
+               thresholds[query_id] = tops[query_id].threshold();
+          }
+     }
+
+     inline void finish() {
+          for (auto& top : tops) {
+               top.finish();
+          }
+     }
+};
+
+/*** scan of the embeddings for one query, the signature of all the kernels below ***/
+using QueryScanFn = void (*)(const float* embeddings, int64_t num_embs, int emb_dim,
+                             const float* query, int top_k, float* D, long* I);
+
+/*** 
+* scan of the embeddings for a batch of queries, tile by tile: each tile of embeddings is loaded from memory once,
+* and stays in cache while it is compared against all the queries of the batch
+***/
+using TiledScanFn = void (*)(const float* embeddings, const float* emb_norms, int64_t num_embs, int emb_dim,
+                             int nq, const float* xq, const float* query_norms, int top_k, float* D, long* I);
+
+/*** number of embeddings per tile, a multiple of 4 with the tile about half of a typical L2 cache ***/
+constexpr int64_t TILE_BYTES = 256 * 1024;
+inline int64_t tile_rows_for(int dim) {
+     return std::max<int64_t>(4, TILE_BYTES / (static_cast<int64_t>(dim) * sizeof(float)) / 4 * 4);
+}
+
+/***
+* Scalar kernels. DIM > 0 fixes the dimension at compile time, DIM == 0 uses emb_dim.
+***/
+inline float l2_scalar(const float* x, const float* y, int dim) {
+     float acc0 = 0, acc1 = 0, acc2 = 0, acc3 = 0;
+     int j = 0;
+     for (; j + 4 <= dim; j += 4) {
+          float d0 = x[j] - y[j];
+          float d1 = x[j + 1] - y[j + 1];
+          float d2 = x[j + 2] - y[j + 2];
+          float d3 = x[j + 3] - y[j + 3];
+          acc0 += d0 * d0;
+          acc1 += d1 * d1;
+          acc2 += d2 * d2;
+          acc3 += d3 * d3;
+     }
+     for (; j < dim; j++) {
+          float d = x[j] - y[j];
+          acc0 += d * d;
+     }
+     return (acc0 + acc1) + (acc2 + acc3);
+}
+
+template <int DIM>
+void scalar_scan(const float* embeddings, int64_t num_embs, int emb_dim,
+                 const float* query, int top_k, float* D, long* I) {
+     const int dim = DIM > 0 ? DIM : emb_dim;
+     TopKBuffer top(top_k, D, I);
+     float threshold = top.threshold();
+     for (int64_t i = 0; i < num_embs; i++) {
+          float distance = l2_scalar(query, embeddings + i * dim, dim);
+          if (distance < threshold) {
+               top.push(distance, i);
+               threshold = top.threshold();
+          }
+     }
+     top.finish();
+}
+
+inline float dot_scalar(const float* x, const float* y, int dim) {
+     float acc0 = 0, acc1 = 0, acc2 = 0, acc3 = 0;
+     int j = 0;
+     for (; j + 4 <= dim; j += 4) {
+          acc0 += x[j] * y[j];
+          acc1 += x[j + 1] * y[j + 1];
+          acc2 += x[j + 2] * y[j + 2];
+          acc3 += x[j + 3] * y[j + 3];
+     }
+     for (; j < dim; j++) {
+          acc0 += x[j] * y[j];
+     }
+     return (acc0 + acc1) + (acc2 + acc3);
+}
+
+/*** inner products of the query with the 4 consecutive embeddings at x, reusing each load of the query ***/
+inline void dot4_scalar(const float* q, const float* x, int dim, float* dots) {
+     const float* x0 = x;
+     const float* x1 = x + dim;
+     const float* x2 = x + 2 * dim;
+     const float* x3 = x + 3 * dim;
+     float acc0 = 0, acc1 = 0, acc2 = 0, acc3 = 0;
+     for (int j = 0; j < dim; j++) {
+          acc0 += q[j] * x0[j];
+          acc1 += q[j] * x1[j];
+          acc2 += q[j] * x2[j];
+          acc3 += q[j] * x3[j];
+     }
+     dots[0] = acc0;
+     dots[1] = acc1;
+     dots[2] = acc2;
+     dots[3] = acc3;
+}
+
+template <int DIM>
+void scalar_tiled_scan(const float* embeddings, const float* emb_norms, int64_t num_embs, int emb_dim,
+                       int nq, const float* xq, const float* query_norms, int top_k, float* D, long* I) {
+     const int dim = DIM > 0 ? DIM : emb_dim;
+     const int64_t tile_rows = tile_rows_for(dim);
+     BatchTopK results(nq, top_k, D, I);
+     for (int64_t tile_begin = 0; tile_begin < num_embs; tile_begin += tile_rows) {
+          const int64_t tile_end = std::min(num_embs, tile_begin + tile_rows);
+          for (int qi = 0; qi < nq; qi++) {
+               const float* query = xq + static_cast<int64_t>(qi) * dim;
+               float dots[4];
+               int64_t r = tile_begin;
+               for (; r + 4 <= tile_end; r += 4) {
+                    dot4_scalar(query, embeddings + r * dim, dim, dots);
+                    for (int t = 0; t < 4; t++) {
+                         results.push(qi, r + t, dots[t], emb_norms[r + t], query_norms[qi]);
+                    }
+               }
+               for (; r < tile_end; r++) {
+                    results.push(qi, r, dot_scalar(query, embeddings + r * dim, dim), emb_norms[r], query_norms[qi]);
+               }
+          }
+     }
+     results.finish();
+}
+
+#ifdef VORTEX_SIMD_X86
+
+/***
+* AVX2 kernels: 4 independent accumulators of 8 floats, i.e. 32 dimensions per iteration.
+***/
+__attribute__((target("avx2,fma")))
+inline float l2_avx2(const float* x, const float* y, int dim) {
+     __m256 acc0 = _mm256_setzero_ps();
+     __m256 acc1 = _mm256_setzero_ps();
+     __m256 acc2 = _mm256_setzero_ps();
+     __m256 acc3 = _mm256_setzero_ps();
+     int j = 0;
+     for (; j + 32 <= dim; j += 32) {
+          __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(x + j), _mm256_loadu_ps(y + j));
+          __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(x + j + 8), _mm256_loadu_ps(y + j + 8));
+          __m256 d2 = _mm256_sub_ps(_mm256_loadu_ps(x + j + 16), _mm256_loadu_ps(y + j + 16));
+          __m256 d3 = _mm256_sub_ps(_mm256_loadu_ps(x + j + 24), _mm256_loadu_ps(y + j + 24));
+          acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+          acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+          acc2 = _mm256_fmadd_ps(d2, d2, acc2);
+          acc3 = _mm256_fmadd_ps(d3, d3, acc3);
+     }
+     for (; j + 8 <= dim; j += 8) {
+          __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(x + j), _mm256_loadu_ps(y + j));
+          acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+     }
+     __m256 acc = _mm256_add_ps(_mm256_add_ps(acc0, acc1), _mm256_add_ps(acc2, acc3));
+     __m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+     sum = _mm_hadd_ps(sum, sum);
+     sum = _mm_hadd_ps(sum, sum);
+     float result = _mm_cvtss_f32(sum);
+     for (; j < dim; j++) {
+          float d = x[j] - y[j];
+          result += d * d;
+     }
+     return result;
+}
+
+template <int DIM>
+__attribute__((target("avx2,fma")))
+void avx2_scan(const float* embeddings, int64_t num_embs, int emb_dim,
+               const float* query, int top_k, float* D, long* I) {
+     const int dim = DIM > 0 ? DIM : emb_dim;
+     TopKBuffer top(top_k, D, I);
+     float threshold = top.threshold();
+     for (int64_t i = 0; i < num_embs; i++) {
+          float distance = l2_avx2(query, embeddings + i * dim, dim);
+          if (distance < threshold) {
+               top.push(distance, i);
+               threshold = top.threshold();
+          }
+     }
+     top.finish();
+}
+
+__attribute__((target("avx2,fma")))
+inline void dot4_avx2(const float* q, const float* x, int dim, float* dots) {
+     const float* x0 = x;
+     const float* x1 = x + dim;
+     const float* x2 = x + 2 * dim;
+     const float* x3 = x + 3 * dim;
+     __m256 acc0 = _mm256_setzero_ps();
+     __m256 acc1 = _mm256_setzero_ps();
+     __m256 acc2 = _mm256_setzero_ps();
+     __m256 acc3 = _mm256_setzero_ps();
+     int j = 0;
+     for (; j + 8 <= dim; j += 8) {
+          __m256 qv = _mm256_loadu_ps(q + j);
+          acc0 = _mm256_fmadd_ps(qv, _mm256_loadu_ps(x0 + j), acc0);
+          acc1 = _mm256_fmadd_ps(qv, _mm256_loadu_ps(x1 + j), acc1);
+          acc2 = _mm256_fmadd_ps(qv, _mm256_loadu_ps(x2 + j), acc2);
+          acc3 = _mm256_fmadd_ps(qv, _mm256_loadu_ps(x3 + j), acc3);
+     }
+     // transpose-and-add the 4 accumulators into [dot0, dot1, dot2, dot3]
+     __m256 sum = _mm256_hadd_ps(_mm256_hadd_ps(acc0, acc1), _mm256_hadd_ps(acc2, acc3));
+     _mm_storeu_ps(dots, _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1)));
+     for (; j < dim; j++) {
+          dots[0] += q[j] * x0[j];
+          dots[1] += q[j] * x1[j];
+          dots[2] += q[j] * x2[j];
+          dots[3] += q[j] * x3[j];
+     }
+}
+
+template <int DIM>
+__attribute__((target("avx2,fma")))
+void avx2_tiled_scan(const float* embeddings, const float* emb_norms, int64_t num_embs, int emb_dim,
+                     int nq, const float* xq, const float* query_norms, int top_k, float* D, long* I) {
+     const int dim = DIM > 0 ? DIM : emb_dim;
+     const int64_t tile_rows = tile_rows_for(dim);
+     BatchTopK results(nq, top_k, D, I);
+     for (int64_t tile_begin = 0; tile_begin < num_embs; tile_begin += tile_rows) {
+          const int64_t tile_end = std::min(num_embs, tile_begin + tile_rows);
+          for (int qi = 0; qi < nq; qi++) {
+               const float* query = xq + static_cast<int64_t>(qi) * dim;
+               float dots[4];
+               int64_t r = tile_begin;
+               for (; r + 4 <= tile_end; r += 4) {
+                    dot4_avx2(query, embeddings + r * dim, dim, dots);
+                    for (int t = 0; t < 4; t++) {
+                         results.push(qi, r + t, dots[t], emb_norms[r + t], query_norms[qi]);
+                    }
+               }
+               for (; r < tile_end; r++) {
+                    results.push(qi, r, dot_scalar(query, embeddings + r * dim, dim), emb_norms[r], query_norms[qi]);
+               }
+          }
+     }
+     results.finish();
+}
+
+/***
+* AVX-512 kernels: 4 independent accumulators of 16 floats, i.e. 64 dimensions per iteration, masked tail.
+***/
+
+/***
+* Add the two 256-bit halves of an accumulator, to finish the sum as in the AVX2 kernels.
+* Replaces _mm512_reduce_add_ps, which g++-12 reports as -Wmaybe-uninitialized: like the plain extracts and casts,
+* it merges into an undefined register, while the zero-masked extract with all lanes set does not.
+* The halves go through the pd extract, as _mm512_extractf32x8_ps needs AVX512DQ.
+***/
+__attribute__((target("avx512f")))
+inline __m256 fold_avx512(__m512 acc) {
+     __m512d v = _mm512_castps_pd(acc);
+     return _mm256_add_ps(_mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xF, v, 0)),
+                          _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xF, v, 1)));
+}
+
+__attribute__((target("avx512f")))
+inline float l2_avx512(const float* x, const float* y, int dim) {
+     __m512 acc0 = _mm512_setzero_ps();
+     __m512 acc1 = _mm512_setzero_ps();
+     __m512 acc2 = _mm512_setzero_ps();
+     __m512 acc3 = _mm512_setzero_ps();
+     int j = 0;
+     for (; j + 64 <= dim; j += 64) {
+          __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(x + j), _mm512_loadu_ps(y + j));
+          __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(x + j + 16), _mm512_loadu_ps(y + j + 16));
+          __m512 d2 = _mm512_sub_ps(_mm512_loadu_ps(x + j + 32), _mm512_loadu_ps(y + j + 32));
+          __m512 d3 = _mm512_sub_ps(_mm512_loadu_ps(x + j + 48), _mm512_loadu_ps(y + j + 48));
+          acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+          acc1 = _mm512_fmadd_ps(d1, d1, acc1);
+          acc2 = _mm512_fmadd_ps(d2, d2, acc2);
+          acc3 = _mm512_fmadd_ps(d3, d3, acc3);
+     }
+     for (; j + 16 <= dim; j += 16) {
+          __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(x + j), _mm512_loadu_ps(y + j));
+          acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+     }
+     if (j < dim) {
+          __mmask16 mask = static_cast<__mmask16>((1u << (dim - j)) - 1);
+          __m512 d0 = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, x + j), _mm512_maskz_loadu_ps(mask, y + j));
+          acc1 = _mm512_fmadd_ps(d0, d0, acc1);
+     }
+     __m256 acc = fold_avx512(_mm512_add_ps(_mm512_add_ps(acc0, acc1), _mm512_add_ps(acc2, acc3)));
+     __m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+     sum = _mm_hadd_ps(sum, sum);
+     sum = _mm_hadd_ps(sum, sum);
+     return _mm_cvtss_f32(sum);
+}
+
+template <int DIM>
+__attribute__((target("avx512f")))
+void avx512_scan(const float* embeddings, int64_t num_embs, int emb_dim,
+                 const float* query, int top_k, float* D, long* I) {
+     const int dim = DIM > 0 ? DIM : emb_dim;
+     TopKBuffer top(top_k, D, I);
+     float threshold = top.threshold();
+     for (int64_t i = 0; i < num_embs; i++) {
+          float distance = l2_avx512(query, embeddings + i * dim, dim);
+          if (distance < threshold) {
+               top.push(distance, i);
+               threshold = top.threshold();
+          }
+     }
+     top.finish();
+}
+
+__attribute__((target("avx512f")))
+inline void dot4_avx512(const float* q, const float* x, int dim, float* dots) {
+     const float* x0 = x;
+     const float* x1 = x + dim;
+     const float* x2 = x + 2 * dim;
+     const float* x3 = x + 3 * dim;
+     __m512 acc0 = _mm512_setzero_ps();
+     __m512 acc1 = _mm512_setzero_ps();
+     __m512 acc2 = _mm512_setzero_ps();
+     __m512 acc3 = _mm512_setzero_ps();
+     int j = 0;
+     for (; j + 16 <= dim; j += 16) {
+          __m512 qv = _mm512_loadu_ps(q + j);
+          acc0 = _mm512_fmadd_ps(qv, _mm512_loadu_ps(x0 + j), acc0);
+          acc1 = _mm512_fmadd_ps(qv, _mm512_loadu_ps(x1 + j), acc1);
+          acc2 = _mm512_fmadd_ps(qv, _mm512_loadu_ps(x2 + j), acc2);
+          acc3 = _mm512_fmadd_ps(qv, _mm512_loadu_ps(x3 + j), acc3);
+     }
+     if (j < dim) {
+          __mmask16 mask = static_cast<__mmask16>((1u << (dim - j)) - 1);
+          __m512 qv = _mm512_maskz_loadu_ps(mask, q + j);
+          acc0 = _mm512_fmadd_ps(qv, _mm512_maskz_loadu_ps(mask, x0 + j), acc0);
+          acc1 = _mm512_fmadd_ps(qv, _mm512_maskz_loadu_ps(mask, x1 + j), acc1);
+          acc2 = _mm512_fmadd_ps(qv, _mm512_maskz_loadu_ps(mask, x2 + j), acc2);
+          acc3 = _mm512_fmadd_ps(qv, _mm512_maskz_loadu_ps(mask, x3 + j), acc3);
+     }
+     // transpose-and-add the 4 accumulators into [dot0, dot1, dot2, dot3]
+     __m256 sum = _mm256_hadd_ps(_mm256_hadd_ps(fold_avx512(acc0), fold_avx512(acc1)),
+                                 _mm256_hadd_ps(fold_avx512(acc2), fold_avx512(acc3)));
+     _mm_storeu_ps(dots, _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1)));
+}
+
+template <int DIM>
+__attribute__((target("avx512f")))
+void avx512_tiled_scan(const float* embeddings, const float* emb_norms, int64_t num_embs, int emb_dim,
+                       int nq, const float* xq, const float* query_norms, int top_k, float* D, long* I) {
+     const int dim = DIM > 0 ? DIM : emb_dim;
+     const int64_t tile_rows = tile_rows_for(dim);
+     BatchTopK results(nq, top_k, D, I);
+     for (int64_t tile_begin = 0; tile_begin < num_embs; tile_begin += tile_rows) {
+          const int64_t tile_end = std::min(num_embs, tile_begin + tile_rows);
+          for (int qi = 0; qi < nq; qi++) {
+               const float* query = xq + static_cast<int64_t>(qi) * dim;
+               float dots[4];
+               int64_t r = tile_begin;
+               for (; r + 4 <= tile_end; r += 4) {
+                    dot4_avx512(query, embeddings + r * dim, dim, dots);
+                    for (int t = 0; t < 4; t++) {
+                         results.push(qi, r + t, dots[t], emb_norms[r + t], query_norms[qi]);
+                    }
+               }
+               for (; r < tile_end; r++) {
+                    results.push(qi, r, dot_scalar(query, embeddings + r * dim, dim), emb_norms[r], query_norms[qi]);
+               }
+          }
+     }
+     results.finish();
+}
+
+#endif // VORTEX_SIMD_X86
+
+enum class KernelFamily { SCALAR, AVX2, AVX512 };
+
+/*** checked once per process ***/
+KernelFamily detect_kernel_family() {
+#ifdef VORTEX_SIMD_X86
+     static const KernelFamily family = []() {
+          __builtin_cpu_init();
+          if (__builtin_cpu_supports("avx512f")) {
+               return KernelFamily::AVX512;
+          }
+          if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+               return KernelFamily::AVX2;
+          }
+          return KernelFamily::SCALAR;
+     }();
+     return family;
+#else
+     return KernelFamily::SCALAR;
+#endif
+}
+
+struct FlatKernels {
+     QueryScanFn scan;
+     TiledScanFn tiled_scan;
+};
+
+template <int DIM>
+FlatKernels kernel_for(KernelFamily family) {
+#ifdef VORTEX_SIMD_X86
+     if (family == KernelFamily::AVX512) {
+          return {&avx512_scan<DIM>, &avx512_tiled_scan<DIM>};
+     }
+     if (family == KernelFamily::AVX2) {
+          return {&avx2_scan<DIM>, &avx2_tiled_scan<DIM>};
+     }
+#endif
+     return {&scalar_scan<DIM>, &scalar_tiled_scan<DIM>};
+}
+
+FlatKernels select_kernel(int emb_dim) {
+     KernelFamily family = detect_kernel_family();
+     switch (emb_dim) {
+          case 128:
+               return kernel_for<128>(family);
+          case 384:
+               return kernel_for<384>(family);
+          case 768:
+               return kernel_for<768>(family);
+          case 1024:
+               return kernel_for<1024>(family);
+          default:
+               return kernel_for<0>(family);
+     }
+}
+
+} // namespace
+
+void simd_l2_norms(const float* x, int64_t n, int dim, float* norms) {
+     for (int64_t i = 0; i < n; i++) {
+          norms[i] = dot_scalar(x + i * dim, x + i * dim, dim);
+     }
+}
+
+void simd_flat_l2_search(const float* embeddings, const float* emb_norms, int64_t num_embs, int emb_dim,
+                         int nq, const float* xq, int top_k, float* D, long* I) {
+     if (top_k <= 0) {
+          return;
+     }
+     FlatKernels kernels = select_kernel(emb_dim);
+     if (emb_norms != nullptr && nq >= SIMD_FLAT_TILED_MIN_QUERIES) {
+          std::vector<float> query_norms(nq);
+          simd_l2_norms(xq, nq, emb_dim, query_norms.data());
+          kernels.tiled_scan(embeddings, emb_norms, num_embs, emb_dim, nq, xq, query_norms.data(), top_k, D, I);
+          return;
+     }
+     for (int i = 0; i < nq; i++) {
+          kernels.scan(embeddings, num_embs, emb_dim, xq + static_cast<int64_t>(i) * emb_dim, top_k,
+                       D + static_cast<int64_t>(i) * top_k, I + static_cast<int64_t>(i) * top_k);
+     }
+}
+
+const char* simd_flat_l2_kernel_name() {
+     switch (detect_kernel_family()) {
+          case KernelFamily::AVX512:
+               return "avx512";
+          case KernelFamily::AVX2:
+               return "avx2";
+          default:
+               return "scalar";
+     }
+}
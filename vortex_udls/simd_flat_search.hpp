@@ -0,0 +1,32 @@
+#pragma once
+#include <cstdint>
+
+#define SIMD_FLAT_TILED_MIN_QUERIES 2 // batches with at least this many queries are searched tile by tile
+
+/***
+* Built-in brute-force L2 search over row-major embeddings, without going through a FAISS index.
+* The distance kernels are specialized at compile time for the common embedding dimensions (128, 384, 768, 1024),
+* with a generic kernel for other dimensions, and the top_k selection is fused into the scan of the embeddings.
+* The AVX-512 or AVX2 kernels are selected at runtime from the CPU features, with a scalar fallback.
+* With emb_norms, a batch of queries is searched tile by tile (||x||^2 + ||q||^2 - 2x.q), so that the embeddings
+* are streamed from memory once per batch instead of once per query.
+* @param embeddings: num_embs x emb_dim flaten embeddings to search
+* @param emb_norms: squared L2 norms of the embeddings (see simd_l2_norms), or nullptr to search query by query
+* @param nq: number of queries
+* @param xq: flaten queries to search
+* @param top_k: number of top embeddings to return, results are sorted by increasing distance
+* @param D: distance array to store the squared L2 distance of the top_k embeddings
+* @param I: index array to store the index of the top_k embeddings, -1 if there are fewer than top_k embeddings
+***/
+void simd_flat_l2_search(const float* embeddings, const float* emb_norms, int64_t num_embs, int emb_dim,
+                         int nq, const float* xq, int top_k, float* D, long* I);
+
+/***
+* Squared L2 norms of the n x dim flaten vectors x, written to norms[0..n)
+***/
+void simd_l2_norms(const float* x, int64_t n, int dim, float* norms);
+
+/***
+* Name of the kernel family simd_flat_l2_search() uses on this CPU ("avx512", "avx2" or "scalar"), for logging.
+***/
+const char* simd_flat_l2_kernel_name();
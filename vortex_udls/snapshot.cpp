@@ -0,0 +1,231 @@
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cascade/utils.hpp>
+#include "snapshot.hpp"
+
+namespace {
+
+struct SnapshotHeader {
+     char magic[8];
+     uint32_t format_version;
+     uint32_t num_sources;
+     uint32_t num_sections;
+     uint32_t reserved;
+};
+
+uint64_t align_up(uint64_t offset) {
+     return (offset + SNAPSHOT_SECTION_ALIGNMENT - 1) / SNAPSHOT_SECTION_ALIGNMENT * SNAPSHOT_SECTION_ALIGNMENT;
+}
+
+template <typename T>
+void append_value(std::string& buffer, const T& value) {
+     buffer.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+void append_string(std::string& buffer, const std::string& str) {
+     append_value(buffer, static_cast<uint32_t>(str.size()));
+     buffer.append(str);
+}
+
+/*** Bounds-checked reader over the mapped metadata ***/
+class MetadataReader {
+     const uint8_t* pos;
+     const uint8_t* end;
+public:
+     MetadataReader(const uint8_t* begin, const uint8_t* end): pos(begin), end(end) {}
+
+     template <typename T>
+     bool read_value(T& value) {
+          if (static_cast<size_t>(end - pos) < sizeof(T)) {
+               return false;
+          }
+          std::memcpy(&value, pos, sizeof(T));
+          pos += sizeof(T);
+          return true;
+     }
+
+     bool read_string(std::string& str) {
+          uint32_t len = 0;
+          if (!read_value(len) || static_cast<size_t>(end - pos) < len) {
+               return false;
+          }
+          str.assign(reinterpret_cast<const char*>(pos), len);
+          pos += len;
+          return true;
+     }
+};
+
+} // namespace
+
+bool write_snapshot(const std::string& path, const std::vector<SnapshotSource>& sources, const std::vector<SnapshotSection>& sections) {
+     // 1. metadata: header, sources and section table, with the section offsets computed up front
+     std::string metadata;
+     SnapshotHeader header = {};
+     std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+     header.format_version = SNAPSHOT_FORMAT_VERSION;
+     header.num_sources = static_cast<uint32_t>(sources.size());
+     header.num_sections = static_cast<uint32_t>(sections.size());
+     append_value(metadata, header);
+     for (const auto& source : sources) {
+          append_string(metadata, source.key);
+          append_value(metadata, source.version);
+          append_value(metadata, source.size);
+     }
+     uint64_t table_size = 0;
+     for (const auto& section : sections) {
+          table_size += sizeof(uint32_t) + section.name.size() + 2 * sizeof(uint64_t);
+     }
+     uint64_t offset = align_up(metadata.size() + table_size);
+     std::vector<uint64_t> section_offsets;
+     for (const auto& section : sections) {
+          uint64_t section_size = 0;
+          for (const auto& piece : section.pieces) {
+               section_size += piece.second;
+          }
+          append_string(metadata, section.name);
+          append_value(metadata, offset);
+          append_value(metadata, section_size);
+          section_offsets.push_back(offset);
+          offset = align_up(offset + section_size);
+     }
+
+     // 2. write to a temporary file, and rename it over the previous snapshot once complete
+     std::error_code ec;
+     std::filesystem::path file_path(path);
+     if (file_path.has_parent_path()) {
+          std::filesystem::create_directories(file_path.parent_path(), ec);
+     }
+     std::string tmp_path = path + ".tmp";
+     {
+          std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+          if (!out) {
+               dbg_default_error("{}, failed to open snapshot file {}.", __func__, tmp_path);
+               return false;
+          }
+          out.write(metadata.data(), metadata.size());
+          uint64_t written = metadata.size();
+          static const char padding[SNAPSHOT_SECTION_ALIGNMENT] = {};
+          for (size_t i = 0; i < sections.size(); i++) {
+               out.write(padding, section_offsets[i] - written);
+               written = section_offsets[i];
+               for (const auto& piece : sections[i].pieces) {
+                    out.write(reinterpret_cast<const char*>(piece.first), piece.second);
+                    written += piece.second;
+               }
+          }
+          if (!out) {
+               dbg_default_error("{}, failed to write snapshot file {}.", __func__, tmp_path);
+               std::remove(tmp_path.c_str());
+               return false;
+          }
+     }
+     if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+          dbg_default_error("{}, failed to rename snapshot file {} to {}.", __func__, tmp_path, path);
+          std::remove(tmp_path.c_str());
+          return false;
+     }
+     return true;
+}
+
+MappedSnapshot::~MappedSnapshot() {
+     if (base != nullptr) {
+          munmap(base, length);
+     }
+}
+
+std::unique_ptr<MappedSnapshot> MappedSnapshot::open(const std::string& path) {
+     int fd = ::open(path.c_str(), O_RDONLY);
+     if (fd < 0) {
+          return nullptr;
+     }
+     struct stat st;
+     if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(SnapshotHeader)) {
+          ::close(fd);
+          return nullptr;
+     }
+     size_t length = static_cast<size_t>(st.st_size);
+     void* base = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+     ::close(fd); // the mapping keeps the file referenced
+     if (base == MAP_FAILED) {
+          dbg_default_warn("{}, failed to mmap snapshot file {}.", __func__, path);
+          return nullptr;
+     }
+     std::unique_ptr<MappedSnapshot> snapshot(new MappedSnapshot(base, length));
+     if (!snapshot->parse()) {
+          dbg_default_warn("{}, ignoring invalid snapshot file {}.", __func__, path);
+          return nullptr;
+     }
+     return snapshot;
+}
+
+bool MappedSnapshot::parse() {
+     const uint8_t* begin = static_cast<const uint8_t*>(base);
+     MetadataReader reader(begin, begin + length);
+     SnapshotHeader header;
+     if (!reader.read_value(header) || std::memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+         header.format_version != SNAPSHOT_FORMAT_VERSION) {
+          return false;
+     }
+     for (uint32_t i = 0; i < header.num_sources; i++) {
+          SnapshotSource source;
+          if (!reader.read_string(source.key) || !reader.read_value(source.version) || !reader.read_value(source.size)) {
+               return false;
+          }
+          sources.push_back(std::move(source));
+     }
+     for (uint32_t i = 0; i < header.num_sections; i++) {
+          std::string name;
+          uint64_t offset = 0;
+          uint64_t size = 0;
+          if (!reader.read_string(name) || !reader.read_value(offset) || !reader.read_value(size) ||
+              offset > length || size > length - offset) {
+               return false;
+          }
+          sections[name] = {begin + offset, size};
+     }
+     return true;
+}
+
+bool MappedSnapshot::get_section(const std::string& name, const uint8_t*& data, uint64_t& size) const {
+     auto it = sections.find(name);
+     if (it == sections.end()) {
+          return false;
+     }
+     data = it->second.first;
+     size = it->second.second;
+     return true;
+}
+
+bool MappedSnapshot::matches_sources(const std::vector<std::string>& keys, const std::vector<uint64_t>& sizes) const {
+     if (keys.size() != sources.size() || sizes.size() != sources.size()) {
+          return false;
+     }
+     for (size_t i = 0; i < sources.size(); i++) {
+          if (sources[i].key != keys[i] || sources[i].size != sizes[i]) {
+               return false;
+          }
+     }
+     return true;
+}
+
+bool MappedSnapshot::matches_first_version(int64_t version) const {
+     return !sources.empty() && sources.front().version == version;
+}
+
+std::string snapshot_path(const std::string& snapshot_dir, const std::string& prefix) {
+     std::string name = prefix;
+     for (char& c : name) {
+          if (c == '/') {
+               c = '_';
+          }
+     }
+     size_t start = name.find_first_not_of('_');
+     name = (start == std::string::npos) ? "root" : name.substr(start);
+     return snapshot_dir + "/" + name + ".snapshot";
+}
@@ -0,0 +1,114 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#define SNAPSHOT_MAGIC "VTXSNAP"
+#define SNAPSHOT_FORMAT_VERSION 1
+#define SNAPSHOT_SECTION_ALIGNMENT 64 // sections start at multiples of it in the file, so that they can be used in place
+
+/***
+* Local on-disk snapshots of data loaded from Cascade (cluster embeddings and indices, doc tables),
+* so that a restarted node can map them instead of fetching and rebuilding everything from the KV store.
+* A snapshot file is:
+*    | header (magic, format version, number of sources and sections) |
+*    | sources: the Cascade objects the snapshot was built from (key, version, object size) |
+*    | section table: name, offset and size of each section |
+*    | sections, each aligned to SNAPSHOT_SECTION_ALIGNMENT |
+* Files are written to a temporary file and renamed, so that a reader never maps a partially written snapshot.
+***/
+
+struct SnapshotSource {
+     std::string key;
+     int64_t version;
+     uint64_t size; // object size reported by get_size(), used to detect stale snapshots
+};
+
+/*** A named section to write, possibly gathered from multiple buffers ***/
+struct SnapshotSection {
+     std::string name;
+     std::vector<std::pair<const void*, uint64_t>> pieces;
+};
+
+/***
+* Write a snapshot file
+* @param path the file to write, its directory is created if needed
+* @return true on success
+***/
+bool write_snapshot(const std::string& path, const std::vector<SnapshotSource>& sources, const std::vector<SnapshotSection>& sections);
+
+/***
+* A snapshot file mapped read-only in memory. The sections stay valid as long as the MappedSnapshot is alive.
+***/
+class MappedSnapshot {
+     void* base;
+     size_t length;
+     std::vector<SnapshotSource> sources;
+     std::unordered_map<std::string, std::pair<const uint8_t*, uint64_t>> sections;
+
+     MappedSnapshot(void* base, size_t length): base(base), length(length) {}
+     bool parse();
+public:
+     MappedSnapshot(const MappedSnapshot&) = delete;
+     MappedSnapshot& operator=(const MappedSnapshot&) = delete;
+     ~MappedSnapshot();
+
+     /*** @return nullptr if the file does not exist, is corrupted, or has another format version ***/
+     static std::unique_ptr<MappedSnapshot> open(const std::string& path);
+
+     const std::vector<SnapshotSource>& get_sources() const { return sources; }
+
+     /*** @return false if the snapshot has no section with this name ***/
+     bool get_section(const std::string& name, const uint8_t*& data, uint64_t& size) const;
+
+     /***
+     * Check that the snapshot was built from the given objects, i.e. the same keys in the same order, of the same sizes
+     * @param sizes the current size of each object, from get_object_sizes()
+     ***/
+     bool matches_sources(const std::vector<std::string>& keys, const std::vector<uint64_t>& sizes) const;
+
+     /***
+     * Check the version of the first object the snapshot was built from.
+     * Overwriting the objects with data of the same shape (e.g. re-embedding the corpus) keeps their sizes, not their versions.
+     * @param version the current version of the first object, from get_object_version()
+     ***/
+     bool matches_first_version(int64_t version) const;
+};
+
+/***
+* Snapshot file of the objects under a Cascade prefix, e.g. /rag/emb/cluster3 -> snapshot_dir/rag_emb_cluster3.snapshot
+***/
+std::string snapshot_path(const std::string& snapshot_dir, const std::string& prefix);
+
+/***
+* Get the current version of an object. Cascade only reports it with the object, which is transferred:
+* used on the first object of a snapshot only, see MappedSnapshot::matches_first_version()
+***/
+template <typename ServiceClientType, typename VersionType>
+int64_t get_object_version(ServiceClientType& service_client, const std::string& key, const VersionType& version, bool stable) {
+     auto result = service_client.get(key, version, stable);
+     return static_cast<int64_t>(result.get().begin()->second.get().version);
+}
+
+/***
+* Get the current sizes of the objects, without transferring them. All the requests are sent before waiting for the replies.
+***/
+template <typename ServiceClientType, typename VersionType>
+std::vector<uint64_t> get_object_sizes(ServiceClientType& service_client, const std::vector<std::string>& keys,
+                                       const VersionType& version, bool stable) {
+     using SizeResultsType = decltype(service_client.get_size(keys.front(), version, stable));
+     std::vector<SizeResultsType> size_results;
+     size_results.reserve(keys.size());
+     for (const auto& key : keys) {
+          size_results.push_back(service_client.get_size(key, version, stable));
+     }
+     std::vector<uint64_t> sizes;
+     sizes.reserve(keys.size());
+     for (auto& result : size_results) {
+          sizes.push_back(result.get().begin()->second.get());
+     }
+     return sizes;
+}
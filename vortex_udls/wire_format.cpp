@@ -0,0 +1,251 @@
+#include <algorithm>
+#include <cassert>
+#include "wire_format.hpp"
+
+size_t query_batch_size(uint32_t num_queries, uint32_t emb_dim, size_t total_text_size) {
+     return sizeof(QueryBatchHeader) +
+            static_cast<size_t>(num_queries) * (sizeof(uint64_t) + sizeof(uint32_t) + sizeof(float) * static_cast<size_t>(emb_dim) + sizeof(uint32_t)) +
+            total_text_size;
+}
+
+QueryBatchWriter::QueryBatchWriter(uint32_t num_queries, uint32_t emb_dim, size_t total_text_size, size_t prefix_size)
+     : buffer(prefix_size + query_batch_size(num_queries, emb_dim, total_text_size), '\0') {
+     init(buffer.data(), num_queries, emb_dim, total_text_size, prefix_size);
+}
+
+QueryBatchWriter::QueryBatchWriter(char* bytes, uint32_t num_queries, uint32_t emb_dim, size_t total_text_size, size_t prefix_size) {
+     init(bytes, num_queries, emb_dim, total_text_size, prefix_size);
+}
+
+void QueryBatchWriter::init(char* bytes, uint32_t num_queries, uint32_t emb_dim, size_t total_text_size, size_t prefix_size) {
+     this->bytes = bytes;
+     this->size = prefix_size + query_batch_size(num_queries, emb_dim, total_text_size);
+     this->num_queries = num_queries;
+     this->emb_dim = emb_dim;
+     QueryBatchHeader header = {QUERY_BATCH_MAGIC, WIRE_FORMAT_VERSION, 0, num_queries, emb_dim};
+     std::memcpy(bytes + prefix_size, &header, sizeof(header));
+     ids_offset = prefix_size + sizeof(QueryBatchHeader);
+     probe_counts_offset = ids_offset + sizeof(uint64_t) * num_queries;
+     embs_offset = probe_counts_offset + sizeof(uint32_t) * num_queries;
+     text_ends_offset = embs_offset + sizeof(float) * static_cast<size_t>(emb_dim) * num_queries;
+     text_blob_offset = text_ends_offset + sizeof(uint32_t) * num_queries;
+}
+
+void QueryBatchWriter::add(uint64_t query_id, const float* emb, std::string_view query_text, uint32_t probe_count) {
+     assert(num_added < num_queries && text_blob_offset + text_size + query_text.size() <= size);
+     std::memcpy(bytes + ids_offset + sizeof(uint64_t) * num_added, &query_id, sizeof(query_id));
+     std::memcpy(bytes + probe_counts_offset + sizeof(uint32_t) * num_added, &probe_count, sizeof(probe_count));
+     std::memcpy(bytes + embs_offset + sizeof(float) * static_cast<size_t>(emb_dim) * num_added, emb, sizeof(float) * emb_dim);
+     std::memcpy(bytes + text_blob_offset + text_size, query_text.data(), query_text.size());
+     text_size += static_cast<uint32_t>(query_text.size());
+     std::memcpy(bytes + text_ends_offset + sizeof(uint32_t) * num_added, &text_size, sizeof(text_size));
+     num_added++;
+}
+
+std::string QueryBatchWriter::take() {
+     assert(bytes == buffer.data() && num_added == num_queries && text_blob_offset + text_size == size);
+     return std::move(buffer);
+}
+
+bool QueryBatchView::parse(const uint8_t* bytes, size_t size, uint32_t expected_emb_dim) {
+     QueryBatchHeader header;
+     if (bytes == nullptr || size < sizeof(header)) {
+          return false;
+     }
+     std::memcpy(&header, bytes, sizeof(header));
+     if (header.magic != QUERY_BATCH_MAGIC || header.version != WIRE_FORMAT_VERSION || header.emb_dim != expected_emb_dim) {
+          return false;
+     }
+     // bound num_queries by the size first, so that the offsets below cannot overflow
+     size_t per_query_size = sizeof(uint64_t) + sizeof(uint32_t) + sizeof(float) * static_cast<size_t>(header.emb_dim) + sizeof(uint32_t);
+     if (header.num_queries > (size - sizeof(header)) / per_query_size) {
+          return false;
+     }
+     size_t ids_offset = sizeof(header);
+     size_t probe_counts_offset = ids_offset + sizeof(uint64_t) * header.num_queries;
+     size_t embs_offset = probe_counts_offset + sizeof(uint32_t) * header.num_queries;
+     size_t text_ends_offset = embs_offset + sizeof(float) * static_cast<size_t>(header.emb_dim) * header.num_queries;
+     size_t text_blob_offset = text_ends_offset + sizeof(uint32_t) * header.num_queries;
+     size_t text_blob_size = size - text_blob_offset;
+     // the text end offsets must be non-decreasing, and the last one must end the message
+     uint32_t prev_end = 0;
+     for (uint32_t i = 0; i < header.num_queries; i++) {
+          uint32_t end;
+          std::memcpy(&end, bytes + text_ends_offset + sizeof(uint32_t) * i, sizeof(end));
+          if (end < prev_end || end > text_blob_size) {
+               return false;
+          }
+          prev_end = end;
+     }
+     if (prev_end != text_blob_size) {
+          return false;
+     }
+     this->num_queries = header.num_queries;
+     this->emb_dim = header.emb_dim;
+     this->ids = bytes + ids_offset;
+     this->probe_counts = bytes + probe_counts_offset;
+     if (reinterpret_cast<uintptr_t>(bytes + embs_offset) % alignof(float) == 0 || header.num_queries == 0) {
+          this->embs = reinterpret_cast<const float*>(bytes + embs_offset);
+     } else {
+          this->aligned_embs.resize(static_cast<size_t>(header.emb_dim) * header.num_queries);
+          std::memcpy(this->aligned_embs.data(), bytes + embs_offset, sizeof(float) * this->aligned_embs.size());
+          this->embs = this->aligned_embs.data();
+     }
+     this->text_ends = bytes + text_ends_offset;
+     this->text_blob = reinterpret_cast<const char*>(bytes + text_blob_offset);
+     return true;
+}
+
+namespace {
+
+/*** Offset of the query batch in a cluster query bundle, aligned so that the embeddings stay float-aligned in the bundle ***/
+size_t cluster_bundle_batch_offset(uint32_t num_clusters, uint32_t num_query_indices) {
+     size_t offset = sizeof(ClusterBundleHeader) + (sizeof(int64_t) + sizeof(uint32_t)) * static_cast<size_t>(num_clusters) +
+                     sizeof(uint32_t) * static_cast<size_t>(num_query_indices);
+     return (offset + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t);
+}
+
+} // namespace
+
+size_t cluster_bundle_size(uint32_t num_clusters, uint32_t num_query_indices, uint32_t num_queries, uint32_t emb_dim, size_t total_text_size) {
+     return cluster_bundle_batch_offset(num_clusters, num_query_indices) + query_batch_size(num_queries, emb_dim, total_text_size);
+}
+
+ClusterBundleWriter::ClusterBundleWriter(uint32_t num_clusters, uint32_t num_query_indices, uint32_t num_queries, uint32_t emb_dim,
+                                         size_t total_text_size)
+     : batch_writer(num_queries, emb_dim, total_text_size, cluster_bundle_batch_offset(num_clusters, num_query_indices)),
+       num_clusters(num_clusters), num_query_indices(num_query_indices) {
+     write_header();
+}
+
+ClusterBundleWriter::ClusterBundleWriter(char* bytes, uint32_t num_clusters, uint32_t num_query_indices, uint32_t num_queries,
+                                         uint32_t emb_dim, size_t total_text_size)
+     : batch_writer(bytes, num_queries, emb_dim, total_text_size, cluster_bundle_batch_offset(num_clusters, num_query_indices)),
+       num_clusters(num_clusters), num_query_indices(num_query_indices) {
+     write_header();
+}
+
+void ClusterBundleWriter::write_header() {
+     ClusterBundleHeader header = {CLUSTER_BUNDLE_MAGIC, WIRE_FORMAT_VERSION, 0, num_clusters, num_query_indices};
+     char* bytes = batch_writer.prefix();
+     std::memcpy(bytes, &header, sizeof(header));
+     // zero the padding before the query batch
+     size_t lists_end = sizeof(header) + (sizeof(int64_t) + sizeof(uint32_t)) * static_cast<size_t>(num_clusters) +
+                        sizeof(uint32_t) * static_cast<size_t>(num_query_indices);
+     std::memset(bytes + lists_end, 0, cluster_bundle_batch_offset(num_clusters, num_query_indices) - lists_end);
+}
+
+void ClusterBundleWriter::add_cluster(long cluster_id) {
+     assert(clusters_added < num_clusters);
+     char* bytes = batch_writer.prefix() + sizeof(ClusterBundleHeader);
+     int64_t id = cluster_id;
+     std::memcpy(bytes + sizeof(int64_t) * clusters_added, &id, sizeof(id));
+     std::memcpy(bytes + sizeof(int64_t) * num_clusters + sizeof(uint32_t) * clusters_added, &query_indices_added, sizeof(uint32_t));
+     clusters_added++;
+}
+
+void ClusterBundleWriter::add_query_index(uint32_t query_index) {
+     assert(clusters_added > 0 && query_indices_added < num_query_indices);
+     char* bytes = batch_writer.prefix() + sizeof(ClusterBundleHeader);
+     char* indices = bytes + (sizeof(int64_t) + sizeof(uint32_t)) * static_cast<size_t>(num_clusters);
+     std::memcpy(indices + sizeof(uint32_t) * query_indices_added, &query_index, sizeof(query_index));
+     query_indices_added++;
+     std::memcpy(bytes + sizeof(int64_t) * num_clusters + sizeof(uint32_t) * (clusters_added - 1), &query_indices_added, sizeof(uint32_t));
+}
+
+std::string ClusterBundleWriter::take() {
+     assert(clusters_added == num_clusters && query_indices_added == num_query_indices);
+     return batch_writer.take();
+}
+
+bool is_cluster_bundle(const uint8_t* bytes, size_t size) {
+     uint32_t magic;
+     if (bytes == nullptr || size < sizeof(magic)) {
+          return false;
+     }
+     std::memcpy(&magic, bytes, sizeof(magic));
+     return magic == CLUSTER_BUNDLE_MAGIC;
+}
+
+bool ClusterBundleView::parse(const uint8_t* bytes, size_t size, uint32_t expected_emb_dim) {
+     ClusterBundleHeader header;
+     if (bytes == nullptr || size < sizeof(header)) {
+          return false;
+     }
+     std::memcpy(&header, bytes, sizeof(header));
+     if (header.magic != CLUSTER_BUNDLE_MAGIC || header.version != WIRE_FORMAT_VERSION) {
+          return false;
+     }
+     // 64-bit arithmetic, so that the offset of huge counts is larger than size instead of wrapping around
+     size_t batch_offset = cluster_bundle_batch_offset(header.num_clusters, header.num_query_indices);
+     if (batch_offset > size) {
+          return false;
+     }
+     const uint8_t* ends = bytes + sizeof(header) + sizeof(int64_t) * header.num_clusters;
+     uint32_t prev_end = 0;
+     for (uint32_t i = 0; i < header.num_clusters; i++) {
+          uint32_t end = read_uint32(ends, i);
+          if (end < prev_end || end > header.num_query_indices) {
+               return false;
+          }
+          prev_end = end;
+     }
+     if (prev_end != header.num_query_indices) {
+          return false;
+     }
+     if (!this->batch.parse(bytes + batch_offset, size - batch_offset, expected_emb_dim)) {
+          return false;
+     }
+     const uint8_t* query_indices = ends + sizeof(uint32_t) * header.num_clusters;
+     for (uint32_t j = 0; j < header.num_query_indices; j++) {
+          if (read_uint32(query_indices, j) >= this->batch.size()) {
+               return false;
+          }
+     }
+     this->num_clusters = header.num_clusters;
+     this->cluster_ids = bytes + sizeof(header);
+     this->index_ends = ends;
+     this->indices = query_indices;
+     return true;
+}
+
+std::string serialize_cluster_search_result(uint64_t query_id, uint32_t top_k, const long* I, const float* D, std::string_view query_text,
+                                            uint32_t probe_count) {
+     static_assert(sizeof(long) == sizeof(int64_t), "emb indices are sent as int64");
+     ClusterSearchResultHeader header = {CLUSTER_SEARCH_RESULT_MAGIC, WIRE_FORMAT_VERSION,
+                                         static_cast<uint16_t>(std::min<uint32_t>(probe_count, UINT16_MAX)), top_k,
+                                         static_cast<uint32_t>(query_text.size()), query_id};
+     size_t I_size = sizeof(int64_t) * top_k;
+     size_t D_size = sizeof(float) * top_k;
+     std::string buffer(sizeof(header) + I_size + D_size + query_text.size(), '\0');
+     char* bytes = buffer.data();
+     std::memcpy(bytes, &header, sizeof(header));
+     if (top_k > 0) {
+          std::memcpy(bytes + sizeof(header), I, I_size);
+          std::memcpy(bytes + sizeof(header) + I_size, D, D_size);
+     }
+     std::memcpy(bytes + sizeof(header) + I_size + D_size, query_text.data(), query_text.size());
+     return buffer;
+}
+
+bool ClusterSearchResultView::parse(const uint8_t* bytes, size_t size) {
+     ClusterSearchResultHeader header;
+     if (bytes == nullptr || size < sizeof(header)) {
+          return false;
+     }
+     std::memcpy(&header, bytes, sizeof(header));
+     if (header.magic != CLUSTER_SEARCH_RESULT_MAGIC || header.version != WIRE_FORMAT_VERSION) {
+          return false;
+     }
+     size_t results_size = (sizeof(int64_t) + sizeof(float)) * static_cast<size_t>(header.top_k);
+     if (size - sizeof(header) < header.text_size || size - sizeof(header) - header.text_size != results_size) {
+          return false;
+     }
+     this->query_id = header.query_id;
+     this->top_k = header.top_k;
+     this->probe_count = header.probe_count;
+     this->I = bytes + sizeof(header);
+     this->D = this->I + sizeof(int64_t) * header.top_k;
+     this->text = std::string_view(reinterpret_cast<const char*>(this->D + sizeof(float) * header.top_k), header.text_size);
+     return true;
+}
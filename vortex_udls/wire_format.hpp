@@ -0,0 +1,286 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/***
+* Binary formats of the objects sent between the client and the UDLs, read in place without parsing or per-query allocation.
+* All the fields are in host byte order (little endian on the supported platforms), and every message starts with
+* a magic number and WIRE_FORMAT_VERSION, so that a message of another format or version is rejected by its validator
+* instead of being misread.
+*
+* Query batch (client -> centroids search UDL -> clusters search UDL):
+*    | QueryBatchHeader | query ids (num_queries x uint64) |
+*    | probe counts (num_queries x uint32, number of clusters the query is sent to, 0 until the centroids search UDL sets it) |
+*    | embeddings (num_queries x emb_dim x float) |
+*    | text end offsets (num_queries x uint32, relative to the text blob) | text blob (query texts back to back) |
+* Cluster query bundle (centroids search UDL -> clusters search UDL), for the clusters of one shard:
+*    | ClusterBundleHeader | cluster ids (num_clusters x int64) | query index list ends (num_clusters x uint32) |
+*    | query indices (num_query_indices x uint32, index in the query batch, the lists of the clusters back to back) |
+*    | padding to 8 bytes | query batch of the queries of all the clusters |
+* Cluster search result (clusters search UDL -> aggregate UDL), for one query:
+*    | ClusterSearchResultHeader (with the probe count of the query) | I (top_k x int64) | D (top_k x float) | query text |
+***/
+
+#define WIRE_FORMAT_VERSION 2
+#define QUERY_BATCH_MAGIC 0x56514231 // "VQB1"
+#define CLUSTER_SEARCH_RESULT_MAGIC 0x56435231 // "VCR1"
+#define CLUSTER_BUNDLE_MAGIC 0x56434231 // "VCB1"
+
+struct QueryBatchHeader {
+     uint32_t magic;
+     uint16_t version;
+     uint16_t reserved;
+     uint32_t num_queries;
+     uint32_t emb_dim;
+};
+
+struct ClusterBundleHeader {
+     uint32_t magic;
+     uint16_t version;
+     uint16_t reserved;
+     uint32_t num_clusters;
+     uint32_t num_query_indices;
+};
+
+struct ClusterSearchResultHeader {
+     uint32_t magic;
+     uint16_t version;
+     uint16_t probe_count;
+     uint32_t top_k;
+     uint32_t text_size;
+     uint64_t query_id;
+};
+
+/***
+* Size in bytes of a query batch with these queries
+***/
+size_t query_batch_size(uint32_t num_queries, uint32_t emb_dim, size_t total_text_size);
+
+/***
+* Size in bytes of a cluster query bundle with these clusters and queries
+* @param num_query_indices the total number of queries of the clusters, counting a query once per cluster
+***/
+size_t cluster_bundle_size(uint32_t num_clusters, uint32_t num_query_indices, uint32_t num_queries, uint32_t emb_dim, size_t total_text_size);
+
+/***
+* Writes a query batch into a buffer allocated once with its final size, or into a caller-provided buffer.
+* Usage: QueryBatchWriter writer(nq, emb_dim, total_text_size); writer.add(...) nq times; then take() the bytes.
+***/
+class QueryBatchWriter {
+     std::string buffer;
+     char* bytes; // buffer.data(), or the caller-provided buffer
+     size_t size;
+     uint32_t num_queries;
+     uint32_t emb_dim;
+     uint32_t num_added = 0;
+     size_t ids_offset;
+     size_t probe_counts_offset;
+     size_t embs_offset;
+     size_t text_ends_offset;
+     size_t text_blob_offset;
+     uint32_t text_size = 0;
+
+     void init(char* bytes, uint32_t num_queries, uint32_t emb_dim, size_t total_text_size, size_t prefix_size);
+public:
+     /***
+     * @param total_text_size the sum of the sizes of the query texts that will be added
+     * @param prefix_size bytes reserved before the query batch, for a message that embeds it
+     ***/
+     QueryBatchWriter(uint32_t num_queries, uint32_t emb_dim, size_t total_text_size, size_t prefix_size = 0);
+
+     /***
+     * Write into bytes, which must hold prefix_size + query_batch_size() bytes and outlive the writer; take() must not be called
+     ***/
+     QueryBatchWriter(char* bytes, uint32_t num_queries, uint32_t emb_dim, size_t total_text_size, size_t prefix_size = 0);
+
+     QueryBatchWriter(const QueryBatchWriter&) = delete;
+     QueryBatchWriter& operator=(const QueryBatchWriter&) = delete;
+
+     /*** the prefix_size bytes reserved before the query batch ***/
+     char* prefix() { return bytes; }
+
+     /***
+     * Append a query; must be called exactly num_queries times
+     * @param probe_count the number of clusters the query is sent to, 0 if not chosen yet
+     ***/
+     void add(uint64_t query_id, const float* emb, std::string_view query_text, uint32_t probe_count = 0);
+
+     /*** @return the serialized query batch, the writer is left empty ***/
+     std::string take();
+};
+
+/***
+* Read-only view of a validated query batch. The view does not own the bytes, which must outlive it.
+***/
+class QueryBatchView {
+     uint32_t num_queries = 0;
+     uint32_t emb_dim = 0;
+     const uint8_t* ids = nullptr;
+     const uint8_t* probe_counts = nullptr;
+     const float* embs = nullptr;
+     const uint8_t* text_ends = nullptr;
+     const char* text_blob = nullptr;
+     std::vector<float> aligned_embs; // copy of the embeddings, only if they are not float-aligned in the bytes
+
+     uint32_t text_end(uint32_t i) const {
+          uint32_t end;
+          std::memcpy(&end, text_ends + sizeof(uint32_t) * i, sizeof(end));
+          return end;
+     }
+public:
+     /***
+     * Validate the bytes as a query batch of emb_dim embeddings, and point the view to them
+     * The embeddings are used in place if the bytes are float-aligned (e.g. a Blob allocated by Cascade), copied otherwise.
+     * @return false if the bytes are not a complete and consistent query batch of this format version and emb_dim
+     ***/
+     bool parse(const uint8_t* bytes, size_t size, uint32_t expected_emb_dim);
+
+     uint32_t size() const { return num_queries; }
+     uint32_t get_emb_dim() const { return emb_dim; }
+
+     /*** the num_queries x emb_dim embeddings, contiguous ***/
+     const float* embeddings() const { return embs; }
+     const float* embedding(uint32_t i) const { return embs + static_cast<size_t>(i) * emb_dim; }
+
+     uint64_t query_id(uint32_t i) const {
+          uint64_t id;
+          std::memcpy(&id, ids + sizeof(uint64_t) * i, sizeof(id));
+          return id;
+     }
+
+     /*** number of clusters the query is sent to, 0 if not chosen yet ***/
+     uint32_t probe_count(uint32_t i) const {
+          uint32_t count;
+          std::memcpy(&count, probe_counts + sizeof(uint32_t) * i, sizeof(count));
+          return count;
+     }
+
+     std::string_view query_text(uint32_t i) const {
+          uint32_t begin = (i == 0) ? 0 : text_end(i - 1);
+          return std::string_view(text_blob + begin, text_end(i) - begin);
+     }
+};
+
+/***
+* Writes a cluster query bundle: the clusters and the indices of their queries, then their queries through batch()
+* Usage: ClusterBundleWriter writer(...);
+*        for each cluster: writer.add_cluster(cluster_id), then writer.add_query_index(...) for each of its queries;
+*        writer.batch().add(...) num_queries times; then take() the bytes.
+***/
+class ClusterBundleWriter {
+     QueryBatchWriter batch_writer;
+     uint32_t num_clusters;
+     uint32_t num_query_indices;
+     uint32_t clusters_added = 0;
+     uint32_t query_indices_added = 0;
+
+     void write_header();
+public:
+     /*** @param num_query_indices the total number of queries of the clusters, counting a query once per cluster ***/
+     ClusterBundleWriter(uint32_t num_clusters, uint32_t num_query_indices, uint32_t num_queries, uint32_t emb_dim, size_t total_text_size);
+
+     /*** Write into bytes, which must hold cluster_bundle_size() bytes and outlive the writer; take() must not be called ***/
+     ClusterBundleWriter(char* bytes, uint32_t num_clusters, uint32_t num_query_indices, uint32_t num_queries, uint32_t emb_dim,
+                         size_t total_text_size);
+
+     /*** Start the query index list of the next cluster; must be called exactly num_clusters times ***/
+     void add_cluster(long cluster_id);
+
+     /*** Append a query to the list of the last added cluster ***/
+     void add_query_index(uint32_t query_index);
+
+     QueryBatchWriter& batch() { return batch_writer; }
+
+     std::string take();
+};
+
+/*** @return true if the bytes start as a cluster query bundle, to tell it from a query batch before validating it ***/
+bool is_cluster_bundle(const uint8_t* bytes, size_t size);
+
+/***
+* Read-only view of a validated cluster query bundle. The view does not own the bytes, which must outlive it.
+***/
+class ClusterBundleView {
+     uint32_t num_clusters = 0;
+     const uint8_t* cluster_ids = nullptr;
+     const uint8_t* index_ends = nullptr;
+     const uint8_t* indices = nullptr;
+     QueryBatchView batch;
+
+     uint32_t read_uint32(const uint8_t* array, uint32_t i) const {
+          uint32_t value;
+          std::memcpy(&value, array + sizeof(uint32_t) * i, sizeof(value));
+          return value;
+     }
+public:
+     /***
+     * @return false if the bytes are not a complete and consistent cluster query bundle of this format version and emb_dim,
+     *         with query indices within its query batch
+     ***/
+     bool parse(const uint8_t* bytes, size_t size, uint32_t expected_emb_dim);
+
+     uint32_t size() const { return num_clusters; }
+
+     long cluster_id(uint32_t i) const {
+          int64_t id;
+          std::memcpy(&id, cluster_ids + sizeof(int64_t) * i, sizeof(id));
+          return static_cast<long>(id);
+     }
+
+     /*** @param query_indices output, the indices in query_batch() of the queries of the i-th cluster ***/
+     void get_query_indices(uint32_t i, std::vector<uint32_t>& query_indices) const {
+          uint32_t begin = (i == 0) ? 0 : read_uint32(index_ends, i - 1);
+          uint32_t end = read_uint32(index_ends, i);
+          query_indices.resize(end - begin);
+          for (uint32_t j = begin; j < end; j++) {
+               query_indices[j - begin] = read_uint32(indices, j);
+          }
+     }
+
+     const QueryBatchView& query_batch() const { return batch; }
+};
+
+/***
+* Serialize the top_k results of one query in a cluster
+* @param I, D: the top_k embedding indices and distances of the query
+* @param probe_count: the number of clusters the query was sent to, i.e. of results the aggregate UDL waits for; 0 if unknown
+***/
+std::string serialize_cluster_search_result(uint64_t query_id, uint32_t top_k, const long* I, const float* D, std::string_view query_text,
+                                            uint32_t probe_count);
+
+/***
+* Read-only view of a validated cluster search result. The view does not own the bytes, which must outlive it.
+***/
+class ClusterSearchResultView {
+     uint64_t query_id = 0;
+     uint32_t top_k = 0;
+     uint32_t probe_count = 0;
+     const uint8_t* I = nullptr;
+     const uint8_t* D = nullptr;
+     std::string_view text;
+public:
+     /*** @return false if the bytes are not a complete and consistent cluster search result of this format version ***/
+     bool parse(const uint8_t* bytes, size_t size);
+
+     uint64_t get_query_id() const { return query_id; }
+     uint32_t get_top_k() const { return top_k; }
+     /*** the number of clusters the query was sent to, 0 if unknown ***/
+     uint32_t get_probe_count() const { return probe_count; }
+     std::string_view query_text() const { return text; }
+
+     long emb_index(uint32_t i) const {
+          int64_t index;
+          std::memcpy(&index, I + sizeof(int64_t) * i, sizeof(index));
+          return static_cast<long>(index);
+     }
+
+     float distance(uint32_t i) const {
+          float distance;
+          std::memcpy(&distance, D + sizeof(float) * i, sizeof(distance));
+          return distance;
+     }
+};